@@ -0,0 +1,518 @@
+#include "AsyncIo.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace {
+
+bool pwrite_all(int fd, const char* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd, data, len, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// An io_uring instance driven through the raw system calls. Every write is
+// one SQE, followed by an FSYNC SQE linked to it when asked for, so a write
+// and its fsync go to the kernel in one io_uring_enter().
+class UringQueue : public IoQueue {
+public:
+    static std::unique_ptr<UringQueue> setup(int fd, unsigned depth, std::string& error);
+    ~UringQueue() override;
+
+    uint64_t write(const char* data, size_t len, uint64_t offset, int buffer, bool sync) override;
+    void submit() override;
+    bool wait(uint64_t id) override;
+    bool register_buffers(const std::vector<std::pair<char*, size_t>>& buffers) override;
+    IoBackend backend() const override { return IoBackend::Uring; }
+
+private:
+    struct Op {
+        const char* data;
+        size_t len;
+        uint64_t offset;
+        bool written;
+        bool synced;
+        bool short_write; // Finished by hand, which cancels the linked fsync
+    };
+
+    int file_fd;
+    int ring_fd = -1;
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_len = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_len = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_entries = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    unsigned queued = 0;      // SQEs filled in but not submitted yet
+    unsigned outstanding = 0; // SQEs filled in and not completed yet
+    uint64_t next_id = 0;
+    std::unordered_map<uint64_t, Op> ops;
+    int error = 0;
+
+    explicit UringQueue(int fd) : file_fd(fd) {}
+    io_uring_sqe* next_sqe();
+    void push();
+    void make_room(unsigned sqes_needed);
+    bool enter(unsigned min_complete);
+    void reap();
+    void complete(uint64_t user_data, int res);
+    void fail(int err) {
+        if (!error) error = err;
+    }
+};
+
+std::unique_ptr<UringQueue> UringQueue::setup(int fd, unsigned depth, std::string& error) {
+    std::unique_ptr<UringQueue> q(new UringQueue(fd));
+    io_uring_params params{};
+    q->ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, std::max(depth, 2u) * 2, &params));
+    if (q->ring_fd < 0) {
+        error = std::string("io_uring_setup: ") + std::strerror(errno);
+        return nullptr;
+    }
+
+    // Plain writes and fsyncs are all this needs, but they are newer than
+    // io_uring itself.
+    std::vector<char> probe_mem(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_mem.data());
+    if (::syscall(__NR_io_uring_register, q->ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0
+        || probe->last_op < IORING_OP_WRITE
+        || !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+        || !(probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED)
+        || !(probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED)) {
+        error = "the kernel's io_uring does not support plain writes";
+        return nullptr;
+    }
+
+    q->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    q->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        q->sq_ring_len = q->cq_ring_len = std::max(q->sq_ring_len, q->cq_ring_len);
+    }
+    q->sq_ring = ::mmap(nullptr, q->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        q->ring_fd, IORING_OFF_SQ_RING);
+    if (q->sq_ring == MAP_FAILED) {
+        error = std::string("mmap: ") + std::strerror(errno);
+        return nullptr;
+    }
+    if (single_mmap) {
+        q->cq_ring = q->sq_ring;
+    } else {
+        q->cq_ring = ::mmap(nullptr, q->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            q->ring_fd, IORING_OFF_CQ_RING);
+        if (q->cq_ring == MAP_FAILED) {
+            error = std::string("mmap: ") + std::strerror(errno);
+            return nullptr;
+        }
+    }
+    q->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, q->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        q->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        error = std::string("mmap: ") + std::strerror(errno);
+        return nullptr;
+    }
+    q->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(q->sq_ring);
+    char* cq = static_cast<char*>(q->cq_ring);
+    q->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    q->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    q->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    q->sq_entries = params.sq_entries;
+    q->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    q->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    q->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    q->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return q;
+}
+
+UringQueue::~UringQueue() {
+    if (ring_fd >= 0 && sqes) {
+        wait(0);
+    }
+    if (sqes) {
+        ::munmap(sqes, sqes_len);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+        ::munmap(cq_ring, cq_ring_len);
+    }
+    if (sq_ring != MAP_FAILED) {
+        ::munmap(sq_ring, sq_ring_len);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+}
+
+io_uring_sqe* UringQueue::next_sqe() {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    return sqe;
+}
+
+void UringQueue::push() {
+    // Only this thread produces, so the tail just needs publishing
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+    ++outstanding;
+}
+
+void UringQueue::make_room(unsigned sqes_needed) {
+    // Keeping at most sq_entries SQEs in flight also keeps the completion
+    // ring, which is twice as large, from overflowing.
+    while (outstanding + sqes_needed > sq_entries) {
+        reap();
+        if (outstanding + sqes_needed <= sq_entries) {
+            break;
+        }
+        if (!enter(1)) {
+            return;
+        }
+    }
+}
+
+uint64_t UringQueue::write(const char* data, size_t len, uint64_t offset, int buffer, bool sync) {
+    make_room(2);
+    uint64_t id = ++next_id;
+    ops.emplace(id, Op{data, len, offset, len == 0, !sync, false});
+    if (len > 0) {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = buffer >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = file_fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(data);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+        sqe->buf_index = static_cast<uint16_t>(buffer >= 0 ? buffer : 0);
+        sqe->user_data = id << 1;
+        if (sync) {
+            sqe->flags |= IOSQE_IO_LINK; // The fsync only starts once the write succeeded
+        }
+        push();
+    }
+    if (sync) {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = file_fd;
+        sqe->user_data = (id << 1) | 1;
+        push();
+    }
+    return id;
+}
+
+void UringQueue::submit() {
+    if (queued > 0) {
+        enter(0);
+    }
+}
+
+bool UringQueue::enter(unsigned min_complete) {
+    while (true) {
+        unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+        long ret = ::syscall(__NR_io_uring_enter, ring_fd, queued, min_complete, flags, nullptr, 0);
+        if (ret >= 0) {
+            queued -= static_cast<unsigned>(ret);
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        // The ring is unusable; whatever is pending is lost
+        fail(errno);
+        ops.clear();
+        queued = outstanding = 0;
+        return false;
+    }
+}
+
+void UringQueue::reap() {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        uint64_t user_data = cqe.user_data;
+        int res = cqe.res;
+        ++head;
+        --outstanding;
+        complete(user_data, res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void UringQueue::complete(uint64_t user_data, int res) {
+    auto it = ops.find(user_data >> 1);
+    if (it == ops.end()) {
+        return;
+    }
+    Op& op = it->second;
+    if (user_data & 1) {
+        if (res == -ECANCELED && op.short_write) {
+            res = ::fsync(file_fd) == 0 ? 0 : -errno;
+        }
+        // A fsync cancelled because its write failed was reported already
+        if (res < 0 && res != -ECANCELED) {
+            fail(-res);
+        }
+        op.synced = true;
+    } else {
+        if (res < 0) {
+            fail(-res);
+        } else if (static_cast<size_t>(res) < op.len) {
+            op.short_write = true;
+            if (!pwrite_all(file_fd, op.data + res, op.len - res, op.offset + res)) {
+                fail(errno);
+            }
+        }
+        op.written = true;
+    }
+    if (op.written && op.synced) {
+        ops.erase(it);
+    }
+}
+
+bool UringQueue::wait(uint64_t id) {
+    submit();
+    while (true) {
+        reap();
+        if (id ? ops.count(id) == 0 : ops.empty()) {
+            break;
+        }
+        if (!enter(1)) {
+            break;
+        }
+    }
+    bool ok = error == 0;
+    if (!ok) {
+        errno = error;
+    }
+    error = 0;
+    return ok;
+}
+
+bool UringQueue::register_buffers(const std::vector<std::pair<char*, size_t>>& buffers) {
+    std::vector<iovec> iov;
+    for (const auto& buffer : buffers) {
+        iov.push_back({buffer.first, buffer.second});
+    }
+    // Fails harmlessly when the buffers exceed RLIMIT_MEMLOCK
+    return ::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+}
+
+// pwrite() and fsync() run on a small thread pool.
+class ThreadQueue : public IoQueue {
+public:
+    ThreadQueue(int fd, unsigned depth) : file_fd(fd), pool(std::max(depth / 2, 1u), depth) {}
+    ~ThreadQueue() override { wait(0); }
+
+    uint64_t write(const char* data, size_t len, uint64_t offset, int, bool sync) override {
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            id = ++next_id;
+            pending.insert(id);
+        }
+        pool.submit([this, data, len, offset, sync, id] {
+            int err = 0;
+            if (len > 0 && !pwrite_all(file_fd, data, len, offset)) {
+                err = errno;
+            } else if (sync && ::fsync(file_fd) != 0) {
+                err = errno;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            if (err && !error) {
+                error = err;
+            }
+            pending.erase(id);
+            done.notify_all();
+        });
+        return id;
+    }
+    void submit() override {}
+    bool wait(uint64_t id) override {
+        std::unique_lock<std::mutex> lock(mtx);
+        done.wait(lock, [&] { return id ? pending.count(id) == 0 : pending.empty(); });
+        bool ok = error == 0;
+        if (!ok) {
+            errno = error;
+        }
+        error = 0;
+        return ok;
+    }
+    IoBackend backend() const override { return IoBackend::Threads; }
+
+private:
+    int file_fd;
+    std::mutex mtx;
+    std::condition_variable done;
+    std::unordered_set<uint64_t> pending;
+    uint64_t next_id = 0;
+    int error = 0;
+    ThreadPool pool; // Last, so its workers stop before the rest goes away
+};
+
+} // namespace
+
+const char* io_backend_name(IoBackend backend) {
+    switch (backend) {
+        case IoBackend::Auto: return "auto";
+        case IoBackend::Uring: return "uring";
+        case IoBackend::Threads: return "threads";
+    }
+    return "unknown";
+}
+
+bool parse_io_backend(const std::string& name, IoBackend& backend) {
+    if (name == "auto") {
+        backend = IoBackend::Auto;
+    } else if (name == "uring") {
+        backend = IoBackend::Uring;
+    } else if (name == "threads") {
+        backend = IoBackend::Threads;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<IoQueue> IoQueue::create(int fd, IoBackend backend, unsigned depth) {
+    if (backend != IoBackend::Threads) {
+        std::string error;
+        if (auto ring = UringQueue::setup(fd, depth, error)) {
+            return ring;
+        }
+        if (backend == IoBackend::Uring) {
+            std::cerr << "[WARNING] io_uring is not available (" << error << "). Writing with pwrite threads instead." << std::endl;
+        }
+    }
+    return std::make_unique<ThreadQueue>(fd, depth);
+}
+
+AsyncFileBuf::AsyncFileBuf(IoBackend backend, size_t buffer_size, unsigned count)
+    : requested(backend), buffer_size(buffer_size), in_flight(std::max(count, 2u), 0) {
+    for (size_t i = 0; i < in_flight.size(); ++i) {
+        buffers.emplace_back(new char[buffer_size]);
+    }
+    setp(buffers[0].get(), buffers[0].get() + buffer_size);
+}
+
+AsyncFileBuf::~AsyncFileBuf() {
+    if (fd >= 0) {
+        close();
+    }
+}
+
+bool AsyncFileBuf::open(const std::string& path) {
+    if (fd >= 0) {
+        close();
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    queue = IoQueue::create(fd, requested, static_cast<unsigned>(in_flight.size()));
+    std::vector<std::pair<char*, size_t>> regions;
+    for (auto& buffer : buffers) {
+        regions.emplace_back(buffer.get(), buffer_size);
+    }
+    registered = queue->register_buffers(regions);
+    current = 0;
+    offset = 0;
+    failed = false;
+    setp(buffers[0].get(), buffers[0].get() + buffer_size);
+    return true;
+}
+
+void AsyncFileBuf::hand_off(bool sync) {
+    size_t len = static_cast<size_t>(pptr() - pbase());
+    if (len == 0 && !sync) {
+        return;
+    }
+    in_flight[current] = queue->write(pbase(), len, offset, registered ? static_cast<int>(current) : -1, sync);
+    queue->submit();
+    offset += len;
+    current = (current + 1) % buffers.size();
+    if (in_flight[current] != 0 && !queue->wait(in_flight[current])) {
+        failed = true;
+    }
+    in_flight[current] = 0;
+    setp(buffers[current].get(), buffers[current].get() + buffer_size);
+}
+
+AsyncFileBuf::int_type AsyncFileBuf::overflow(int_type ch) {
+    if (fd < 0) {
+        return traits_type::eof();
+    }
+    hand_off(false);
+    if (failed) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int AsyncFileBuf::sync() {
+    if (fd < 0) {
+        return -1;
+    }
+    hand_off(false);
+    return failed ? -1 : 0;
+}
+
+bool AsyncFileBuf::close() {
+    if (fd < 0) {
+        return false;
+    }
+    // The fsync linked to the last write only follows that write, so the
+    // others have to be complete first.
+    if (!queue->wait(0)) {
+        failed = true;
+    }
+    hand_off(true);
+    if (!queue->wait(0)) {
+        failed = true;
+    }
+    queue.reset();
+    if (::close(fd) != 0) {
+        failed = true;
+    }
+    fd = -1;
+    std::fill(in_flight.begin(), in_flight.end(), 0);
+    current = 0;
+    setp(buffers[0].get(), buffers[0].get() + buffer_size);
+    return !failed;
+}
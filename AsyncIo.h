@@ -0,0 +1,90 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <streambuf>
+#include <cstddef>
+#include <cstdint>
+
+// How files are written. Io_uring is used through its system calls
+// directly; the pool of pwrite() threads covers kernels and sandboxes
+// where io_uring is missing or disabled.
+enum class IoBackend : uint8_t {
+    Auto,   // io_uring if the kernel allows it, threads otherwise
+    Uring,
+    Threads
+};
+
+const char* io_backend_name(IoBackend backend);
+bool parse_io_backend(const std::string& name, IoBackend& backend);
+
+// Positional writes to one file descriptor, completed asynchronously.
+// write() only queues; submit() starts everything queued and wait() blocks
+// until writes have completed. The data of a write must stay untouched
+// until it has completed. Only one thread may use a queue at a time.
+class IoQueue {
+public:
+    virtual ~IoQueue() = default;
+
+    // Queues len bytes at offset and returns an id for wait(). buffer is
+    // the index of the registered buffer that holds data, or -1. With sync,
+    // an fsync of the file follows the write, and the write only counts as
+    // completed once that has too; with len 0, only the fsync is issued.
+    // The fsync is only ordered after this write, not after others still
+    // in flight.
+    virtual uint64_t write(const char* data, size_t len, uint64_t offset, int buffer = -1, bool sync = false) = 0;
+    virtual void submit() = 0;
+    // Waits for write id, or for every write with 0. Returns false, with
+    // errno set, if any write since the last wait() failed.
+    virtual bool wait(uint64_t id = 0) = 0;
+    // Lets writes from these buffers skip mapping them on every write.
+    // Returns false if the backend cannot, which is harmless.
+    virtual bool register_buffers(const std::vector<std::pair<char*, size_t>>& buffers) { (void)buffers; return false; }
+    virtual IoBackend backend() const = 0;
+
+    // Creates a queue of up to depth writes in flight for fd. Auto falls
+    // back to threads if io_uring cannot be set up; Uring does not.
+    static std::unique_ptr<IoQueue> create(int fd, IoBackend backend, unsigned depth = 8);
+};
+
+// Output stream buffer for a file written through an IoQueue. A full buffer
+// is handed to the queue and filling carries on in the next one, so the
+// thread producing the data only waits while every buffer is in flight.
+class AsyncFileBuf : public std::streambuf {
+public:
+    explicit AsyncFileBuf(IoBackend backend = IoBackend::Auto, size_t buffer_size = 1 << 20, unsigned buffers = 4);
+    ~AsyncFileBuf() override;
+
+    AsyncFileBuf(const AsyncFileBuf&) = delete;
+    AsyncFileBuf& operator=(const AsyncFileBuf&) = delete;
+
+    // Creates or truncates path.
+    bool open(const std::string& path);
+    bool is_open() const { return fd >= 0; }
+    // Writes out the rest, fsyncs the file behind the last write and closes
+    // it. Returns false if any write failed.
+    bool close();
+
+protected:
+    int_type overflow(int_type ch) override;
+    int sync() override;
+
+private:
+    IoBackend requested;
+    size_t buffer_size;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    std::vector<uint64_t> in_flight; // Write id per buffer, 0 while free
+    bool registered = false;
+    size_t current = 0;
+    uint64_t offset = 0;
+    int fd = -1;
+    bool failed = false;
+    std::unique_ptr<IoQueue> queue;
+
+    // Queues what the current buffer holds and moves on to the next one.
+    void hand_off(bool sync);
+};
+
+#endif // ASYNCIO_H
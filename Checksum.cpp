@@ -0,0 +1,197 @@
+#include "Checksum.h"
+#include "Encoding.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define IMKVS_HAVE_SSE42 1
+#endif
+
+namespace {
+
+std::array<uint32_t, 256> make_crc32c_table() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+uint32_t crc32c_table(const unsigned char* p, size_t len, uint32_t crc) {
+    static const std::array<uint32_t, 256> table = make_crc32c_table();
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef IMKVS_HAVE_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const unsigned char* p, size_t len, uint32_t crc) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+using Crc32cFn = uint32_t (*)(const unsigned char*, size_t, uint32_t);
+
+Crc32cFn select_crc32c() {
+#ifdef IMKVS_HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_table;
+}
+
+constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+} // namespace
+
+uint32_t crc32c(const void* data, size_t len, uint32_t crc) {
+    static const Crc32cFn impl = select_crc32c();
+    return ~impl(static_cast<const unsigned char*>(data), len, ~crc);
+}
+
+uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+    const char* p = static_cast<const char*>(data);
+    const char* const end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, get_u64(p));
+            v2 = xxh64_round(v2, get_u64(p + 8));
+            v3 = xxh64_round(v3, get_u64(p + 16));
+            v4 = xxh64_round(v4, get_u64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += static_cast<uint64_t>(len);
+    while (end - p >= 8) {
+        h ^= xxh64_round(0, get_u64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<uint64_t>(get_u32(p)) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= static_cast<uint64_t>(static_cast<unsigned char>(*p)) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        ++p;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+size_t checksum_size(ChecksumType type) {
+    switch (type) {
+        case ChecksumType::Crc32c: return 4;
+        case ChecksumType::XXH64: return 8;
+        case ChecksumType::Sha256: return 32;
+    }
+    return 0;
+}
+
+void append_checksum(ChecksumType type, const void* data, size_t len, std::string& out) {
+    switch (type) {
+        case ChecksumType::Crc32c:
+            put_u32(out, crc32c(data, len));
+            break;
+        case ChecksumType::XXH64:
+            put_u64(out, xxh64(data, len));
+            break;
+        case ChecksumType::Sha256: {
+            unsigned char digest[32];
+            sha256(data, len, digest);
+            out.append(reinterpret_cast<const char*>(digest), sizeof(digest));
+            break;
+        }
+    }
+}
+
+bool verify_checksum(ChecksumType type, const void* data, size_t len, const char* digest) {
+    switch (type) {
+        case ChecksumType::Crc32c:
+            return crc32c(data, len) == get_u32(digest);
+        case ChecksumType::XXH64:
+            return xxh64(data, len) == get_u64(digest);
+        case ChecksumType::Sha256: {
+            unsigned char computed[32];
+            sha256(data, len, computed);
+            return std::memcmp(computed, digest, sizeof(computed)) == 0;
+        }
+    }
+    return false;
+}
+
+const char* checksum_name(ChecksumType type) {
+    switch (type) {
+        case ChecksumType::Crc32c: return "crc32c";
+        case ChecksumType::XXH64: return "xxh64";
+        case ChecksumType::Sha256: return "sha256";
+    }
+    return "unknown";
+}
+
+bool parse_checksum_type(const std::string& name, ChecksumType& type) {
+    for (ChecksumType candidate : {ChecksumType::Crc32c, ChecksumType::XXH64, ChecksumType::Sha256}) {
+        if (name == checksum_name(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
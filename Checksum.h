@@ -0,0 +1,43 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Sha256.h"
+
+// Integrity checks selectable for binary snapshots. CRC-32C and XXH64 only
+// catch accidental corruption; SHA-256 also detects deliberate tampering.
+// The numeric values are stored in snapshot headers and must not change.
+enum class ChecksumType : uint8_t {
+    Crc32c = 0,
+    XXH64 = 1,
+    Sha256 = 2
+};
+
+// Size in bytes of the binary digest append_checksum() writes.
+size_t checksum_size(ChecksumType type);
+// Appends the binary digest of data to out (little-endian for the integer
+// checksums, the raw 32 bytes for SHA-256).
+void append_checksum(ChecksumType type, const void* data, size_t len, std::string& out);
+// True if digest (checksum_size(type) bytes) matches data.
+bool verify_checksum(ChecksumType type, const void* data, size_t len, const char* digest);
+
+const char* checksum_name(ChecksumType type);
+bool parse_checksum_type(const std::string& name, ChecksumType& type);
+
+// CRC-32C (Castagnoli). Pass the previous result as crc to checksum data
+// that arrives in pieces. Uses the SSE4.2 crc32 instruction when the CPU
+// has it.
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+// XXH64, the 64-bit xxHash.
+uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0);
+
+// Hash that places a key in the store: its top bits pick the partition and
+// the Merkle leaf. Merkle manifests depend on it, so it must not change.
+inline uint64_t key_hash(const std::string& key) {
+    return xxh64(key.data(), key.size());
+}
+
+#endif // CHECKSUM_H
@@ -0,0 +1,173 @@
+#include "Compression.h"
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// LZ4 block format limits: a match is at least 4 bytes, the last 5 bytes
+// are always literals and the last match starts 12 bytes before the end.
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t LAST_LITERALS = 5;
+constexpr size_t MATCH_FIND_LIMIT = 12;
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_LOG = 12;
+
+uint32_t read_u32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash_u32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+void put_length(std::string& out, size_t len) {
+    while (len >= 255) {
+        out.push_back(static_cast<char>(255));
+        len -= 255;
+    }
+    out.push_back(static_cast<char>(len));
+}
+
+void put_sequence(std::string& out, const unsigned char* literals, size_t literal_len, size_t offset, size_t match_len) {
+    const size_t match_code = match_len - MIN_MATCH;
+    unsigned char token = static_cast<unsigned char>((literal_len < 15 ? literal_len : 15) << 4);
+    token |= static_cast<unsigned char>(match_code < 15 ? match_code : 15);
+    out.push_back(static_cast<char>(token));
+    if (literal_len >= 15) {
+        put_length(out, literal_len - 15);
+    }
+    out.append(reinterpret_cast<const char*>(literals), literal_len);
+    out.push_back(static_cast<char>(offset & 0xFF));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (match_code >= 15) {
+        put_length(out, match_code - 15);
+    }
+}
+
+// Reads an extended length (the bytes following a nibble of 15). Returns
+// false if the input ends first.
+bool get_length(const unsigned char*& p, const unsigned char* end, size_t& len) {
+    unsigned char byte;
+    do {
+        if (p == end) {
+            return false;
+        }
+        byte = *p++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+} // namespace
+
+const char* compression_name(Compression compression) {
+    switch (compression) {
+        case Compression::None: return "none";
+        case Compression::Lz4: return "lz4";
+    }
+    return "unknown";
+}
+
+bool parse_compression(const std::string& name, Compression& compression) {
+    for (Compression candidate : {Compression::None, Compression::Lz4}) {
+        if (name == compression_name(candidate)) {
+            compression = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void lz4_compress(const void* data, size_t len, std::string& out) {
+    const unsigned char* in = static_cast<const unsigned char*>(data);
+    out.reserve(out.size() + len + len / 255 + 16);
+    size_t anchor = 0;
+    if (len > MATCH_FIND_LIMIT) {
+        // Positions are stored plus one so that 0 marks an empty slot
+        std::vector<uint32_t> table(size_t(1) << HASH_LOG, 0);
+        const size_t match_limit = len - MATCH_FIND_LIMIT;
+        const size_t extend_limit = len - LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < match_limit) {
+            const uint32_t sequence = read_u32(in + ip);
+            uint32_t& slot = table[hash_u32(sequence)];
+            const size_t candidate = slot;
+            slot = static_cast<uint32_t>(ip + 1);
+            if (candidate == 0 || ip - (candidate - 1) > MAX_OFFSET || read_u32(in + candidate - 1) != sequence) {
+                // Step faster through data that keeps failing to match
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            size_t ref = candidate - 1;
+            while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+                --ip;
+                --ref;
+            }
+            size_t match_len = MIN_MATCH;
+            while (ip + match_len < extend_limit && in[ip + match_len] == in[ref + match_len]) {
+                ++match_len;
+            }
+            put_sequence(out, in + anchor, ip - anchor, ip - ref, match_len);
+            ip += match_len;
+            anchor = ip;
+            if (ip - 2 < match_limit) {
+                table[hash_u32(read_u32(in + ip - 2))] = static_cast<uint32_t>(ip - 1);
+            }
+        }
+    }
+    // The block ends with a literal-only sequence
+    const size_t literal_len = len - anchor;
+    out.push_back(static_cast<char>((literal_len < 15 ? literal_len : 15) << 4));
+    if (literal_len >= 15) {
+        put_length(out, literal_len - 15);
+    }
+    out.append(reinterpret_cast<const char*>(in + anchor), literal_len);
+}
+
+bool lz4_decompress(const void* data, size_t len, char* dst, size_t dst_len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* const end = p + len;
+    size_t op = 0;
+    while (p < end) {
+        const unsigned char token = *p++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(p, end, literal_len)) {
+            return false;
+        }
+        if (literal_len > static_cast<size_t>(end - p) || literal_len > dst_len - op) {
+            return false;
+        }
+        std::memcpy(dst + op, p, literal_len);
+        p += literal_len;
+        op += literal_len;
+        if (p == end) {
+            break; // The last sequence has no match
+        }
+        if (end - p < 2) {
+            return false;
+        }
+        const size_t offset = p[0] | (static_cast<size_t>(p[1]) << 8);
+        p += 2;
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !get_length(p, end, match_len)) {
+            return false;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > dst_len - op) {
+            return false;
+        }
+        const char* match = dst + op - offset;
+        if (offset >= match_len) {
+            std::memcpy(dst + op, match, match_len);
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < match_len; ++i) {
+                dst[op + i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+    return op == dst_len;
+}
@@ -0,0 +1,27 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Block compression selectable for snapshots and the write-ahead log. The
+// numeric values are stored on disk and must not change.
+enum class Compression : uint8_t {
+    None = 0,
+    Lz4 = 1
+};
+
+const char* compression_name(Compression compression);
+bool parse_compression(const std::string& name, Compression& compression);
+
+// Appends data encoded in the LZ4 block format to out. Every call produces
+// an independent block, decodable without the ones before it. The output
+// can be slightly larger than the input for incompressible data.
+void lz4_compress(const void* data, size_t len, std::string& out);
+// Decodes one LZ4 block into exactly dst_len bytes at dst. Returns false if
+// the block is malformed or does not decode to dst_len bytes; never reads
+// or writes out of bounds.
+bool lz4_decompress(const void* data, size_t len, char* dst, size_t dst_len);
+
+#endif // COMPRESSION_H
@@ -0,0 +1,178 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#include "ValueWithTTL.h"
+
+// Little-endian and varint primitives shared by the on-disk formats
+// (snapshots and the write-ahead log).
+
+inline void put_u32(std::string& buf, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        buf.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void put_u64(std::string& buf, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        buf.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void put_varint(std::string& buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    buf.push_back(static_cast<char>(v));
+}
+
+inline void put_zigzag(std::string& buf, long long v) {
+    put_varint(buf, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+inline void put_double(std::string& buf, double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    put_u64(buf, bits);
+}
+
+inline uint32_t get_u32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return v;
+}
+
+inline uint64_t get_u64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return v;
+}
+
+// Bounds-checked reader over an encoded buffer. Every method returns false
+// instead of reading past end.
+struct Cursor {
+    const char* p;
+    const char* end;
+
+    bool varint(uint64_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            unsigned char byte = static_cast<unsigned char>(*p++);
+            v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool zigzag(long long& v) {
+        uint64_t raw;
+        if (!varint(raw)) return false;
+        v = static_cast<long long>((raw >> 1) ^ (~(raw & 1) + 1));
+        return true;
+    }
+
+    bool u8(unsigned char& v) {
+        if (p == end) return false;
+        v = static_cast<unsigned char>(*p++);
+        return true;
+    }
+
+    bool f64(double& d) {
+        if (end - p < 8) return false;
+        uint64_t bits = get_u64(p);
+        p += 8;
+        std::memcpy(&d, &bits, sizeof(d));
+        return true;
+    }
+
+    bool bytes(std::string& s, uint64_t len) {
+        if (static_cast<uint64_t>(end - p) < len) return false;
+        s.assign(p, static_cast<size_t>(len));
+        p += len;
+        return true;
+    }
+
+    bool string(std::string& s) {
+        uint64_t len;
+        return varint(len) && bytes(s, len);
+    }
+};
+
+enum : unsigned char {
+    VALUE_TYPE_STRING = 0,
+    VALUE_TYPE_INTEGER = 1,
+    VALUE_TYPE_FLOAT = 2
+};
+
+// u8 type | zigzag expiration_time_ms | value
+inline void put_value(std::string& buf, const ValueWithTTL& value) {
+    if (auto* str = std::get_if<std::string>(&value.data)) {
+        buf.push_back(static_cast<char>(VALUE_TYPE_STRING));
+        put_zigzag(buf, value.expiration_time_ms);
+        put_varint(buf, str->size());
+        buf.append(*str);
+    } else if (auto* num = std::get_if<long long>(&value.data)) {
+        buf.push_back(static_cast<char>(VALUE_TYPE_INTEGER));
+        put_zigzag(buf, value.expiration_time_ms);
+        put_zigzag(buf, *num);
+    } else {
+        buf.push_back(static_cast<char>(VALUE_TYPE_FLOAT));
+        put_zigzag(buf, value.expiration_time_ms);
+        put_double(buf, std::get<double>(value.data));
+    }
+}
+
+inline bool get_value(Cursor& cur, ValueWithTTL& value) {
+    unsigned char type;
+    if (!cur.u8(type) || !cur.zigzag(value.expiration_time_ms)) {
+        return false;
+    }
+    if (type == VALUE_TYPE_STRING) {
+        std::string str;
+        if (!cur.string(str)) return false;
+        value.data = std::move(str);
+    } else if (type == VALUE_TYPE_INTEGER) {
+        long long num;
+        if (!cur.zigzag(num)) return false;
+        value.data = num;
+    } else if (type == VALUE_TYPE_FLOAT) {
+        double d;
+        if (!cur.f64(d)) return false;
+        value.data = d;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Steps over an encoded value like get_value() without decoding it, and
+// reports its expiration.
+inline bool skip_value(Cursor& cur, long long& expiration_time_ms) {
+    unsigned char type;
+    if (!cur.u8(type) || !cur.zigzag(expiration_time_ms)) {
+        return false;
+    }
+    uint64_t n;
+    if (type == VALUE_TYPE_STRING) {
+        if (!cur.varint(n) || static_cast<uint64_t>(cur.end - cur.p) < n) return false;
+        cur.p += n;
+    } else if (type == VALUE_TYPE_INTEGER) {
+        if (!cur.varint(n)) return false;
+    } else if (type == VALUE_TYPE_FLOAT) {
+        if (cur.end - cur.p < 8) return false;
+        cur.p += 8;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#endif // ENCODING_H
@@ -0,0 +1,151 @@
+#include "JsonSnapshot.h"
+#include "Sha256.h"
+
+void append_envelopes(const std::vector<std::pair<std::string, ValueWithTTL>>& entries, std::string& out, bool& first,
+                      std::vector<size_t>* rehashed) {
+    // Hash the compact string representation of each value, exactly as
+    // the reader will recompute it. The uncached ones are hashed in one
+    // call so the values can share SIMD lanes.
+    std::vector<std::string> value_strs;
+    std::vector<Sha256Message> messages;
+    std::vector<size_t> hashed;
+    value_strs.reserve(entries.size());
+    for (const auto& pair : entries) {
+        value_strs.push_back(json(pair.second).dump());
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].second.has_digest(DigestKind::JsonValueSha256)) {
+            messages.push_back({value_strs[i].data(), value_strs[i].size()});
+            hashed.push_back(i);
+        }
+    }
+    std::vector<unsigned char> digests(32 * messages.size());
+    sha256_many(messages.data(), messages.size(), digests.data());
+    for (size_t h = 0; h < hashed.size(); ++h) {
+        entries[hashed[h]].second.cache_digest(DigestKind::JsonValueSha256, &digests[32 * h]);
+    }
+    if (rehashed) {
+        rehashed->insert(rehashed->end(), hashed.begin(), hashed.end());
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        out += first ? "\n    " : ",\n    ";
+        first = false;
+        out += json(entries[i].first).dump();
+        out += ": {\"hash\":\"";
+        out += sha256_hex(entries[i].second.digest.data());
+        out += "\",\"value\":";
+        out += value_strs[i];
+        out += '}';
+    }
+}
+
+size_t decode_envelopes(EnvelopeBatch& batch, std::vector<std::pair<std::string, ValueWithTTL>>& out,
+                        std::string& messages) {
+    std::vector<std::string> value_strs(batch.size());
+    std::vector<Sha256Message> hashed;
+    std::vector<size_t> hashed_index;
+    size_t skipped = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const auto& [key, entry_envelope] = batch[i];
+        if (!entry_envelope.is_object() || !entry_envelope.contains("value") || !entry_envelope.contains("hash")
+            || !entry_envelope["hash"].is_string()) {
+            messages += "[WARNING] Skipping malformed entry for key '" + key + "'. Missing 'value' or 'hash' field.\n";
+            ++skipped;
+            continue;
+        }
+        // Recalculate hash to verify integrity
+        value_strs[i] = entry_envelope["value"].dump();
+        hashed.push_back({value_strs[i].data(), value_strs[i].size()});
+        hashed_index.push_back(i);
+    }
+    std::vector<unsigned char> digests(32 * hashed.size());
+    sha256_many(hashed.data(), hashed.size(), digests.data());
+
+    out.reserve(out.size() + hashed.size());
+    for (size_t h = 0; h < hashed.size(); ++h) {
+        auto& [key, entry_envelope] = batch[hashed_index[h]];
+        const std::string& stored_hash = entry_envelope["hash"].get_ref<const std::string&>();
+        if (stored_hash != sha256_hex(&digests[32 * h])) {
+            messages += "[CRITICAL] TAMPERING DETECTED for key '" + key + "'. This entry will not be loaded.\n";
+            ++skipped;
+            continue;
+        }
+
+        // If the hash is valid, deserialize the value
+        try {
+            ValueWithTTL value = entry_envelope["value"].get<ValueWithTTL>();
+            value.cache_digest(DigestKind::JsonValueSha256, &digests[32 * h]);
+            out.emplace_back(std::move(key), std::move(value));
+        } catch (const json::exception& e) {
+            messages += "[WARNING] Skipping corrupted data for key '" + key + "'. Details: " + e.what() + "\n";
+            ++skipped;
+        }
+    }
+    return skipped;
+}
+
+bool EnvelopeReader::start_object(std::size_t) {
+    if (depth++ == 0) return true;
+    stack.push_back(open(json::object()));
+    return true;
+}
+
+bool EnvelopeReader::key(string_t& val) {
+    if (depth == 1) {
+        entry_key = std::move(val);
+    } else {
+        member_key = std::move(val);
+    }
+    return true;
+}
+
+bool EnvelopeReader::end_object() {
+    if (--depth == 0) return true;
+    return close();
+}
+
+bool EnvelopeReader::start_array(std::size_t) {
+    // The snapshot is a single object keyed by store key.
+    if (depth++ == 0) return false;
+    stack.push_back(open(json::array()));
+    return true;
+}
+
+bool EnvelopeReader::end_array() {
+    --depth;
+    return close();
+}
+
+json* EnvelopeReader::open(json&& val) {
+    if (stack.empty()) {
+        envelope = std::move(val);
+        return &envelope;
+    }
+    json& parent = *stack.back();
+    if (parent.is_array()) {
+        parent.push_back(std::move(val));
+        return &parent.back();
+    }
+    json& slot = parent[member_key];
+    slot = std::move(val);
+    return &slot;
+}
+
+bool EnvelopeReader::add(json&& val) {
+    if (depth == 0) return false;
+    open(std::move(val));
+    if (stack.empty()) emit();
+    return true;
+}
+
+bool EnvelopeReader::close() {
+    stack.pop_back();
+    if (stack.empty()) emit();
+    return true;
+}
+
+void EnvelopeReader::emit() {
+    on_entry(entry_key, envelope);
+    envelope = json();
+}
@@ -0,0 +1,74 @@
+#ifndef JSONSNAPSHOT_H
+#define JSONSNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstddef>
+
+#include "ValueWithTTL.h"
+
+// JSON snapshot format
+// --------------------
+// One object keyed by store key, written one envelope per line:
+//   "key": {"hash": "<hex SHA-256>", "value": {"expiration_time_ms": ..., "type": ..., "data": ...}}
+// The hash covers the compact dump of "value", so any change to it,
+// accidental or not, is detected when the file is read back.
+
+using EnvelopeBatch = std::vector<std::pair<std::string, json>>;
+
+// Appends the envelopes of entries to out, each on its own line and
+// preceded by a comma unless first is set, which it then clears. Values
+// keep their cached JsonValueSha256 digest when it is still valid; the
+// rest are hashed in one sha256_many() call, cached on the entry and their
+// indexes added to rehashed.
+void append_envelopes(const std::vector<std::pair<std::string, ValueWithTTL>>& entries, std::string& out, bool& first,
+                      std::vector<size_t>* rehashed = nullptr);
+
+// Checks the hash of every envelope in batch and decodes the value of
+// those that match into out, with the digest cached. Problems are appended
+// to messages, one line per entry, and that entry is left out. Returns the
+// number left out.
+size_t decode_envelopes(EnvelopeBatch& batch, std::vector<std::pair<std::string, ValueWithTTL>>& out,
+                        std::string& messages);
+
+// SAX handler for the JSON snapshot. Only the envelope currently being read
+// is materialised; each one is handed to on_entry as soon as it closes, so
+// memory stays bounded by the largest envelope no matter the file size.
+class EnvelopeReader : public json::json_sax_t {
+public:
+    using EntryFn = std::function<void(const std::string&, json&)>;
+
+    explicit EnvelopeReader(EntryFn fn) : on_entry(std::move(fn)) {}
+
+    bool null() override { return add(nullptr); }
+    bool boolean(bool val) override { return add(val); }
+    bool number_integer(number_integer_t val) override { return add(val); }
+    bool number_unsigned(number_unsigned_t val) override { return add(val); }
+    bool number_float(number_float_t val, const string_t&) override { return add(val); }
+    bool string(string_t& val) override { return add(std::move(val)); }
+    bool binary(binary_t& val) override { return add(json::binary(std::move(val))); }
+
+    bool start_object(std::size_t) override;
+    bool key(string_t& val) override;
+    bool end_object() override;
+    bool start_array(std::size_t) override;
+    bool end_array() override;
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override { return false; }
+
+private:
+    json* open(json&& val);
+    bool add(json&& val);
+    bool close();
+    void emit();
+
+    EntryFn on_entry;
+    std::size_t depth = 0;
+    std::vector<json*> stack;
+    json envelope;
+    std::string entry_key;
+    std::string member_key;
+};
+
+#endif // JSONSNAPSHOT_H
@@ -3,7 +3,19 @@
 #include <sstream>
 #include <iostream>
 #include <chrono>
-#include "picosha2.h"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <functional>
+#include <filesystem>
+#include <cstdio>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Sha256.h"
+#include "ThreadPool.h"
+#include "JsonSnapshot.h"
 
 using json = nlohmann::json;
 
@@ -17,6 +29,9 @@ void to_json(json& j, const ValueWithTTL& v) {
         } else if constexpr (std::is_same_v<T, long long>) {
             j["type"] = "integer";
             j["data"] = arg; 
+        } else if constexpr (std::is_same_v<T, double>) {
+            j["type"] = "float";
+            j["data"] = arg;
         }
     }, v.data);
 }
@@ -28,6 +43,8 @@ void from_json(const json& j, ValueWithTTL& v) {
         v.data = j.at("data").get<std::string>(); 
     } else if (type == "integer") {
         v.data = j.at("data").get<long long>(); 
+    } else if (type == "float") {
+        v.data = j.at("data").get<double>();
     }
 }
 
@@ -37,227 +54,1172 @@ long long getCurrentTimeMillis() {
     ).count();
 }
 
-void KeyValueStore::set(const std::string& key, const std::string& value, long long ttl_ms) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    long long expiration_time = -1;
-    if (ttl_ms > 0) {
-        expiration_time = getCurrentTimeMillis() + ttl_ms;
+size_t KeyValueStore::partition_of(const std::string& key) {
+    return partition_index(key_hash(key));
+}
+
+KeyValueStore::~KeyValueStore() {
+    stop_migration();
+    stop_autosave();
+    wait_for_background_save();
+}
+
+static std::string value_to_string(const ValueWithTTL& entry) {
+    return std::visit([](auto&& arg) {
+        using T = std::decay_t<decltype(arg)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+            return arg;
+        } else if constexpr (std::is_same_v<T, long long>) {
+            return std::to_string(arg);
+        } else if constexpr (std::is_same_v<T, double>) {
+            char buf[32];
+            auto res = std::to_chars(buf, buf + sizeof(buf), arg);
+            return std::string(buf, res.ptr);
+        }
+    }, entry.data);
+}
+
+// Flushes a file, or a directory's entries, to stable storage.
+static bool fsync_path(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+static std::string parent_directory(const std::string& path) {
+    std::string parent = std::filesystem::path(path).parent_path().string();
+    return parent.empty() ? "." : parent;
+}
+
+static std::string delta_filename(const std::string& base, uint32_t sequence) {
+    return base + ".delta." + std::to_string(sequence);
+}
+
+// Deletes every delta snapshot of base, e.g. once a new base replaces them.
+static void remove_deltas(const std::string& base) {
+    const std::string prefix = std::filesystem::path(base).filename().string() + ".delta.";
+    std::error_code ec;
+    for (const auto& item : std::filesystem::directory_iterator(parent_directory(base), ec)) {
+        if (item.path().filename().string().rfind(prefix, 0) == 0) {
+            std::filesystem::remove(item.path(), ec);
+        }
+    }
+}
+
+// Records the outcome of a deferred block check, warning the first time a
+// block turns out to be damaged.
+static void settle_block(const MappedSnapshot& file, uint32_t block, bool intact) {
+    file.mark_block(block, intact);
+    if (!intact) {
+        std::cerr << "[CRITICAL] Checksum mismatch in block " << block + 1 << " of " << file.path()
+                  << (file.integrity().per_entry ? ". Its damaged entries are quarantined." : ". Its entries are quarantined.")
+                  << std::endl;
+    }
+}
+
+// Decodes an entry of a mapped snapshot, checking its block first if that
+// was deferred. Fails for entries of a damaged block unless they carry a
+// checksum of their own that still matches.
+static bool decode_cold(const MappedSnapshot::EntryRef& ref, ValueWithTTL& value) {
+    const MappedSnapshot& file = *ref.file;
+    if (file.block_state(ref.block) == MappedSnapshot::BlockState::Unchecked) {
+        settle_block(file, ref.block, file.check_block(ref.block));
+    }
+    bool intact = file.block_state(ref.block) == MappedSnapshot::BlockState::Intact;
+    if (!intact && !file.integrity().per_entry) {
+        return false;
     }
-    ValueWithTTL entry = {value, expiration_time};
+    return MappedSnapshot::decode(ref, value, !intact);
+}
+
+static uint64_t new_base_id() {
+    std::random_device rd;
+    uint64_t id = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^ static_cast<uint64_t>(getCurrentTimeMillis());
+    return id ? id : 1;
+}
+
+static long long expiration_from_ttl(long long ttl_ms) {
+    return ttl_ms > 0 ? getCurrentTimeMillis() + ttl_ms : -1;
+}
+
+const ValueWithTTL* KeyValueStore::lookup(const std::string& key) {
     if (in_trxn) {
-        trxn_data[key] = entry;
-    } else {
-        data[key] = entry;
+        if (auto staged = trxn_data.find(key)) {
+            return staged->has_value() ? &**staged : nullptr;
+        }
+    }
+    size_t p = partition_of(key);
+    materialize(p, key);
+    Partition& part = partitions[p];
+    auto it = part.find(key);
+    if (it == part.end()) {
+        return nullptr;
+    }
+    if (it->second.is_expired()) {
+        // Not a change: saved, the entry would have expired just the same
+        if (snap.active && !snap.copied[p]) {
+            preserve(p, key);
+        }
+        part.erase(it);
+        return nullptr;
     }
+    return &it->second;
 }
 
-std::optional<std::string> KeyValueStore::get(const std::string& key) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
+void KeyValueStore::store_entry(const std::string& key, ValueWithTTL entry) {
+    entry.version = ++next_version;
     if (in_trxn) {
-        auto it = trxn_data.find(key);
-        if (it != trxn_data.end()) {
-            if (!it->second.has_value()) return std::nullopt;
-            return std::visit([](auto&& arg) {
-                using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, std::string>) {
-                    return arg;
-                } else if constexpr (std::is_same_v<T, long long>) {
-                    return std::to_string(arg);
-                }
-            }, it->second->data);
+        trxn_data.put(key, std::move(entry));
+        return;
+    }
+    if (logging()) {
+        LogRecord record;
+        record.key = key;
+        record.value = entry;
+        if (!log_record(record)) {
+            return;
         }
     }
-    auto it = data.find(key);
-    if (it != data.end()) {
-        if (it->second.is_expired()) {
-            data.erase(it);
-            return std::nullopt;
+    size_t p = partition_of(key);
+    before_write(p, key);
+    release_quarantined(key);
+    partitions[p][key] = std::move(entry);
+}
+
+bool KeyValueStore::erase_entry(const std::string& key) {
+    if (in_trxn) {
+        trxn_data.put(key, std::nullopt);
+        return true;
+    }
+    size_t p = partition_of(key);
+    materialize(p, key);
+    if (!partitions[p].count(key)) {
+        release_quarantined(key);
+        return false;
+    }
+    if (logging()) {
+        LogRecord record;
+        record.type = LogRecord::REMOVE;
+        record.key = key;
+        if (!log_record(record)) {
+            return false;
         }
-        return std::visit([](auto&& arg) {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, std::string>) {
-                return arg;
-            } else if constexpr (std::is_same_v<T, long long>) {
-                return std::to_string(arg);
+    }
+    before_write(p, key);
+    release_quarantined(key);
+    partitions[p].erase(key);
+    return true;
+}
+
+KeyValueStore::WriteGuard::WriteGuard(KeyValueStore& store) : store(store), lock(store.mtx), outer(store.write_guard) {
+    store.write_guard = this;
+}
+
+KeyValueStore::WriteGuard::~WriteGuard() {
+    if (lock.owns_lock() && !release()) {
+        store.write_error = true;
+    }
+}
+
+bool KeyValueStore::WriteGuard::release() {
+    WriteAheadLog* log = store.wal.get();
+    store.write_guard = outer;
+    lock.unlock();
+    // An outer guard waits for it instead
+    if (outer) {
+        outer->seq = std::max(outer->seq, seq);
+        return true;
+    }
+    return seq == 0 || log->wait_durable(seq);
+}
+
+uint64_t KeyValueStore::log_record(const LogRecord& record) {
+    uint64_t seq = wal->append(record);
+    if (seq == 0) {
+        write_error = true;
+    } else if (write_guard) {
+        write_guard->logged(seq);
+    }
+    return seq;
+}
+
+bool KeyValueStore::write_failed() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return write_error.exchange(false) || (wal && wal->failed());
+}
+
+void KeyValueStore::replay_record(LogRecord& record, ReplayTally& tally) {
+    size_t p = partition_of(record.key);
+    Partition& part = partitions[p];
+    // The record replaces the whole entry, so a cold one is never decoded
+    if (cold_entries && cold[p].erase(record.key)) {
+        ++tally.cold_dropped;
+    }
+    if (warm) {
+        warm->drop(p, record.key);
+    }
+    ++tally.changes;
+    if (delta.enabled) {
+        delta.dirty[p].insert(record.key);
+    }
+    switch (record.type) {
+        case LogRecord::SET:
+        case LogRecord::INCRBY:
+        case LogRecord::INCRBYFLOAT:
+            part.insert_or_assign(std::move(record.key), std::move(record.value));
+            break;
+        case LogRecord::REMOVE:
+            part.erase(record.key);
+            break;
+        case LogRecord::COMMIT:
+        case LogRecord::TRANSACTION:
+            break;
+    }
+}
+
+bool KeyValueStore::open_log(const std::string& path, FsyncPolicy policy, Compression compression) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    wal.reset();
+    write_error = false;
+
+    // Records are read, checked and versioned in log order on this thread,
+    // and applied a round at a time by the pool while the next round is
+    // read. Worker g owns the partitions p with p % groups == g. A
+    // transaction reaches apply only once its whole record has been read and
+    // checked, so a torn one never takes effect. With a single
+    // core, handing records over would only add to the work.
+    constexpr size_t REPLAY_ROUND = 16384;
+    const size_t groups = replay_threads ? replay_threads : ThreadPool::default_size();
+    std::unique_ptr<ThreadPool> pool;
+    if (groups > 1) {
+        pool = std::make_unique<ThreadPool>(groups);
+    }
+    std::vector<std::vector<LogRecord>> filling(groups), applying(groups);
+    std::vector<ReplayTally> tallies(groups);
+    size_t buffered = 0;
+    auto dispatch = [&] {
+        if (!pool) {
+            return;
+        }
+        pool->wait();
+        std::swap(filling, applying);
+        for (size_t g = 0; g < groups; ++g) {
+            if (!applying[g].empty()) {
+                pool->submit([this, &batch = applying[g], &tally = tallies[g]] {
+                    for (auto& record : batch) {
+                        replay_record(record, tally);
+                    }
+                    batch.clear();
+                });
             }
-        }, it->second.data);
+        }
+        buffered = 0;
+    };
+    auto apply = [&](LogRecord& record) {
+        record.value.version = ++next_version;
+        if (!pool) {
+            replay_record(record, tallies[0]);
+            return;
+        }
+        filling[partition_of(record.key) % groups].push_back(std::move(record));
+        if (++buffered == REPLAY_ROUND) {
+            dispatch();
+        }
+    };
+    bool replayed = WriteAheadLog::replay(path, apply);
+    dispatch();
+    if (pool) {
+        pool->wait();
+    }
+    for (const auto& tally : tallies) {
+        changes += tally.changes;
+        cold_entries -= tally.cold_dropped;
+    }
+    if (cold_entries == 0) {
+        mappings.clear();
+    }
+    if (warm && warm->entries() == 0) {
+        warm.reset();
+    }
+    if (!replayed) {
+        return false;
+    }
+    wal = std::make_unique<WriteAheadLog>(path, policy, compression, io_backend);
+    wal->set_auto_compact(log_rewrite_growth, log_rewrite_min_bytes);
+    return wal->is_open();
+}
+
+void KeyValueStore::set_io_backend(IoBackend backend) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    io_backend = backend;
+}
+
+void KeyValueStore::set_replay_threads(size_t threads) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    replay_threads = threads;
+}
+
+bool KeyValueStore::rewrite_log() {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    return wal && wal->compact();
+}
+
+bool KeyValueStore::rewrite_log_background() {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    return wal && wal->compact_in_background();
+}
+
+void KeyValueStore::set_log_rewrite(unsigned growth_percent, uint64_t min_bytes) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    log_rewrite_growth = growth_percent;
+    log_rewrite_min_bytes = min_bytes;
+    if (wal) {
+        wal->set_auto_compact(growth_percent, min_bytes);
+    }
+}
+
+uint64_t KeyValueStore::log_size() const {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    return wal ? wal->size() : 0;
+}
+
+bool KeyValueStore::checkpoint(const std::string& filename) {
+    return write_snapshot(filename, SnapshotFormat::Binary, true);
+}
+
+bool KeyValueStore::save_background(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(background_mtx);
+    if (background_running) {
+        return false;
+    }
+    if (background_save.joinable()) {
+        background_save.join();
+    }
+    background_running = true;
+    background_save = std::thread([this, filename] {
+        checkpoint(filename);
+        std::lock_guard<std::mutex> done(background_mtx);
+        background_running = false;
+    });
+    return true;
+}
+
+void KeyValueStore::wait_for_background_save() {
+    std::thread running;
+    {
+        std::lock_guard<std::mutex> lock(background_mtx);
+        running = std::move(background_save);
+    }
+    if (running.joinable()) {
+        running.join();
+    }
+}
+
+void KeyValueStore::set(const std::string& key, const std::string& value, long long ttl_ms) {
+    WriteGuard guard(*this);
+    store_entry(key, {value, expiration_from_ttl(ttl_ms)});
+}
+
+std::optional<std::string> KeyValueStore::get(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if (const ValueWithTTL* entry = lookup(key)) {
+        return value_to_string(*entry);
     }
     return std::nullopt;
 }
 
+bool KeyValueStore::setnx(const std::string& key, const std::string& value, long long ttl_ms) {
+    WriteGuard guard(*this);
+    if (lookup(key)) {
+        return false;
+    }
+    store_entry(key, {value, expiration_from_ttl(ttl_ms)});
+    return true;
+}
 
-std::optional<long long> perform_op(std::optional<ValueWithTTL>& entry, const std::string& op) {
-    if (!entry.has_value() || entry->is_expired()) {
-        long long start_val = (op == "INCR") ? 1LL : -1LL;
-        entry = {start_val, -1};
-        return start_val;
+bool KeyValueStore::setxx(const std::string& key, const std::string& value, long long ttl_ms) {
+    WriteGuard guard(*this);
+    if (!lookup(key)) {
+        return false;
     }
+    store_entry(key, {value, expiration_from_ttl(ttl_ms)});
+    return true;
+}
+
+std::optional<std::string> KeyValueStore::getset(const std::string& key, const std::string& value, long long ttl_ms) {
+    WriteGuard guard(*this);
+    std::optional<std::string> old_value;
+    if (const ValueWithTTL* entry = lookup(key)) {
+        old_value = value_to_string(*entry);
+    }
+    store_entry(key, {value, expiration_from_ttl(ttl_ms)});
+    return old_value;
+}
+
+std::optional<std::string> KeyValueStore::getdel(const std::string& key) {
+    WriteGuard guard(*this);
+    const ValueWithTTL* entry = lookup(key);
+    if (!entry) {
+        return std::nullopt;
+    }
+    std::string old_value = value_to_string(*entry);
+    erase_entry(key);
+    return old_value;
+}
 
-    long long new_value;
-    bool success = false;
+bool KeyValueStore::cas(const std::string& key, const std::string& expected, const std::string& desired, long long ttl_ms) {
+    WriteGuard guard(*this);
+    const ValueWithTTL* entry = lookup(key);
+    if (!entry || value_to_string(*entry) != expected) {
+        return false;
+    }
+    store_entry(key, {desired, expiration_from_ttl(ttl_ms)});
+    return true;
+}
+
+std::optional<unsigned long long> KeyValueStore::version(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if (const ValueWithTTL* entry = lookup(key)) {
+        return entry->version;
+    }
+    return std::nullopt;
+}
+
+bool KeyValueStore::cas_version(const std::string& key, unsigned long long expected_version, const std::string& desired, long long ttl_ms) {
+    WriteGuard guard(*this);
+    const ValueWithTTL* entry = lookup(key);
+    if (!entry || entry->version != expected_version) {
+        return false;
+    }
+    store_entry(key, {desired, expiration_from_ttl(ttl_ms)});
+    return true;
+}
+
+
+// Parses the whole of str as a number of type T; trailing junk is rejected.
+template <typename T>
+static std::optional<T> parse_number(const std::string& str) {
+    T val{};
+    auto res = std::from_chars(str.data(), str.data() + str.size(), val);
+    if (res.ec != std::errc() || res.ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+    return val;
+}
+
+static bool add_overflows(long long a, long long b) {
+    return (b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b);
+}
+
+// Adds delta to an entry in place. The arithmetic is chosen at compile time
+// from the delta type: long long for INCRBY/DECRBY, double for INCRBYFLOAT.
+// A missing or expired entry starts from zero. Returns std::nullopt (leaving
+// the entry untouched) if the value is not a number of a compatible type or
+// the result would overflow.
+template <typename D>
+std::optional<D> perform_op(ValueWithTTL& entry, bool existed, D delta) {
+    if (!existed) {
+        entry = {delta, -1};
+        return delta;
+    }
+
+    std::optional<D> result;
     std::visit([&](auto& arg) {
         using T = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_same_v<T, long long>) {
-            new_value = (op == "INCR") ? ++arg : --arg;
-            success = true;
-        } else if constexpr (std::is_same_v<T, std::string>) {
-            try {
-                long long val = std::stoll(arg);
-                new_value = (op == "INCR") ? ++val : --val;
-                entry->data = new_value; 
-                success = true;
-            } catch (...) {
-                success = false;
+        if constexpr (std::is_same_v<D, long long>) {
+            std::optional<long long> current;
+            if constexpr (std::is_same_v<T, long long>) {
+                current = arg;
+            } else if constexpr (std::is_same_v<T, std::string>) {
+                current = parse_number<long long>(arg);
+            }
+            if (current && !add_overflows(*current, delta)) {
+                result = *current + delta;
+            }
+        } else {
+            std::optional<double> current;
+            if constexpr (std::is_same_v<T, std::string>) {
+                current = parse_number<double>(arg);
+            } else {
+                current = static_cast<double>(arg);
+            }
+            if (current && std::isfinite(*current + delta)) {
+                result = *current + delta;
             }
         }
-    }, entry->data);
+    }, entry.data);
 
-    if (success) {
-        return new_value;
+    if (result.has_value()) {
+        entry.data = *result;
     }
-    return std::nullopt;
+    return result;
 }
 
 
 std::optional<long long> KeyValueStore::incr(const std::string& key) {
+    return incrby(key, 1);
+}
+
+std::optional<long long> KeyValueStore::decr(const std::string& key) {
+    return incrby(key, -1);
+}
+
+std::optional<long long> KeyValueStore::incrby(const std::string& key, long long delta) {
+    WriteGuard guard(*this);
+    std::optional<long long> result;
+    ValueWithTTL* entry = update_entry(key, [&](ValueWithTTL& entry, bool existed) {
+        result = perform_op(entry, existed, delta);
+        return result.has_value();
+    });
+    if (entry && logging()) {
+        LogRecord record;
+        record.type = LogRecord::INCRBY;
+        record.key = key;
+        record.delta = delta;
+        record.value = *entry;
+        log_record(record);
+    }
+    return result;
+}
+
+std::optional<long long> KeyValueStore::decrby(const std::string& key, long long delta) {
+    if (delta == LLONG_MIN) {
+        return std::nullopt;
+    }
+    return incrby(key, -delta);
+}
+
+std::optional<double> KeyValueStore::incrbyfloat(const std::string& key, double delta) {
+    if (!std::isfinite(delta)) {
+        return std::nullopt;
+    }
+    WriteGuard guard(*this);
+    std::optional<double> result;
+    ValueWithTTL* entry = update_entry(key, [&](ValueWithTTL& entry, bool existed) {
+        result = perform_op(entry, existed, delta);
+        return result.has_value();
+    });
+    if (entry && logging()) {
+        LogRecord record;
+        record.type = LogRecord::INCRBYFLOAT;
+        record.key = key;
+        record.fdelta = delta;
+        record.value = *entry;
+        log_record(record);
+    }
+    return result;
+}
+
+size_t KeyValueStore::append(const std::string& key, const std::string& suffix) {
+    size_t length = 0;
+    update(key, [&](ValueWithTTL& entry, bool existed) {
+        if (!existed) {
+            entry = {suffix, -1};
+        } else if (auto* str = std::get_if<std::string>(&entry.data)) {
+            str->append(suffix);
+        } else {
+            entry.data = value_to_string(entry) + suffix;
+        }
+        length = std::get<std::string>(entry.data).size();
+        return true;
+    });
+    return length;
+}
+
+void KeyValueStore::preserve(size_t p, const std::string& key) {
+    auto& preserved = snap.preserved[p];
+    if (preserved.count(key)) {
+        return; // Already holds the value from when the snapshot began
+    }
+    const Partition& part = partitions[p];
+    auto it = part.find(key);
+    if (it != part.end()) {
+        preserved.emplace(key, it->second);
+    } else {
+        preserved.emplace(key, std::nullopt);
+    }
+}
+
+void KeyValueStore::start_snapshot() const {
+    snap.active = true;
+    snap.copied.fill(false);
+}
+
+void KeyValueStore::copy_partition(size_t p, SnapshotChunk& out) const {
+    out.clear();
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    if (in_trxn) {
-        std::optional<ValueWithTTL> current_val = std::nullopt;
-        
-        if (trxn_data.count(key)) {
-            current_val = trxn_data.at(key);
-        } else if (data.count(key)) {
-            current_val = data.at(key);
+    const Partition& part = partitions[p];
+    auto& preserved = snap.preserved[p];
+    out.reserve(part.size() + preserved.size());
+    for (const auto& pair : part) {
+        if (!preserved.empty() && preserved.count(pair.first)) {
+            continue; // Changed since the snapshot began, taken from preserved below
+        }
+        if (!pair.second.is_expired()) {
+            out.emplace_back(pair);
         }
-        auto result = perform_op(current_val, "INCR");
-        if (result.has_value()) {
-            trxn_data[key] = current_val; 
+    }
+    for (auto& pair : preserved) {
+        if (pair.second.has_value() && !pair.second->is_expired()) {
+            out.emplace_back(pair.first, std::move(*pair.second));
         }
-        return result;
     }
-    
-    std::optional<ValueWithTTL> entry = std::nullopt;
-    if (data.count(key)) {
-        entry = data.at(key);
+    // Keys still cold are decoded for the copy only; they stay cold unless
+    // they fail, and then they are quarantined as on first use
+    for (auto it = cold[p].begin(); it != cold[p].end();) {
+        auto next = std::next(it);
+        ValueWithTTL value;
+        if (!decode_cold(it->second, value)) {
+            quarantine_cold(p, it);
+        } else if (!value.is_expired()) {
+            out.emplace_back(it->first, std::move(value));
+        }
+        it = next;
     }
-    auto result = perform_op(entry, "INCR");
-    if (result.has_value()) {
-        data[key] = entry.value(); 
+    if (warm) {
+        warm->visit(p, [&](std::string& key, ValueWithTTL& value) {
+            if (!value.is_expired()) {
+                out.emplace_back(key, std::move(value));
+            }
+        });
     }
-    return result;
+    preserved.clear();
+    snap.copied[p] = true;
 }
 
-std::optional<long long> KeyValueStore::decr(const std::string& key) {
+void KeyValueStore::copy_changed(size_t p, SnapshotChunk& out) const {
+    out.clear();
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    if (in_trxn) {
-        std::optional<ValueWithTTL> current_val = std::nullopt;
-        if (trxn_data.count(key)) {
-            current_val = trxn_data.at(key);
-        } else if (data.count(key)) {
-            current_val = data.at(key);
+    const Partition& part = partitions[p];
+    auto& preserved = snap.preserved[p];
+    ValueWithTTL tombstone;
+    tombstone.expiration_time_ms = SNAPSHOT_TOMBSTONE_EXPIRATION;
+    out.reserve(delta.writing[p].size());
+    for (const std::string& key : delta.writing[p]) {
+        const ValueWithTTL* value = nullptr;
+        auto kept = preserved.find(key);
+        if (kept != preserved.end()) {
+            value = kept->second ? &*kept->second : nullptr;
+        } else {
+            auto it = part.find(key);
+            value = it != part.end() ? &it->second : nullptr;
         }
-        auto result = perform_op(current_val, "DECR");
-        if (result.has_value()) {
-            trxn_data[key] = current_val;
+        if (value && !value->is_expired()) {
+            out.emplace_back(key, *value);
+        } else {
+            out.emplace_back(key, tombstone);
         }
-        return result;
     }
+    preserved.clear();
+    snap.copied[p] = true;
+}
 
-    std::optional<ValueWithTTL> entry = std::nullopt;
-    if (data.count(key)) {
-        entry = data.at(key);
-    }
-    auto result = perform_op(entry, "DECR");
-    if (result.has_value()) {
-        data[key] = entry.value();
+void KeyValueStore::finish_snapshot() const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    snap.active = false;
+    for (auto& preserved : snap.preserved) {
+        preserved.clear();
     }
-    return result;
 }
 
-bool KeyValueStore::save(const std::string& filename) const {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "ERROR: Could not open file for writing: " << filename << std::endl;
+void KeyValueStore::set_snapshot_integrity(SnapshotIntegrity integrity) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    snapshot_integrity = integrity;
+}
+
+void KeyValueStore::set_snapshot_compression(Compression compression) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    snapshot_compression = compression;
+}
+
+bool KeyValueStore::save(const std::string& filename, SnapshotFormat format) const {
+    return write_snapshot(filename, format, false);
+}
+
+bool KeyValueStore::write_snapshot(const std::string& filename, SnapshotFormat format, bool checkpoint) const {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    const long long started_ms = getCurrentTimeMillis();
+    // Checkpoints in delta mode extend the chain while it is short and small
+    // next to its base, and start a new base otherwise.
+    const bool chained = checkpoint && delta.enabled && format == SnapshotFormat::Binary;
+    const bool as_delta = chained && delta.base_id != 0 && delta.sequence < delta.max_chain
+        && delta.delta_bytes < delta.base_bytes / 2;
+    SnapshotChain chain;
+    if (chained) {
+        chain = as_delta ? SnapshotChain{delta.base_id, delta.sequence + 1} : SnapshotChain{new_base_id(), 0};
+    }
+    const std::string target = as_delta ? delta_filename(filename, chain.sequence) : filename;
+
+    // Written beside the target and renamed over it once durable, so a crash
+    // mid-save leaves the previous snapshot intact.
+    const std::string temp_filename = target + ".tmp";
+    AsyncFileBuf buffer(io_backend);
+    std::ostream file(&buffer);
+    if (!buffer.open(temp_filename)) {
+        std::cerr << "ERROR: Could not open file for writing: " << temp_filename << std::endl;
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        last_save_ok = false;
+        last_save_duration_ms = getCurrentTimeMillis() - started_ms;
         return false;
     }
+    unsigned long long changes_at_start;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        start_snapshot();
+        changes_at_start = changes;
+        // The snapshot covers exactly the records logged so far. They move to
+        // the log's archive, which is dropped once the snapshot is complete.
+        if (checkpoint && wal && !wal->rotate()) {
+            snap.active = false;
+            buffer.close();
+            std::remove(temp_filename.c_str());
+            last_save_ok = false;
+            last_save_duration_ms = getCurrentTimeMillis() - started_ms;
+            return false;
+        }
+        // Writes from here on belong to the next checkpoint
+        if (chained) {
+            for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+                delta.writing[p].swap(delta.dirty[p]);
+            }
+        }
+    }
 
-    json final_json = json::object(); // Start with an empty JSON object
+    bool ok = (format == SnapshotFormat::Binary) ? save_binary(file, chain, as_delta) : save_json(file);
+    bool written = buffer.close(); // Also fsyncs the file
+    ok = ok && !file.fail() && written;
+    finish_snapshot();
 
-    for (const auto& pair : data) {
-        if (pair.second.is_expired()) {
-            continue; // Don't save expired keys
+    if (ok && !(std::rename(temp_filename.c_str(), target.c_str()) == 0 && fsync_path(parent_directory(target)))) {
+        std::cerr << "ERROR: Could not make snapshot durable: " << target << std::endl;
+        ok = false;
+    }
+    if (!ok) {
+        std::remove(temp_filename.c_str());
+    }
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        const long long finished_ms = getCurrentTimeMillis();
+        last_save_ok = ok;
+        last_save_duration_ms = finished_ms - started_ms;
+        if (ok) {
+            last_save_ms = finished_ms;
+            saved_changes = changes_at_start;
+        }
+        if (chained) {
+            // A failed checkpoint hands its keys back to the next one
+            for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+                if (!ok) {
+                    delta.dirty[p].insert(delta.writing[p].begin(), delta.writing[p].end());
+                }
+                delta.writing[p].clear();
+            }
         }
+    }
 
-        // Create a JSON object for the value part
-        json value_j = pair.second;
-        std::string value_str = value_j.dump();
+    if (ok && chained) {
+        std::error_code ec;
+        uint64_t bytes = std::filesystem::file_size(target, ec);
+        if (as_delta) {
+            delta.sequence = chain.sequence;
+            delta.delta_bytes += bytes;
+        } else {
+            delta.base_id = chain.base_id;
+            delta.sequence = 0;
+            delta.base_bytes = bytes;
+            delta.delta_bytes = 0;
+        }
+    }
+    if (ok && delta.enabled && !chained) {
+        delta.base_id = 0; // May have replaced the base, so the next checkpoint writes a new one
+    }
+    if (ok && checkpoint && !as_delta) {
+        remove_deltas(filename); // Folded into the new base
+    }
+    if (ok && checkpoint && wal) {
+        wal->drop_archive();
+    }
+    return ok;
+}
 
-        // Hash the string representation of the value
-        std::string hash_hex_str;
-        picosha2::hash256_hex_string(value_str, hash_hex_str);
+void KeyValueStore::set_delta_snapshots(bool enabled, size_t max_chain) {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if (delta.enabled != enabled) {
+        // Changes were not tracked so far, so the next checkpoint starts a new base
+        delta.base_id = 0;
+        delta.sequence = 0;
+        for (auto& keys : delta.dirty) {
+            keys.clear();
+        }
+    }
+    delta.enabled = enabled;
+    delta.max_chain = max_chain;
+}
 
-        // Create the per-entry envelope
-        json entry_envelope;
-        entry_envelope["value"] = value_j;
-        entry_envelope["hash"] = hash_hex_str;
+KeyValueStore::SaveStats KeyValueStore::save_stats() const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    SaveStats stats;
+    stats.last_save_ms = last_save_ms;
+    stats.last_save_duration_ms = last_save_duration_ms;
+    stats.last_save_ok = last_save_ok;
+    stats.changes_since_save = changes - saved_changes;
+    return stats;
+}
 
-        // Add it to our final JSON object
-        final_json[pair.first] = entry_envelope;
+void KeyValueStore::set_autosave(const std::string& filename, std::vector<SaveRule> rules) {
+    stop_autosave();
+    if (rules.empty()) {
+        return;
     }
+    std::lock_guard<std::mutex> lock(autosave_mtx);
+    autosave_stop = false;
+    autosave_thread = std::thread(&KeyValueStore::run_autosave, this, filename, std::move(rules));
+}
 
-    file << final_json.dump(4);
-    file.close();
-    return true;
+void KeyValueStore::stop_autosave() {
+    std::thread running;
+    {
+        std::lock_guard<std::mutex> lock(autosave_mtx);
+        autosave_stop = true;
+        running = std::move(autosave_thread);
+    }
+    autosave_cv.notify_all();
+    if (running.joinable()) {
+        running.join();
+    }
+}
+
+void KeyValueStore::run_autosave(std::string filename, std::vector<SaveRule> rules) {
+    constexpr auto POLL_INTERVAL = std::chrono::milliseconds(100);
+    constexpr long long RETRY_DELAY_MS = 5000; // After a failed save
+    const long long started_ms = getCurrentTimeMillis();
+    long long last_attempt_ms = 0;
+
+    std::unique_lock<std::mutex> lock(autosave_mtx);
+    while (!autosave_cv.wait_for(lock, POLL_INTERVAL, [this] { return autosave_stop; })) {
+        SaveStats stats = save_stats();
+        long long now = getCurrentTimeMillis();
+        if (!stats.last_save_ok && now - last_attempt_ms < RETRY_DELAY_MS) {
+            continue;
+        }
+        long long elapsed_ms = now - std::max(stats.last_save_ms, started_ms);
+        for (const SaveRule& rule : rules) {
+            if (elapsed_ms >= rule.seconds * 1000 && stats.changes_since_save >= rule.changes && stats.changes_since_save > 0) {
+                if (save_background(filename)) {
+                    last_attempt_ms = now;
+                }
+                break;
+            }
+        }
+    }
+}
+
+bool KeyValueStore::save_binary(std::ostream& file, SnapshotChain chain, bool as_delta) const {
+    SnapshotIntegrity integrity = snapshot_integrity;
+    integrity.merkle = integrity.merkle && !as_delta;
+    SnapshotWriter writer(file, integrity, chain, snapshot_compression);
+    SnapshotChunk chunk;
+    std::vector<size_t> rehashed;
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        if (as_delta) {
+            copy_changed(p, chunk);
+        } else {
+            copy_partition(p, chunk);
+        }
+        rehashed.clear();
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            bool cached = chunk[i].second.has_digest(DigestKind::EntrySha256);
+            writer.add(chunk[i].first, chunk[i].second);
+            if (!cached && chunk[i].second.has_digest(DigestKind::EntrySha256)) {
+                rehashed.push_back(i);
+            }
+        }
+        cache_digests(p, chunk, rehashed, DigestKind::EntrySha256);
+    }
+    return writer.finish();
+}
+
+void KeyValueStore::cache_digests(size_t p, const SnapshotChunk& chunk, const std::vector<size_t>& rehashed, DigestKind kind) const {
+    if (rehashed.empty()) {
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    const Partition& part = partitions[p];
+    for (size_t i : rehashed) {
+        auto it = part.find(chunk[i].first);
+        if (it != part.end() && it->second.version == chunk[i].second.version) {
+            it->second.cache_digest(kind, chunk[i].second.digest.data());
+        }
+    }
+}
+
+bool KeyValueStore::save_json(std::ostream& file) const {
+    // Entries are streamed out one partition at a time, so memory use is
+    // bounded by one partition no matter how large the keyspace is. Entries
+    // unchanged since the last save or load keep their cached digest.
+    constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+    std::string out = "{";
+    bool first = true;
+
+    SnapshotChunk chunk;
+    std::vector<size_t> rehashed;
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        copy_partition(p, chunk);
+        rehashed.clear();
+        append_envelopes(chunk, out, first, &rehashed);
+        cache_digests(p, chunk, rehashed, DigestKind::JsonValueSha256);
+        if (out.size() >= FLUSH_THRESHOLD) {
+            file.write(out.data(), out.size());
+            out.clear();
+        }
+    }
+    out += "\n}\n";
+    file.write(out.data(), out.size());
+    return static_cast<bool>(file);
 }
 
 bool KeyValueStore::load(const std::string& filename) {
+    stop_migration();
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    std::ifstream file(filename);
+    std::ifstream file(filename, std::ios::binary);
     if (!file.is_open() || file.peek() == std::ifstream::traits_type::eof()) {
         return true;
     }
+    bool ok;
+    if (SnapshotReader::is_snapshot(file)) {
+        SnapshotChain chain;
+        ok = (lazy_load && load_mapped(filename, chain)) || load_binary(file, filename, chain);
+        load_deltas(filename, chain);
+    } else {
+        ok = load_json(file, filename);
+    }
 
-    json file_j;
-    try {
-        file >> file_j;
-    } catch (const json::parse_error& e) {
-        std::cerr << "[ERROR] Failed to parse " << filename << ". It is not valid JSON. Starting fresh." << std::endl;
-        data.clear();
+    // The loaders add and drop cold keys without keeping count
+    cold_entries = 0;
+    for (const auto& keys : cold) {
+        cold_entries += keys.size();
+    }
+    if (warm && warm->entries() == 0) {
+        warm.reset();
+    }
+    if (cold_entries == 0) {
+        mappings.clear();
+    } else if (lazy_migrate) {
+        migration_thread = std::thread(&KeyValueStore::run_migration, this);
+    } else if (lazy_verify) {
+        migration_thread = std::thread(&KeyValueStore::run_verification, this, mappings);
+    }
+    return ok;
+}
+
+void KeyValueStore::load_deltas(const std::string& filename, const SnapshotChain& base) {
+    uint32_t applied = 0;
+    uint64_t delta_bytes = 0;
+    if (base.base_id != 0 && base.sequence == 0) {
+        while (true) {
+            const std::string path = delta_filename(filename, applied + 1);
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) {
+                break;
+            }
+            SnapshotChain chain;
+            const SnapshotChain expected{base.base_id, applied + 1};
+            if (!load_binary(file, path, chain, &expected)) {
+                std::cerr << "[WARNING] Ignoring " << path << " and any later deltas. It does not continue the chain of "
+                          << filename << "." << std::endl;
+                break;
+            }
+            ++applied;
+            std::error_code ec;
+            delta_bytes += std::filesystem::file_size(path, ec);
+        }
+    }
+
+    if (delta.enabled && base.base_id != 0 && base.sequence == 0) {
+        std::error_code ec;
+        delta.base_id = base.base_id;
+        delta.sequence = applied;
+        delta.base_bytes = std::filesystem::file_size(filename, ec);
+        delta.delta_bytes = delta_bytes;
+    } else {
+        delta.base_id = 0;
+        delta.sequence = 0;
+    }
+    for (auto& keys : delta.dirty) {
+        keys.clear(); // What was just loaded is already on disk
+    }
+}
+
+bool KeyValueStore::load_binary(std::istream& file, const std::string& filename, SnapshotChain& chain,
+                                const SnapshotChain* expected) {
+    SnapshotReader reader(file);
+    chain = reader.chain();
+    if (expected && (!reader.header_ok() || chain.base_id != expected->base_id || chain.sequence != expected->sequence)) {
+        return false;
+    }
+    if (!reader.header_ok()) {
+        std::cerr << "[ERROR] " << filename << " has an unsupported snapshot version. Starting fresh." << std::endl;
         return true;
     }
 
-    for (auto& element : file_j.items()) {
-        const std::string& key = element.key();
-        const json& entry_envelope = element.value();
+    // Blocks are read on this thread and verified, decoded and inserted on
+    // the pool. With a manifest, the pool also rebuilds the Merkle tree of
+    // what it decoded, expired entries included, to check against it.
+    LoadState state;
+    ThreadPool pool;
+    SnapshotBlock block;
+    size_t block_no = 0;
+    std::unique_ptr<MerkleTree> loaded;
+    std::mutex loaded_mtx;
+    if (reader.has_manifest()) {
+        loaded = std::make_unique<MerkleTree>();
+    }
+    while (reader.read_block(block)) {
+        ++block_no;
+        std::string& messages = state.messages.emplace_back();
+        auto shared = std::make_shared<SnapshotBlock>(std::move(block));
+        pool.submit([this, &state, &messages, shared, block_no, &filename, &loaded, &loaded_mtx] {
+            bool intact = SnapshotReader::verify(*shared);
+            if (!intact && !shared->integrity.per_entry) {
+                messages = "[CRITICAL] Checksum mismatch in block " + std::to_string(block_no) + " of " + filename
+                    + ". Its " + std::to_string(shared->entry_count) + " entries will not be loaded.\n";
+                return;
+            }
+            SnapshotChunk entries;
+            size_t rejected = 0;
+            bool decoded = SnapshotReader::decode_block(*shared, entries, !intact, &rejected);
+            if (!intact) {
+                // Entries carry their own checksums, so only the damaged ones are lost
+                messages = "[CRITICAL] Checksum mismatch in block " + std::to_string(block_no) + " of " + filename
+                    + ". " + std::to_string(rejected) + " damaged entries will not be loaded.\n";
+            }
+            if (!decoded) {
+                messages += "[WARNING] Skipping undecodable entries in block " + std::to_string(block_no) + " of " + filename + ".\n";
+            }
+            if (loaded) {
+                std::vector<std::pair<uint32_t, MerkleTree::Digest>> digests;
+                digests.reserve(entries.size());
+                for (const auto& entry : entries) {
+                    digests.emplace_back(MerkleTree::leaf_of(entry.first), MerkleTree::entry_digest(entry.first, entry.second));
+                }
+                std::lock_guard<std::mutex> lock(loaded_mtx);
+                for (const auto& d : digests) {
+                    loaded->add(d.first, d.second);
+                }
+            }
+            load_entries(state, entries);
+        });
+        block = SnapshotBlock();
+    }
+    pool.wait();
+    print_load_messages(state);
+    if (reader.truncated()) {
+        std::cerr << "[WARNING] " << filename << " is truncated. Loaded the complete blocks before the damage." << std::endl;
+    } else if (loaded) {
+        check_manifest(reader, *loaded, filename);
+    }
+    return true;
+}
 
-        if (!entry_envelope.is_object() || !entry_envelope.contains("value") || !entry_envelope.contains("hash")) {
-            std::cerr << "[WARNING] Skipping malformed entry for key '" << key << "'. Missing 'value' or 'hash' field." << std::endl;
-            continue;
+void KeyValueStore::check_manifest(SnapshotReader& reader, MerkleTree& loaded, const std::string& filename) {
+    MerkleTree manifest;
+    if (!reader.read_manifest(manifest)) {
+        std::cerr << "[WARNING] The Merkle manifest of " << filename << " is damaged. Its entries were not checked against it."
+                  << std::endl;
+        return;
+    }
+    loaded.build();
+    if (loaded.root() == manifest.root()) {
+        return;
+    }
+    const std::vector<uint32_t> leaves = MerkleTree::diff(manifest, loaded);
+    std::cerr << "[CRITICAL] " << filename << " does not match its Merkle manifest: " << leaves.size()
+              << " leaves differ, " << MerkleTree::missing(manifest, loaded, leaves) << " entries missing." << std::endl;
+}
+
+void KeyValueStore::load_entries(LoadState& state, SnapshotChunk& entries) {
+    const long long now = getCurrentTimeMillis();
+    for (auto& entry : entries) {
+        size_t p = partition_of(entry.first);
+        long long expiration = entry.second.expiration_time_ms;
+        std::lock_guard<std::mutex> lock(state.locks[p]);
+        if (!cold[p].empty()) {
+            cold[p].erase(entry.first);
+        }
+        if (warm) {
+            warm->drop(p, entry.first);
+        }
+        if (expiration != -1 && expiration < now) {
+            // Expired, or a tombstone from a delta snapshot
+            partitions[p].erase(entry.first);
+        } else {
+            partitions[p].insert_or_assign(std::move(entry.first), std::move(entry.second));
+        }
+    }
+}
+
+void KeyValueStore::print_load_messages(const LoadState& state) {
+    for (const auto& messages : state.messages) {
+        std::cerr << messages;
+    }
+    std::cerr.flush();
+}
+
+bool KeyValueStore::load_json(std::istream& file, const std::string& filename) {
+    using Batch = EnvelopeBatch;
+    constexpr size_t BATCH_SIZE = 1024;
+
+    // Hashing dominates a JSON load, so envelopes are verified and
+    // deserialized on the pool in batches while the parser moves on.
+    auto verify_batch = [this](Batch& batch, LoadState& state, std::string& messages) {
+        SnapshotChunk entries;
+        decode_envelopes(batch, entries, messages);
+        load_entries(state, entries);
+    };
+
+    LoadState state;
+    ThreadPool pool;
+    auto batch = std::make_shared<Batch>();
+    auto submit_batch = [&] {
+        std::string& messages = state.messages.emplace_back();
+        pool.submit([batch, &state, &messages, &verify_batch] { verify_batch(*batch, state, messages); });
+        batch = std::make_shared<Batch>();
+    };
+
+    EnvelopeReader reader([&](const std::string& key, json& entry_envelope) {
+        batch->emplace_back(key, std::move(entry_envelope));
+        if (batch->size() == BATCH_SIZE) {
+            submit_batch();
         }
-        
-        json value_j = entry_envelope["value"];
-        std::string stored_hash = entry_envelope["hash"];
-        
-        // Recalculate hash to verify integrity
-        std::string value_str = value_j.dump();
-        std::string calculated_hash;
-        picosha2::hash256_hex_string(value_str, calculated_hash);
-        
-        if (stored_hash != calculated_hash) {
-            std::cerr << "[CRITICAL] TAMPERING DETECTED for key '" << key << "'. This entry will not be loaded." << std::endl;
-            continue; // Skip this entry and move to the next
-        }
-
-        // If the hash is valid, deserialize the value
-        try {
-            data[key] = value_j.get<ValueWithTTL>();
-        } catch (const json::exception& e) {
-            std::cerr << "[WARNING] Skipping corrupted data for key '" << key << "'. Details: " << e.what() << std::endl;
-        }
-    }
-    
-    file.close();
+    });
+
+    bool parsed = false;
+    try {
+        parsed = json::sax_parse(file, &reader);
+    } catch (const json::exception&) {
+        parsed = false;
+    }
+    if (!parsed) {
+        pool.wait();
+        std::cerr << "[ERROR] Failed to parse " << filename << ". It is not valid JSON. Starting fresh." << std::endl;
+        for (auto& part : partitions) part.clear();
+        for (auto& keys : cold) keys.clear();
+        warm.reset();
+        return true;
+    }
+    if (!batch->empty()) {
+        submit_batch();
+    }
+    pool.wait();
+    print_load_messages(state);
     return true;
 }
 
@@ -273,20 +1235,77 @@ void KeyValueStore::begin(){
 }
 
 void KeyValueStore::commit() {
-    std::lock_guard<std::recursive_mutex> lock(mtx); 
+    WriteGuard guard(*this); 
     if (!in_trxn) {
         std::cout << "ERROR: No transaction to commit." << std::endl;
         return;
     }
-    for (const auto& pair : trxn_data) {
-        if (pair.second.has_value()) {
-            data[pair.first] = *pair.second;
-        } else {
-            data.erase(pair.first);
+    const auto& writes = trxn_data.entries();
+    if (wal && !writes.empty()) {
+        // One record, under one checksum, so replay applies all of the
+        // write set or none of it. Concurrent committers share its fsync.
+        LogRecord record;
+        record.type = LogRecord::TRANSACTION;
+        record.writes.resize(writes.size());
+        for (size_t i = 0; i < writes.size(); ++i) {
+            LogRecord& write = record.writes[i];
+            write.type = writes[i].value.has_value() ? LogRecord::SET : LogRecord::REMOVE;
+            write.key = writes[i].key;
+            if (writes[i].value.has_value()) write.value = *writes[i].value;
+        }
+        const uint64_t seq = wal->append(record);
+        if (seq == 0) {
+            // Applied without a record, it would silently vanish on restart
+            in_trxn = false;
+            trxn_data.clear();
+            std::cout << (wal->failed() ? "ERROR: The write-ahead log has failed. The transaction was rolled back."
+                                        : "ERROR: Transaction too large to log. It was rolled back.")
+                      << std::endl;
+            return;
+        }
+        guard.logged(seq);
+    }
+
+    // Bucket the write set by partition so each table is grown once up front
+    // instead of rehashing repeatedly while the lock is held.
+    std::array<size_t, PARTITION_COUNT + 1> offsets{};
+    std::array<size_t, PARTITION_COUNT> inserts{};
+    for (const auto& rec : writes) {
+        size_t p = partition_index(rec.hash);
+        ++offsets[p + 1];
+        if (rec.value.has_value()) ++inserts[p];
+    }
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        offsets[p + 1] += offsets[p];
+    }
+    std::vector<uint32_t> order(writes.size());
+    std::array<size_t, PARTITION_COUNT> cursor;
+    std::copy(offsets.begin(), offsets.end() - 1, cursor.begin());
+    for (size_t i = 0; i < writes.size(); ++i) {
+        order[cursor[partition_index(writes[i].hash)]++] = static_cast<uint32_t>(i);
+    }
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        Partition& part = partitions[p];
+        if (inserts[p] > 0) {
+            part.reserve(part.size() + inserts[p]);
+        }
+        for (size_t i = offsets[p]; i < offsets[p + 1]; ++i) {
+            const auto& rec = writes[order[i]];
+            before_write(p, rec.key);
+            release_quarantined(rec.key);
+            if (rec.value.has_value()) {
+                part[rec.key] = *rec.value;
+            } else {
+                part.erase(rec.key);
+            }
         }
     }
     in_trxn = false;
     trxn_data.clear();
+    if (!guard.release()) {
+        std::cout << "ERROR: The transaction could not be made durable." << std::endl;
+        return;
+    }
     std::cout << "OK" << std::endl;
 }
 
@@ -302,16 +1321,294 @@ void KeyValueStore::rollback() {
 }
 
 bool KeyValueStore::remove(const std::string& key) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
+    WriteGuard guard(*this);
     if (in_trxn) {
-        trxn_data[key] = std::nullopt;
-        return true;
+        return erase_entry(key);
     }
     get(key);
-    return data.erase(key) > 0;
+    return erase_entry(key);
 }
 
 size_t KeyValueStore::count() const {
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    return data.size();
+    size_t total = 0;
+    for (const auto& part : partitions) {
+        total += part.size();
+    }
+    return total + cold_entries + (warm ? warm->entries() : 0);
+}
+
+void KeyValueStore::set_lazy_load(bool enabled, bool migrate, bool defer_verification) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    lazy_load = enabled;
+    lazy_migrate = migrate;
+    lazy_verify = defer_verification;
+}
+
+std::vector<std::string> KeyValueStore::quarantined() const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    std::vector<std::string> keys;
+    keys.reserve(quarantine.size());
+    for (const auto& pair : quarantine) {
+        keys.push_back(pair.first);
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+void KeyValueStore::visit_digests(size_t p, const std::vector<bool>* leaves, const DigestVisitor& visit) const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    for (const auto& pair : partitions[p]) {
+        uint32_t leaf = MerkleTree::leaf_of(pair.first);
+        if (!pair.second.is_expired() && (!leaves || (*leaves)[leaf])) {
+            visit(pair.first, leaf, MerkleTree::entry_digest(pair.first, pair.second));
+        }
+    }
+    for (const auto& pair : cold[p]) {
+        uint32_t leaf = MerkleTree::leaf_of(pair.first);
+        ValueWithTTL value;
+        if ((!leaves || (*leaves)[leaf]) && decode_cold(pair.second, value) && !value.is_expired()) {
+            visit(pair.first, leaf, MerkleTree::entry_digest(pair.first, value));
+        }
+    }
+    if (warm) {
+        warm->visit(p, [&](std::string& key, ValueWithTTL& value) {
+            uint32_t leaf = MerkleTree::leaf_of(key);
+            if ((!leaves || (*leaves)[leaf]) && !value.is_expired()) {
+                visit(key, leaf, MerkleTree::entry_digest(key, value));
+            }
+        });
+    }
+}
+
+MerkleTree KeyValueStore::merkle_tree() const {
+    MerkleTree tree;
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        visit_digests(p, nullptr, [&](const std::string&, uint32_t leaf, const MerkleTree::Digest& digest) {
+            tree.add(leaf, digest);
+        });
+    }
+    tree.build();
+    return tree;
+}
+
+KeyValueStore::LeafEntries KeyValueStore::leaf_entries(const std::vector<uint32_t>& leaves) const {
+    constexpr uint32_t LEAVES_PER_PARTITION = MerkleTree::LEAF_COUNT / PARTITION_COUNT;
+    std::vector<bool> wanted(MerkleTree::LEAF_COUNT);
+    std::vector<bool> scan(PARTITION_COUNT);
+    for (uint32_t leaf : leaves) {
+        if (leaf < MerkleTree::LEAF_COUNT) {
+            wanted[leaf] = true;
+            scan[leaf / LEAVES_PER_PARTITION] = true;
+        }
+    }
+    LeafEntries entries;
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        if (scan[p]) {
+            visit_digests(p, &wanted, [&](const std::string& key, uint32_t, const MerkleTree::Digest& digest) {
+                entries.emplace_back(key, digest);
+            });
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+size_t KeyValueStore::lazy_entries() const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return cold_entries;
+}
+
+void KeyValueStore::materialize(size_t p, ColdIndex::iterator it) {
+    ValueWithTTL value;
+    const MappedSnapshot::EntryRef& ref = it->second;
+    if (!decode_cold(ref, value)) {
+        quarantine_cold(p, it);
+        return;
+    }
+    partitions[p].emplace(it->first, std::move(value));
+    cold[p].erase(it);
+    if (--cold_entries == 0) {
+        mappings.clear();
+    }
+}
+
+void KeyValueStore::quarantine_cold(size_t p, ColdIndex::iterator it) const {
+    const MappedSnapshot::EntryRef& ref = it->second;
+    if (ref.file->integrity().per_entry) {
+        std::cerr << "[CRITICAL] Checksum mismatch for key '" << it->first << "' in " << ref.file->path()
+                  << ". It was quarantined." << std::endl;
+    }
+    quarantine.insert_or_assign(it->first, std::string(ref.data, ref.size));
+    cold[p].erase(it);
+    if (--cold_entries == 0) {
+        mappings.clear();
+    }
+}
+
+void KeyValueStore::take_warm(size_t p, const std::string& key) {
+    size_t slot = warm->find(p, key);
+    if (slot == WarmImage::npos) {
+        return;
+    }
+    ValueWithTTL value;
+    if (warm->decode(p, slot, value)) {
+        partitions[p].emplace(key, std::move(value));
+    } else {
+        std::cerr << "[CRITICAL] Undecodable entry for key '" << key << "' in " << warm->path()
+                  << ". It was quarantined." << std::endl;
+        quarantine.insert_or_assign(key, warm->encoded(p, slot));
+    }
+    warm->take(p, slot);
+    if (warm->entries() == 0) {
+        warm.reset();
+    }
+}
+
+bool KeyValueStore::save_warm_image(const std::string& path) const {
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    WarmImage::Writer writer;
+    if (!writer.open(path)) {
+        std::cerr << "ERROR: Could not open file for writing: " << path << ".tmp" << std::endl;
+        return false;
+    }
+    unsigned long long version;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        start_snapshot();
+        version = next_version;
+    }
+    bool ok = true;
+    SnapshotChunk chunk;
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        copy_partition(p, chunk);
+        ok = ok && writer.add_partition(chunk);
+    }
+    finish_snapshot();
+    if (!(ok && writer.finish(version))) {
+        std::cerr << "ERROR: Could not write warm image: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool KeyValueStore::attach_warm_image(const std::string& path) {
+    static_assert(WarmImage::PARTITIONS == PARTITION_COUNT, "the image is laid out by store partition");
+    std::lock_guard<std::mutex> serial(snapshot_mtx);
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if (!std::filesystem::exists(path)) {
+        return false;
+    }
+    if (warm || count() != 0) {
+        std::cerr << "[ERROR] A warm image can only be attached to an empty store." << std::endl;
+        return false;
+    }
+    std::string error;
+    std::unique_ptr<WarmImage> image = WarmImage::attach(path, error);
+    if (!image) {
+        std::cerr << "[WARNING] Cannot attach warm image " << path << ": " << error
+                  << ". Recovering from the snapshot and log instead." << std::endl;
+        return false;
+    }
+    next_version = std::max(next_version, image->next_version());
+    if (image->entries() != 0) {
+        warm = std::move(image);
+    }
+    return true;
+}
+
+size_t KeyValueStore::warm_entries() const {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return warm ? warm->entries() : 0;
+}
+
+void KeyValueStore::run_migration() {
+    // A slice at a time, so readers and writers get the lock in between
+    constexpr size_t SLICE = 1024;
+    size_t p = 0;
+    while (p < PARTITION_COUNT && !migration_stop) {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mtx);
+            for (size_t i = 0; i < SLICE && !cold[p].empty(); ++i) {
+                materialize(p, cold[p].begin());
+            }
+            if (cold[p].empty()) {
+                ++p;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+void KeyValueStore::run_verification(std::vector<std::shared_ptr<MappedSnapshot>> files) {
+    for (const auto& file : files) {
+        for (uint32_t b = 0; b < file->block_count() && !migration_stop; ++b) {
+            if (file->block_state(b) != MappedSnapshot::BlockState::Unchecked) {
+                continue;
+            }
+            // Hashing happens outside the lock; only the outcome needs it
+            bool intact = file->check_block(b);
+            std::lock_guard<std::recursive_mutex> lock(mtx);
+            if (file->block_state(b) == MappedSnapshot::BlockState::Unchecked) {
+                settle_block(*file, b, intact);
+                if (!intact) {
+                    quarantine_block(*file, b);
+                }
+            }
+        }
+    }
+}
+
+void KeyValueStore::quarantine_block(const MappedSnapshot& file, uint32_t block) {
+    for (size_t p = 0; p < PARTITION_COUNT; ++p) {
+        for (auto it = cold[p].begin(); it != cold[p].end();) {
+            auto next = std::next(it);
+            if (it->second.file == &file && it->second.block == block) {
+                materialize(p, it); // Quarantines whatever fails
+            }
+            it = next;
+        }
+    }
+}
+
+void KeyValueStore::stop_migration() {
+    if (migration_thread.joinable()) {
+        migration_stop = true;
+        migration_thread.join();
+        migration_stop = false;
+    }
+}
+
+bool KeyValueStore::load_mapped(const std::string& filename, SnapshotChain& chain) {
+    std::string error;
+    std::unique_ptr<MappedSnapshot> mapped = MappedSnapshot::open(filename, error);
+    if (!mapped) {
+        std::cerr << "[WARNING] Could not map " << filename << " (" << error << "). Loading it in full instead." << std::endl;
+        return false;
+    }
+    chain = mapped->chain();
+    const long long now = getCurrentTimeMillis();
+    size_t corrupt_blocks = 0;
+    bool complete = mapped->index([&](std::string&& key, long long expiration, MappedSnapshot::EntryRef ref) {
+        size_t p = partition_of(key);
+        partitions[p].erase(key);
+        if (warm) {
+            warm->drop(p, key);
+        }
+        if (expiration != -1 && expiration < now) {
+            cold[p].erase(key);
+        } else {
+            cold[p].insert_or_assign(std::move(key), ref);
+        }
+    }, corrupt_blocks, !lazy_verify);
+    if (corrupt_blocks) {
+        std::cerr << "[CRITICAL] " << corrupt_blocks << " blocks of " << filename << " failed their checksum."
+                  << (mapped->integrity().per_entry ? " Only their damaged entries will be dropped." : " Their entries will not be loaded.")
+                  << std::endl;
+    }
+    if (!complete) {
+        std::cerr << "[WARNING] " << filename << " is truncated. Loaded the complete blocks before the damage." << std::endl;
+    }
+    mappings.push_back(std::move(mapped));
+    return true;
 }
\ No newline at end of file
@@ -3,54 +3,477 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <optional>
-#include <chrono>
 #include <mutex>
-#include <variant>
+#include <array>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
 
-#include "json.hpp"
-using json = nlohmann::json;
+#include "ValueWithTTL.h"
+#include "TransactionBuffer.h"
+#include "Snapshot.h"
+#include "WriteAheadLog.h"
+#include "MappedSnapshot.h"
+#include "WarmImage.h"
+#include "AsyncIo.h"
 
-struct ValueWithTTL {
-    std::variant<std::string, long long> data;
-    long long expiration_time_ms;
+class ThreadPool;
 
-    bool is_expired() const {
-        if (expiration_time_ms == -1) {
-            return false;
-        }
-        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
-        ).count();
-        return now > expiration_time_ms;
-    }
-};
+class KeyValueStore {
+public:
+    // The keyspace is split into independently sized hash tables so that a
+    // growing table only ever rehashes a fraction of the keys at a time.
+    static constexpr size_t PARTITION_COUNT = 64; // partition_index() relies on this being 2^6
 
-void to_json(json& j, const ValueWithTTL& v);
-void from_json(const json& j, ValueWithTTL& v);
+    // Autosave rule: save once `seconds` have passed since the last save if
+    // at least `changes` writes happened meanwhile.
+    struct SaveRule {
+        long long seconds;
+        unsigned long long changes;
+    };
+
+    struct SaveStats {
+        long long last_save_ms = 0;          // When the last successful save finished, 0 if never
+        long long last_save_duration_ms = 0; // How long the last save attempt took
+        bool last_save_ok = true;
+        unsigned long long changes_since_save = 0;
+    };
 
-class KeyValueStore {
 private:
+    using Partition = std::unordered_map<std::string, ValueWithTTL>;
+
     mutable std::recursive_mutex mtx;
-    std::unordered_map<std::string, ValueWithTTL> data;
+    std::array<Partition, PARTITION_COUNT> partitions;
 
     bool in_trxn = false;
-    std::unordered_map<std::string, std::optional<ValueWithTTL>> trxn_data;
+    TransactionBuffer trxn_data;
+    unsigned long long next_version = 0;
+    std::unique_ptr<WriteAheadLog> wal;
+    std::atomic<bool> write_error{false}; // See write_failed()
+    unsigned log_rewrite_growth = 0; // Applied by open_log(); guarded by snapshot_mtx
+    uint64_t log_rewrite_min_bytes = 0;
+    size_t replay_threads = 0;
+
+    // Holds the store lock for a mutation. Once the lock is released, it
+    // waits until the last record logged under it is as durable as the
+    // fsync policy promises, so concurrent writers can share a single fsync
+    // without waiting on records queued after their own.
+    class WriteGuard {
+    public:
+        explicit WriteGuard(KeyValueStore& store);
+        // Flags a write error for write_failed() unless release() was called.
+        ~WriteGuard();
+        // Unlocks and waits. Returns false, for the caller to report, if the
+        // records did not become durable.
+        bool release();
+        void logged(uint64_t sequence) { seq = sequence; }
+    private:
+        KeyValueStore& store;
+        std::unique_lock<std::recursive_mutex> lock;
+        WriteGuard* outer;
+        uint64_t seq = 0;
+    };
+    WriteGuard* write_guard = nullptr; // Innermost guard holding mtx
+
+    // The top bits of key_hash(), so a partition holds a contiguous range
+    // of Merkle leaves.
+    static size_t partition_index(uint64_t hash) { return static_cast<size_t>(hash >> 58); }
+    static size_t partition_of(const std::string& key);
+
+    // Copy-on-write bookkeeping for a snapshot that is written while the
+    // store keeps serving. Until the snapshot has copied a partition, the
+    // first write to each of its keys preserves the value the key had when
+    // the snapshot began (std::nullopt if it did not exist yet).
+    struct SnapshotState {
+        bool active = false;
+        std::array<bool, PARTITION_COUNT> copied{};
+        std::array<std::unordered_map<std::string, std::optional<ValueWithTTL>>, PARTITION_COUNT> preserved;
+    };
+    using SnapshotChunk = std::vector<std::pair<std::string, ValueWithTTL>>;
+
+    mutable SnapshotState snap;
+    mutable std::mutex snapshot_mtx; // Serialises snapshots; taken before mtx
+    SnapshotIntegrity snapshot_integrity; // Guarded by snapshot_mtx
+    Compression snapshot_compression = Compression::None; // Guarded by snapshot_mtx
+    IoBackend io_backend = IoBackend::Auto; // Guarded by snapshot_mtx
+
+    // Delta snapshot bookkeeping. The chain fields are guarded by
+    // snapshot_mtx, the key sets by mtx.
+    struct DeltaState {
+        bool enabled = false;
+        size_t max_chain = 16;
+        uint64_t base_id = 0;   // Base the next delta extends, 0 if there is none
+        uint32_t sequence = 0;  // Deltas already written on top of it
+        uint64_t base_bytes = 0;
+        uint64_t delta_bytes = 0;
+        std::array<std::unordered_set<std::string>, PARTITION_COUNT> dirty;   // Written since the last checkpoint
+        std::array<std::unordered_set<std::string>, PARTITION_COUNT> writing; // Taken by the checkpoint in progress
+    };
+    mutable DeltaState delta;
+
+    // Entries of a lazily loaded snapshot that have not been decoded yet.
+    // A key is either here or in its partition, never both; guarded by mtx
+    // like the partitions. The mappings stay open until nothing refers to
+    // them any more. Saving decodes cold entries too, and quarantines those
+    // that fail, hence mutable.
+    using ColdIndex = std::unordered_map<std::string, MappedSnapshot::EntryRef>;
+    mutable std::array<ColdIndex, PARTITION_COUNT> cold;
+    mutable size_t cold_entries = 0;
+    mutable std::vector<std::shared_ptr<MappedSnapshot>> mappings;
+    bool lazy_load = false;
+    bool lazy_migrate = true;
+    bool lazy_verify = false; // Block checksums are checked on first use
+    // Encoded entries that failed verification, kept out of the store until
+    // the key is written or removed
+    mutable std::unordered_map<std::string, std::string> quarantine;
+    std::thread migration_thread;
+    std::atomic<bool> migration_stop{false};
+
+    // Warm-restart image the store was attached to. Like cold entries, a key
+    // is either still in the image or in its partition, and is taken out on
+    // first use; the image is unmapped once none are left. Guarded by mtx.
+    std::unique_ptr<WarmImage> warm;
+
+    // Decodes key into partition p if it is still cold or in the image.
+    void materialize(size_t p, const std::string& key) {
+        if (cold_entries) {
+            auto it = cold[p].find(key);
+            if (it != cold[p].end()) {
+                materialize(p, it);
+            }
+        }
+        if (warm) {
+            take_warm(p, key);
+        }
+    }
+    void materialize(size_t p, ColdIndex::iterator it);
+    // Moves a cold entry that does not decode into quarantine.
+    void quarantine_cold(size_t p, ColdIndex::iterator it) const;
+    void take_warm(size_t p, const std::string& key);
+    bool load_mapped(const std::string& filename, SnapshotChain& chain);
+    void run_migration();
+    // Checks every block still unchecked and quarantines the cold entries of
+    // those that are damaged.
+    void run_verification(std::vector<std::shared_ptr<MappedSnapshot>> files);
+    void quarantine_block(const MappedSnapshot& file, uint32_t block);
+    void stop_migration();
+    // Calls visit(key, leaf, digest) for the live entries of partition p,
+    // cold ones included, that fall in one of leaves (any leaf if null).
+    using DigestVisitor = std::function<void(const std::string&, uint32_t, const MerkleTree::Digest&)>;
+    void visit_digests(size_t p, const std::vector<bool>* leaves, const DigestVisitor& visit) const;
+
+    void before_write(size_t p, const std::string& key) {
+        materialize(p, key);
+        ++changes;
+        if (delta.enabled) {
+            delta.dirty[p].insert(key);
+        }
+        if (snap.active && !snap.copied[p]) {
+            preserve(p, key);
+        }
+    }
+    // A key written or removed no longer has a damaged entry to keep.
+    void release_quarantined(const std::string& key) {
+        if (!quarantine.empty()) {
+            quarantine.erase(key);
+        }
+    }
+    void preserve(size_t p, const std::string& key);
+    void start_snapshot() const;
+    // Copies the live entries partition p held when the snapshot began,
+    // holding the store lock only for the copy.
+    void copy_partition(size_t p, SnapshotChunk& out) const;
+    // Like copy_partition(), but only for the keys a delta checkpoint took
+    // from partition p. Keys that did not exist are copied as tombstones.
+    void copy_changed(size_t p, SnapshotChunk& out) const;
+    void finish_snapshot() const;
+    bool write_snapshot(const std::string& filename, SnapshotFormat format, bool checkpoint) const;
+    // Hands digests computed while saving chunk (at the given indexes) back
+    // to the live entries of partition p that have not changed since.
+    void cache_digests(size_t p, const SnapshotChunk& chunk, const std::vector<size_t>& rehashed, DigestKind kind) const;
+
+    std::mutex background_mtx;
+    std::thread background_save;
+    bool background_running = false;
+
+    // Partition writes so far, and the count when the last successful
+    // snapshot began. Both guarded by mtx, like the save statistics.
+    unsigned long long changes = 0;
+    mutable unsigned long long saved_changes = 0;
+    mutable long long last_save_ms = 0;
+    mutable long long last_save_duration_ms = 0;
+    mutable bool last_save_ok = true;
+
+    std::mutex autosave_mtx; // Taken before mtx
+    std::condition_variable autosave_cv;
+    std::thread autosave_thread;
+    bool autosave_stop = false;
+    void run_autosave(std::string filename, std::vector<SaveRule> rules);
+    void stop_autosave();
+
+    // Visible live entry for key (staged writes first), or nullptr.
+    const ValueWithTTL* lookup(const std::string& key);
+    void store_entry(const std::string& key, ValueWithTTL entry);
+    bool erase_entry(const std::string& key);
+    template <typename Fn>
+    ValueWithTTL* update_entry(const std::string& key, Fn&& fn);
+
+    // Writes are logged only while a write-ahead log is open; writes staged
+    // in a transaction are logged by commit() instead.
+    bool logging() const { return wal && !in_trxn; }
+    // Logs a record while logging() holds and returns its sequence number,
+    // which the write guard waits for. 0, flagging a write error, means the
+    // record could not be logged and the write must not take effect.
+    uint64_t log_record(const LogRecord& record);
+    // Counts kept by each replay worker and added to the store afterwards
+    struct ReplayTally {
+        unsigned long long changes = 0;
+        size_t cold_dropped = 0;
+    };
+    // Applies a replayed record. It only touches the record's partition, so
+    // workers owning different partitions can run at once.
+    void replay_record(LogRecord& record, ReplayTally& tally);
+
+    // Shared by the tasks of one load(). Decoded entries go straight into
+    // their partition under that partition's loader lock; load() holds the
+    // store lock throughout, so nothing becomes visible before it returns.
+    struct LoadState {
+        std::array<std::mutex, PARTITION_COUNT> locks;
+        std::deque<std::string> messages; // One per task, printed in file order
+    };
+    void load_entries(LoadState& state, SnapshotChunk& entries);
+    static void print_load_messages(const LoadState& state);
+
+    // Reports a mismatch between the entries load_binary() decoded and the
+    // manifest that follows the blocks.
+    static void check_manifest(SnapshotReader& reader, MerkleTree& loaded, const std::string& filename);
+    bool save_binary(std::ostream& file, SnapshotChain chain = {}, bool as_delta = false) const;
+    bool save_json(std::ostream& file) const;
+    // Loads a binary snapshot and reports its place in a delta chain. With
+    // expected, nothing is loaded unless the header matches it.
+    bool load_binary(std::istream& file, const std::string& filename, SnapshotChain& chain,
+                     const SnapshotChain* expected = nullptr);
+    // Applies the deltas that continue base, in order, and records the chain
+    // so the next checkpoint extends it.
+    void load_deltas(const std::string& filename, const SnapshotChain& base);
+    bool load_json(std::istream& file, const std::string& filename);
 
 public:
+    KeyValueStore() = default;
+    ~KeyValueStore();
+
     void set(const std::string& key, const std::string& value, long long ttl_ms = -1);
     std::optional<std::string> get(const std::string& key);
     bool remove(const std::string& key);
+    // Keys held, counted without decoding anything. Entries are only dropped
+    // once an expired key is touched, so those that expired since they were
+    // written, lazily loaded or restored from a warm image still count.
     size_t count() const;
-    bool save(const std::string& filename) const;
+    // Writes a point-in-time snapshot of all live keys. load() detects the
+    // format by itself.
+    bool save(const std::string& filename, SnapshotFormat format = SnapshotFormat::Binary) const;
     bool load(const std::string& filename);
+    // Checksum algorithm, and whether every entry is checksummed on its own,
+    // for binary snapshots written from now on. Defaults to CRC-32C per block.
+    void set_snapshot_integrity(SnapshotIntegrity integrity);
+    // Compresses every block of binary snapshots written from now on.
+    // Loading handles compressed and uncompressed files alike.
+    void set_snapshot_compression(Compression compression);
+
+    // How snapshots and the log are written. Snapshots are encoded into
+    // buffers that are written while the next one fills. Takes effect for
+    // the log the next time it is opened.
+    void set_io_backend(IoBackend backend);
+
+    // Replays the write-ahead log at path on top of the current contents
+    // (normally a freshly loaded snapshot), then logs every later write to it.
+    // Records are applied by a pool of workers that each own a share of the
+    // partitions, so every key still sees its records in log order.
+    // With compression, large write batches are stored LZ4-compressed.
+    bool open_log(const std::string& path, FsyncPolicy policy = FsyncPolicy::EverySec,
+                  Compression compression = Compression::None);
+    // Workers open_log() replays with; 0 means one per core.
+    void set_replay_threads(size_t threads);
+    // Compacts the log down to one record per key it still affects; see
+    // WriteAheadLog::compact(). Writes carry on meanwhile.
+    bool rewrite_log();
+    // Runs rewrite_log() on a background thread. Returns false if no log is
+    // open or a rewrite is already running.
+    bool rewrite_log_background();
+    // Rewrites the log in the background whenever it has grown by
+    // growth_percent since its last rewrite or checkpoint and is at least
+    // min_bytes large. 0 turns it off.
+    void set_log_rewrite(unsigned growth_percent, uint64_t min_bytes);
+    // Size of the open log in bytes, 0 without one.
+    uint64_t log_size() const;
+    // Whether a write since the last call could not be logged, or did not
+    // become as durable as the fsync policy promises, and so must not be
+    // acknowledged. Once the log itself has failed, every write is refused
+    // and this stays true until open_log() is called again.
+    bool write_failed();
+    // Saves a binary snapshot and, once it is written, drops the log records
+    // it covers. Like save(), it only briefly holds the store lock per
+    // partition, so other threads keep reading and writing meanwhile.
+    bool checkpoint(const std::string& filename);
+    // Runs checkpoint() on a background thread. Returns false if a
+    // background save is already running.
+    bool save_background(const std::string& filename);
+    void wait_for_background_save();
+    // Makes checkpoint() write deltas holding only the keys written or
+    // deleted since the previous checkpoint, as <filename>.delta.N next to a
+    // full base. Once max_chain deltas exist, or they add up to half the
+    // base, the next checkpoint compacts the chain into a new base. Enable
+    // it before load() so the chain on disk is picked up.
+    void set_delta_snapshots(bool enabled, size_t max_chain = 16);
+    // Makes load() memory-map binary snapshots and only index them: each
+    // value is decoded the first time its key is used. With migrate, a
+    // background thread decodes the remaining keys a slice at a time. With
+    // defer_verification, block checksums are not checked while indexing
+    // either, but when an entry of the block is first decoded, and by the
+    // background thread. Entries that fail are quarantined.
+    void set_lazy_load(bool enabled, bool migrate = true, bool defer_verification = false);
+    // Keys of a lazily loaded snapshot that have not been decoded yet.
+    size_t lazy_entries() const;
+
+    // Writes every live key to a warm-restart image at path and marks it
+    // clean. Meant for a clean shutdown, after the final checkpoint; like
+    // save(), it does not stop other threads meanwhile.
+    bool save_warm_image(const std::string& path) const;
+    // Serves the keys of a clean warm-restart image at path in place, each
+    // decoded the first time it is used, so the store is ready without
+    // reading the image through. The image is marked dirty first and so is
+    // never attached twice. Returns false, leaving the store as it was, if
+    // there is no clean image or the store is not empty; the caller should
+    // then load() the snapshot and replay the log instead.
+    bool attach_warm_image(const std::string& path);
+    // Keys of an attached warm-restart image that have not been used yet.
+    size_t warm_entries() const;
+    // Keys whose snapshot entry failed deferred verification, sorted.
+    std::vector<std::string> quarantined() const;
+
+    // Merkle tree of the live entries, equal to the manifest a snapshot of
+    // them would carry. Cold entries are decoded for it but stay cold.
+    MerkleTree merkle_tree() const;
+    // Live keys in the given leaves of merkle_tree(), such as those
+    // MerkleTree::diff() found, with their entry digests and sorted by key,
+    // so two replicas can narrow differing leaves down to the keys. Only
+    // scans the partitions those leaves fall in, each once.
+    using LeafEntries = std::vector<std::pair<std::string, MerkleTree::Digest>>;
+    LeafEntries leaf_entries(const std::vector<uint32_t>& leaves) const;
+    // Runs save_background(filename) from a scheduler thread whenever one of
+    // rules is met. An empty list turns autosave off.
+    void set_autosave(const std::string& filename, std::vector<SaveRule> rules);
+    SaveStats save_stats() const;
 
     std::optional<long long> incr(const std::string& key);
     std::optional<long long> decr(const std::string& key);
+    std::optional<long long> incrby(const std::string& key, long long delta);
+    std::optional<long long> decrby(const std::string& key, long long delta);
+    std::optional<double> incrbyfloat(const std::string& key, double delta);
+    size_t append(const std::string& key, const std::string& suffix);
+
+    // Read-modify-write of a single key with one lookup and no value copy.
+    // fn(ValueWithTTL& entry, bool existed) edits the entry in place; when the
+    // key is missing or expired, existed is false and fn must fill in the whole
+    // entry. Returning false abandons the update, and fn must then leave the
+    // entry untouched. Returns whatever fn returned.
+    template <typename Fn>
+    bool update(const std::string& key, Fn&& fn);
+
+    // Conditional writes, each completed under a single lock acquisition.
+    bool setnx(const std::string& key, const std::string& value, long long ttl_ms = -1);
+    bool setxx(const std::string& key, const std::string& value, long long ttl_ms = -1);
+    std::optional<std::string> getset(const std::string& key, const std::string& value, long long ttl_ms = -1);
+    std::optional<std::string> getdel(const std::string& key);
+    bool cas(const std::string& key, const std::string& expected, const std::string& desired, long long ttl_ms = -1);
+    std::optional<unsigned long long> version(const std::string& key);
+    bool cas_version(const std::string& key, unsigned long long expected_version, const std::string& desired, long long ttl_ms = -1);
 
     void begin();
     void commit();
     void rollback();
 };
 
-#endif // KEYVALUESTORE_H
\ No newline at end of file
+template <typename Fn>
+ValueWithTTL* KeyValueStore::update_entry(const std::string& key, Fn&& fn) {
+    if (in_trxn) {
+        if (auto staged = trxn_data.find(key)) {
+            bool existed = staged->has_value() && !(*staged)->is_expired();
+            if (!existed) {
+                staged->emplace();
+            }
+            if (!fn(**staged, existed)) {
+                if (!existed) staged->reset();
+                return nullptr;
+            }
+            (*staged)->version = ++next_version;
+            return &**staged;
+        }
+        // First write to this key in the transaction: stage a private copy.
+        ValueWithTTL copy;
+        bool existed = false;
+        size_t p = partition_of(key);
+        materialize(p, key);
+        Partition& part = partitions[p];
+        auto it = part.find(key);
+        if (it != part.end() && !it->second.is_expired()) {
+            copy = it->second;
+            existed = true;
+        }
+        if (!fn(copy, existed)) {
+            return nullptr;
+        }
+        copy.version = ++next_version;
+        return &*trxn_data.put(key, std::move(copy));
+    }
+
+    if (logging() && wal->failed()) {
+        write_error = true;
+        return nullptr;
+    }
+    size_t p = partition_of(key);
+    Partition& part = partitions[p];
+    materialize(p, key);
+    // fn edits in place, so a snapshot under way keeps the value first. It
+    // is only a change, though, once fn has gone through.
+    if (snap.active && !snap.copied[p]) {
+        preserve(p, key);
+    }
+    auto [it, inserted] = part.try_emplace(key);
+    bool existed = !inserted && !it->second.is_expired();
+    if (!inserted && !existed) {
+        it->second = ValueWithTTL{};
+    }
+    if (!fn(it->second, existed)) {
+        if (!existed) part.erase(it);
+        return nullptr;
+    }
+    before_write(p, key);
+    release_quarantined(key);
+    it->second.version = ++next_version;
+    return &it->second;
+}
+
+template <typename Fn>
+bool KeyValueStore::update(const std::string& key, Fn&& fn) {
+    WriteGuard guard(*this);
+    ValueWithTTL* entry = update_entry(key, std::forward<Fn>(fn));
+    if (!entry) {
+        return false;
+    }
+    if (logging()) {
+        LogRecord record;
+        record.key = key;
+        record.value = *entry;
+        log_record(record);
+    }
+    return true;
+}
+
+#endif // KEYVALUESTORE_H
@@ -0,0 +1,172 @@
+#include "MappedSnapshot.h"
+#include "Checksum.h"
+#include "Compression.h"
+#include "Encoding.h"
+#include <istream>
+#include <streambuf>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+// Lets SnapshotReader parse the header straight from the mapping.
+class MemoryBuffer : public std::streambuf {
+public:
+    MemoryBuffer(const char* data, size_t len) {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + len);
+    }
+};
+
+} // namespace
+
+std::unique_ptr<MappedSnapshot> MappedSnapshot::open(const std::string& path, std::string& error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        error = "empty or unreadable file";
+        ::close(fd);
+        return nullptr;
+    }
+    void* addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        error = std::strerror(errno);
+        return nullptr;
+    }
+    std::unique_ptr<MappedSnapshot> mapped(new MappedSnapshot());
+    mapped->base = static_cast<const char*>(addr);
+    mapped->length = static_cast<size_t>(st.st_size);
+    mapped->file_path = path;
+
+    MemoryBuffer buffer(mapped->base, mapped->length);
+    std::istream in(&buffer);
+    SnapshotReader reader(in);
+    if (!reader.header_ok()) {
+        error = "not a supported binary snapshot";
+        return nullptr;
+    }
+    mapped->file_integrity = reader.integrity();
+    mapped->file_chain = reader.chain();
+    mapped->file_compression = reader.compression();
+    mapped->header_size = 16 + (mapped->file_chain.base_id ? 12 : 0);
+    return mapped;
+}
+
+MappedSnapshot::~MappedSnapshot() {
+    if (base) {
+        ::munmap(const_cast<char*>(base), length);
+    }
+}
+
+bool MappedSnapshot::index(const std::function<void(std::string&&, long long, EntryRef)>& visit, size_t& corrupt_blocks,
+                           bool verify) {
+    const size_t checksum_len = checksum_size(file_integrity.checksum);
+    const size_t digest_len = file_integrity.per_entry ? checksum_len : 0;
+    const size_t frame_len = file_compression == Compression::None ? 8 : 12;
+    ::madvise(const_cast<char*>(base), length, MADV_SEQUENTIAL);
+    size_t pos = header_size;
+    bool ok = false;
+    while (length - pos >= 8) {
+        uint32_t len = get_u32(base + pos);
+        uint32_t count = get_u32(base + pos + 4);
+        if (len == 0 && count == 0) {
+            ok = true; // End marker
+            break;
+        }
+        if (length - pos < frame_len) {
+            break;
+        }
+        uint32_t raw_len = frame_len == 12 ? get_u32(base + pos + 8) : 0;
+        const char* stored = base + pos + frame_len;
+        if (length - pos - frame_len < static_cast<size_t>(len) + checksum_len) {
+            break;
+        }
+        pos += frame_len + len + checksum_len;
+        const uint32_t block_no = static_cast<uint32_t>(blocks.size());
+        blocks.push_back(Block{stored, len});
+        states.emplace_back(BlockState::Unchecked);
+        if (verify) {
+            bool intact = check_block(block_no);
+            mark_block(block_no, intact);
+            if (!intact) {
+                ++corrupt_blocks;
+                if (!file_integrity.per_entry) {
+                    continue; // Otherwise decode() still catches the damaged entries
+                }
+            }
+        }
+        const char* payload = stored;
+        size_t payload_len = len;
+        if (raw_len != 0) {
+            std::unique_ptr<char[]> raw(new char[raw_len]);
+            if (!lz4_decompress(stored, len, raw.get(), raw_len)) {
+                ++corrupt_blocks;
+                continue;
+            }
+            payload = raw.get();
+            payload_len = raw_len;
+            decompressed.push_back(std::move(raw));
+        }
+
+        Cursor cur{payload, payload + payload_len};
+        for (uint32_t i = 0; i < count; ++i) {
+            const char* start = cur.p;
+            std::string key;
+            long long expiration;
+            if (!cur.string(key) || !skip_value(cur, expiration)
+                || static_cast<size_t>(cur.end - cur.p) < digest_len) {
+                ++corrupt_blocks; // Entries before the fault were already handed out
+                break;
+            }
+            cur.p += digest_len;
+            visit(std::move(key), expiration, EntryRef{this, start, static_cast<uint32_t>(cur.p - start), block_no});
+        }
+    }
+    ::madvise(const_cast<char*>(base), length, MADV_RANDOM);
+    return ok;
+}
+
+bool MappedSnapshot::check_block(uint32_t block) const {
+    const Block& b = blocks[block];
+    return verify_checksum(file_integrity.checksum, b.stored, b.len, b.stored + b.len);
+}
+
+void MappedSnapshot::mark_block(uint32_t block, bool intact) const {
+    states[block].store(intact ? BlockState::Intact : BlockState::Corrupt, std::memory_order_release);
+}
+
+bool MappedSnapshot::decode(EntryRef ref, ValueWithTTL& value, bool verify_entry) {
+    const SnapshotIntegrity& integrity = ref.file->file_integrity;
+    const size_t digest_len = integrity.per_entry ? checksum_size(integrity.checksum) : 0;
+    if (ref.size < digest_len) {
+        return false;
+    }
+    const char* digest = ref.data + ref.size - digest_len;
+    Cursor cur{ref.data, digest};
+    uint64_t key_len;
+    if (!cur.varint(key_len) || static_cast<uint64_t>(cur.end - cur.p) < key_len) {
+        return false;
+    }
+    cur.p += key_len;
+    if (!get_value(cur, value) || cur.p != cur.end) {
+        return false;
+    }
+    if (digest_len) {
+        if (verify_entry && !verify_checksum(integrity.checksum, ref.data, digest - ref.data, digest)) {
+            return false;
+        }
+        if (integrity.checksum == ChecksumType::Sha256) {
+            value.cache_digest(DigestKind::EntrySha256, reinterpret_cast<const unsigned char*>(digest));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,93 @@
+#ifndef MAPPEDSNAPSHOT_H
+#define MAPPEDSNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <cstdint>
+
+#include "ValueWithTTL.h"
+#include "Snapshot.h"
+
+// Read-only memory map of a binary snapshot. index() walks the blocks and
+// reports where every entry lives without decoding its value, so values can
+// be decoded when they are first needed instead of all at startup. The
+// mapping must outlive every EntryRef handed out. Snapshots are replaced by
+// renaming a new file over the old one, which leaves the mapped file intact.
+//
+// Block checksums can be left for later: each block then remains Unchecked
+// until check_block() has been run and its result recorded with
+// mark_block(), e.g. when one of its entries is first needed.
+class MappedSnapshot {
+public:
+    // One encoded entry, inside the mapping or inside a decompressed copy of
+    // its block owned by file.
+    struct EntryRef {
+        const MappedSnapshot* file = nullptr;
+        const char* data = nullptr;
+        uint32_t size = 0;
+        uint32_t block = 0;
+    };
+
+    enum class BlockState : uint8_t {
+        Unchecked,
+        Intact,
+        Corrupt
+    };
+
+    // Maps path. Returns nullptr, with the reason in error, if the file
+    // cannot be mapped or is not a binary snapshot this build understands.
+    static std::unique_ptr<MappedSnapshot> open(const std::string& path, std::string& error);
+    ~MappedSnapshot();
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    const SnapshotIntegrity& integrity() const { return file_integrity; }
+    const SnapshotChain& chain() const { return file_chain; }
+    size_t size() const { return length; }
+    const std::string& path() const { return file_path; }
+
+    // Calls visit(key, expiration_time_ms, ref) for every entry. With
+    // verify, blocks whose checksum does not match are counted in
+    // corrupt_blocks, and their entries are only visited if they carry their
+    // own checksums. Without it every block is left Unchecked. Returns false
+    // if the file ends early or is malformed; entries visited before that
+    // stay valid.
+    bool index(const std::function<void(std::string&&, long long, EntryRef)>& visit, size_t& corrupt_blocks,
+               bool verify = true);
+    // Decodes the value of the entry at ref. With verify_entry, and if the
+    // file has per-entry checksums, the entry's own checksum is checked too.
+    // Returns false if it is malformed or does not match.
+    static bool decode(EntryRef ref, ValueWithTTL& value, bool verify_entry = true);
+
+    uint32_t block_count() const { return static_cast<uint32_t>(blocks.size()); }
+    BlockState block_state(uint32_t block) const { return states[block].load(std::memory_order_acquire); }
+    // Recomputes the checksum of a block. Safe to call from any thread.
+    bool check_block(uint32_t block) const;
+    void mark_block(uint32_t block, bool intact) const;
+
+private:
+    MappedSnapshot() = default;
+
+    struct Block {
+        const char* stored;
+        uint32_t len;
+    };
+
+    std::string file_path;
+    const char* base = nullptr;
+    size_t length = 0;
+    size_t header_size = 0;
+    SnapshotIntegrity file_integrity;
+    SnapshotChain file_chain;
+    Compression file_compression = Compression::None;
+    std::vector<std::unique_ptr<char[]>> decompressed;
+    std::vector<Block> blocks;
+    mutable std::deque<std::atomic<BlockState>> states;
+};
+
+#endif // MAPPEDSNAPSHOT_H
@@ -0,0 +1,203 @@
+#include "MerkleTree.h"
+#include "Checksum.h"
+#include "Encoding.h"
+#include "Snapshot.h"
+#include "Sha256.h"
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+namespace {
+
+const MerkleTree::Digest& empty_leaf() {
+    static const MerkleTree::Digest digest = [] {
+        MerkleTree::Digest d;
+        const unsigned char tag = 0x00;
+        sha256(&tag, 1, d.data());
+        return d;
+    }();
+    return digest;
+}
+
+} // namespace
+
+MerkleTree::MerkleTree() : nodes(2 * LEAF_COUNT), counts(LEAF_COUNT) {
+    std::fill(nodes.begin() + LEAF_COUNT, nodes.end(), empty_leaf());
+    hash_inner();
+}
+
+uint32_t MerkleTree::leaf_of(const std::string& key) {
+    return static_cast<uint32_t>(key_hash(key) >> (64 - DEPTH));
+}
+
+MerkleTree::Digest MerkleTree::entry_digest(const std::string& key, const ValueWithTTL& value) {
+    if (!value.has_digest(DigestKind::EntrySha256)) {
+        std::string encoded;
+        put_varint(encoded, key.size());
+        encoded.append(key);
+        put_value(encoded, value);
+        unsigned char digest[32];
+        sha256(encoded.data(), encoded.size(), digest);
+        value.cache_digest(DigestKind::EntrySha256, digest);
+    }
+    return value.digest;
+}
+
+void MerkleTree::add(uint32_t leaf, const Digest& digest) {
+    if (added.empty()) {
+        added.resize(LEAF_COUNT);
+    }
+    added[leaf].push_back(digest);
+    ++counts[leaf];
+}
+
+void MerkleTree::build() {
+    std::string buf;
+    for (uint32_t i = 0; i < added.size(); ++i) {
+        auto& digests = added[i];
+        if (digests.empty()) {
+            continue;
+        }
+        std::sort(digests.begin(), digests.end());
+        buf.assign(1, '\0');
+        for (const auto& d : digests) {
+            buf.append(reinterpret_cast<const char*>(d.data()), d.size());
+        }
+        sha256(buf.data(), buf.size(), nodes[LEAF_COUNT + i].data());
+    }
+    added.clear();
+    added.shrink_to_fit();
+    hash_inner();
+}
+
+void MerkleTree::hash_inner() {
+    unsigned char pair[65];
+    pair[0] = 0x01;
+    for (uint32_t n = LEAF_COUNT - 1; n >= 1; --n) {
+        std::memcpy(pair + 1, nodes[2 * n].data(), 32);
+        std::memcpy(pair + 33, nodes[2 * n + 1].data(), 32);
+        sha256(pair, sizeof(pair), nodes[n].data());
+    }
+}
+
+uint64_t MerkleTree::total_entries() const {
+    uint64_t total = 0;
+    for (uint32_t c : counts) {
+        total += c;
+    }
+    return total;
+}
+
+std::vector<uint32_t> MerkleTree::diff(const MerkleTree& a, const MerkleTree& b) {
+    std::vector<uint32_t> leaves;
+    std::vector<uint32_t> stack{1};
+    while (!stack.empty()) {
+        uint32_t n = stack.back();
+        stack.pop_back();
+        if (a.nodes[n] == b.nodes[n]) {
+            continue;
+        }
+        if (n >= LEAF_COUNT) {
+            leaves.push_back(n - LEAF_COUNT);
+        } else {
+            stack.push_back(2 * n + 1); // Right first, so leaves come out ascending
+            stack.push_back(2 * n);
+        }
+    }
+    return leaves;
+}
+
+uint64_t MerkleTree::missing(const MerkleTree& a, const MerkleTree& b, const std::vector<uint32_t>& leaves) {
+    uint64_t total = 0;
+    for (uint32_t leaf : leaves) {
+        if (a.counts[leaf] > b.counts[leaf]) {
+            total += a.counts[leaf] - b.counts[leaf];
+        }
+    }
+    return total;
+}
+
+std::string MerkleTree::encode() const {
+    std::string out;
+    put_u32(out, LEAF_COUNT);
+    put_u32(out, 0);
+    uint32_t stored = 0;
+    for (uint32_t i = 0; i < LEAF_COUNT; ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        put_u32(out, i);
+        put_u32(out, counts[i]);
+        out.append(reinterpret_cast<const char*>(leaf(i).data()), 32);
+        ++stored;
+    }
+    std::string count;
+    put_u32(count, stored);
+    out.replace(4, 4, count);
+    out.append(reinterpret_cast<const char*>(root().data()), 32);
+    put_u32(out, crc32c(out.data(), out.size()));
+    return out;
+}
+
+size_t MerkleTree::encoded_size(const char* head) {
+    return 8 + static_cast<size_t>(get_u32(head + 4)) * 40 + 32 + 4;
+}
+
+bool MerkleTree::decode(const char* data, size_t len, MerkleTree& tree, size_t* used) {
+    if (len < 8 || get_u32(data) != LEAF_COUNT || get_u32(data + 4) > LEAF_COUNT) {
+        return false;
+    }
+    const size_t size = encoded_size(data);
+    if (len < size || get_u32(data + size - 4) != crc32c(data, size - 4)) {
+        return false;
+    }
+    MerkleTree decoded;
+    const uint32_t stored = get_u32(data + 4);
+    const char* p = data + 8;
+    long long previous = -1;
+    for (uint32_t s = 0; s < stored; ++s, p += 40) {
+        uint32_t leaf = get_u32(p);
+        if (leaf >= LEAF_COUNT || static_cast<long long>(leaf) <= previous) {
+            return false;
+        }
+        previous = leaf;
+        decoded.counts[leaf] = get_u32(p + 4);
+        std::memcpy(decoded.nodes[LEAF_COUNT + leaf].data(), p + 8, 32);
+    }
+    decoded.hash_inner();
+    if (std::memcmp(decoded.root().data(), p, 32) != 0) {
+        return false;
+    }
+    tree = std::move(decoded);
+    if (used) {
+        *used = size;
+    }
+    return true;
+}
+
+bool MerkleTree::read(const std::string& path, MerkleTree& tree, std::string& error) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        error = "cannot open file";
+        return false;
+    }
+    const uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    char footer[16];
+    if (file_size < sizeof(footer) || !file.seekg(file_size - sizeof(footer)) || !file.read(footer, sizeof(footer))
+        || std::memcmp(footer + 8, SNAPSHOT_MANIFEST_MAGIC, sizeof(SNAPSHOT_MANIFEST_MAGIC)) != 0) {
+        error = "no Merkle manifest";
+        return false;
+    }
+    const uint64_t offset = get_u64(footer);
+    if (offset > file_size - sizeof(footer)) {
+        error = "damaged Merkle manifest";
+        return false;
+    }
+    std::string manifest(file_size - sizeof(footer) - offset, '\0');
+    file.seekg(offset);
+    if (!file.read(&manifest[0], manifest.size()) || !decode(manifest.data(), manifest.size(), tree)) {
+        error = "damaged Merkle manifest";
+        return false;
+    }
+    return true;
+}
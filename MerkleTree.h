@@ -0,0 +1,76 @@
+#ifndef MERKLETREE_H
+#define MERKLETREE_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "ValueWithTTL.h"
+
+// Merkle tree over the keyspace. Every key falls into one of LEAF_COUNT
+// leaves by the top bits of key_hash(), so each store partition covers a
+// contiguous run of leaves. A leaf hashes the SHA-256 digests of its
+// entries, sorted so the order they were added in does not matter, and
+// every inner node hashes its two children:
+//   leaf  : SHA-256(0x00 | digest* in ascending order)
+//   inner : SHA-256(0x01 | left | right)
+// An entry digest is the SHA-256 of the entry as a binary snapshot encodes
+// it (varint key_len | key | value), the same one per-entry SHA-256
+// snapshots store, so trees built from a store, a snapshot file or a
+// replica compare equal exactly when their entries do.
+class MerkleTree {
+public:
+    static constexpr unsigned DEPTH = 12;
+    static constexpr uint32_t LEAF_COUNT = 1u << DEPTH;
+    using Digest = std::array<unsigned char, 32>;
+
+    MerkleTree();
+
+    static uint32_t leaf_of(const std::string& key);
+    // Digest of one entry, reusing the one cached on value while it is valid
+    // and caching it otherwise.
+    static Digest entry_digest(const std::string& key, const ValueWithTTL& value);
+
+    void add(uint32_t leaf, const Digest& digest);
+    void add(const std::string& key, const ValueWithTTL& value) { add(leaf_of(key), entry_digest(key, value)); }
+    // Hashes the leaves and the nodes above them. Must be called after the
+    // last add() and before anything below is read.
+    void build();
+
+    const Digest& root() const { return nodes[1]; }
+    const Digest& leaf(uint32_t i) const { return nodes[LEAF_COUNT + i]; }
+    // Entries added to leaf i.
+    uint32_t entries(uint32_t i) const { return counts[i]; }
+    uint64_t total_entries() const;
+
+    // Leaves whose hashes differ, ascending. Only descends into subtrees
+    // whose roots differ, so it costs O(changes * DEPTH) hashes compared.
+    static std::vector<uint32_t> diff(const MerkleTree& a, const MerkleTree& b);
+    // Entries a holds beyond b in leaves, such as those diff() found, i.e.
+    // how many went missing on the way from a to b.
+    static uint64_t missing(const MerkleTree& a, const MerkleTree& b, const std::vector<uint32_t>& leaves);
+
+    // Manifest form, as stored in binary snapshots:
+    //   u32 leaf_count | u32 stored | (u32 leaf | u32 entries | leaf hash)* | root | u32 crc32c
+    // Only non-empty leaves are stored; the crc covers everything before it.
+    std::string encode() const;
+    // Reads a manifest from data, which may continue past it, and checks
+    // its crc and that its leaves add up to its root. Sets *used to the
+    // bytes it took.
+    static bool decode(const char* data, size_t len, MerkleTree& tree, size_t* used = nullptr);
+    // Bytes decode() needs in total, judging by the first 8 of a manifest.
+    static size_t encoded_size(const char* head);
+    // Reads the manifest of a binary snapshot file through its footer
+    // without touching the blocks.
+    static bool read(const std::string& path, MerkleTree& tree, std::string& error);
+
+private:
+    std::vector<Digest> nodes;              // Heap order: root at 1, leaf i at LEAF_COUNT + i
+    std::vector<uint32_t> counts;
+    std::vector<std::vector<Digest>> added; // Entry digests per leaf until build()
+
+    void hash_inner();
+};
+
+#endif // MERKLETREE_H
@@ -0,0 +1,333 @@
+#include "Sha256.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define IMKVS_HAVE_X86_SHA256 1
+#endif
+
+namespace {
+
+constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+constexpr uint32_t INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline uint32_t load_be32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+inline void store_be32(unsigned char* p, uint32_t v) {
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+// A message split into the 64-byte blocks SHA-256 compresses: the complete
+// blocks of the input, then one or two blocks of tail and padding.
+struct PaddedMessage {
+    const unsigned char* data;
+    size_t full_blocks;
+    size_t total_blocks;
+    unsigned char tail[128];
+
+    PaddedMessage() = default;
+    explicit PaddedMessage(const Sha256Message& msg) { reset(msg); }
+
+    void reset(const Sha256Message& msg) {
+        data = static_cast<const unsigned char*>(msg.data);
+        full_blocks = msg.len / 64;
+        size_t rest = msg.len % 64;
+        size_t tail_len = rest + 9 <= 64 ? 64 : 128;
+        total_blocks = full_blocks + tail_len / 64;
+        std::memset(tail, 0, sizeof(tail));
+        if (rest) {
+            std::memcpy(tail, data + full_blocks * 64, rest);
+        }
+        tail[rest] = 0x80;
+        uint64_t bits = static_cast<uint64_t>(msg.len) * 8;
+        for (int i = 0; i < 8; ++i) {
+            tail[tail_len - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+        }
+    }
+
+    const unsigned char* block(size_t i) const {
+        return i < full_blocks ? data + i * 64 : tail + (i - full_blocks) * 64;
+    }
+};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void compress_scalar(uint32_t state[8], const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = load_be32(block + 4 * i);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+#ifdef IMKVS_HAVE_X86_SHA256
+__attribute__((target("sha,sse4.1,ssse3")))
+void compress_shani(uint32_t state[8], const unsigned char* block) {
+    const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The SHA instructions keep the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    const __m128i abef_save = state0;
+    const __m128i cdgh_save = state1;
+
+    // Four rounds per group; msg[g % 4] holds the schedule words of group g
+    __m128i msg[4];
+    for (int g = 0; g < 16; ++g) {
+        if (g < 4) {
+            msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * g)), BYTE_SWAP);
+        }
+        __m128i& cur = msg[g % 4];
+        __m128i wk = _mm_add_epi32(cur, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * g])));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        if (g >= 3 && g <= 14) {
+            __m128i& next = msg[(g + 1) % 4];
+            next = _mm_add_epi32(next, _mm_alignr_epi8(cur, msg[(g + 3) % 4], 4));
+            next = _mm_sha256msg2_epu32(next, cur);
+        }
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+        if (g >= 1 && g <= 12) {
+            __m128i& prev = msg[(g + 3) % 4];
+            prev = _mm_sha256msg1_epu32(prev, cur);
+        }
+    }
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+#define ROTR_X8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+// Hashes up to eight messages, one per lane. Lanes whose message has fewer
+// blocks than the longest one keep their state once they run out.
+__attribute__((target("avx2")))
+void hash_lanes_avx2(const PaddedMessage* const* lanes, size_t count, unsigned char* const* out) {
+    size_t max_blocks = 0;
+    for (size_t l = 0; l < count; ++l) {
+        if (lanes[l]->total_blocks > max_blocks) {
+            max_blocks = lanes[l]->total_blocks;
+        }
+    }
+
+    __m256i s[8];
+    for (int i = 0; i < 8; ++i) {
+        s[i] = _mm256_set1_epi32(static_cast<int>(INITIAL_STATE[i]));
+    }
+
+    alignas(32) uint32_t words[8];
+    alignas(32) int32_t active[8];
+    for (size_t b = 0; b < max_blocks; ++b) {
+        const unsigned char* blocks[8];
+        for (size_t l = 0; l < 8; ++l) {
+            bool live = l < count && b < lanes[l]->total_blocks;
+            active[l] = live ? -1 : 0;
+            blocks[l] = live ? lanes[l]->block(b) : lanes[0]->block(0);
+        }
+
+        __m256i w[16];
+        for (int i = 0; i < 16; ++i) {
+            for (int l = 0; l < 8; ++l) {
+                words[l] = load_be32(blocks[l] + 4 * i);
+            }
+            w[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(words));
+        }
+
+        __m256i a = s[0], bb = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; ++i) {
+            __m256i wi;
+            if (i < 16) {
+                wi = w[i];
+            } else {
+                __m256i w15 = w[(i - 15) & 15];
+                __m256i w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR_X8(w15, 7), ROTR_X8(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR_X8(w2, 17), ROTR_X8(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+                w[i & 15] = wi;
+            }
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(ROTR_X8(e, 6), ROTR_X8(e, 11)), ROTR_X8(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+                _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(K[i])), wi)));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(ROTR_X8(a, 2), ROTR_X8(a, 13)), ROTR_X8(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+            __m256i t2 = _mm256_add_epi32(sigma0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+
+        const __m256i mask = _mm256_load_si256(reinterpret_cast<const __m256i*>(active));
+        const __m256i next[8] = {a, bb, c, d, e, f, g, h};
+        for (int i = 0; i < 8; ++i) {
+            s[i] = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], next[i]), mask);
+        }
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(words), s[i]);
+        for (size_t l = 0; l < count; ++l) {
+            store_be32(out[l] + 4 * i, words[l]);
+        }
+    }
+}
+
+#undef ROTR_X8
+#endif
+
+using CompressFn = void (*)(uint32_t*, const unsigned char*);
+
+void hash_one(CompressFn compress, const Sha256Message& msg, unsigned char* out) {
+    PaddedMessage padded(msg);
+    uint32_t state[8];
+    std::memcpy(state, INITIAL_STATE, sizeof(state));
+    for (size_t b = 0; b < padded.total_blocks; ++b) {
+        compress(state, padded.block(b));
+    }
+    for (int i = 0; i < 8; ++i) {
+        store_be32(out + 4 * i, state[i]);
+    }
+}
+
+CompressFn compress_for(Sha256Backend backend) {
+#ifdef IMKVS_HAVE_X86_SHA256
+    if (backend == Sha256Backend::ShaNi) {
+        return compress_shani;
+    }
+#endif
+    (void)backend;
+    return compress_scalar;
+}
+
+Sha256Backend select_single() {
+    return sha256_supported(Sha256Backend::ShaNi) ? Sha256Backend::ShaNi : Sha256Backend::Scalar;
+}
+
+Sha256Backend select_many() {
+    if (sha256_supported(Sha256Backend::ShaNi)) return Sha256Backend::ShaNi;
+    if (sha256_supported(Sha256Backend::Avx2)) return Sha256Backend::Avx2;
+    return Sha256Backend::Scalar;
+}
+
+} // namespace
+
+bool sha256_supported(Sha256Backend backend) {
+    switch (backend) {
+        case Sha256Backend::Scalar:
+            return true;
+#ifdef IMKVS_HAVE_X86_SHA256
+        case Sha256Backend::ShaNi:
+            return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+        case Sha256Backend::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+const char* sha256_backend_name(Sha256Backend backend) {
+    switch (backend) {
+        case Sha256Backend::Scalar: return "scalar";
+        case Sha256Backend::ShaNi: return "sha-ni";
+        case Sha256Backend::Avx2: return "avx2";
+    }
+    return "unknown";
+}
+
+void sha256(const void* data, size_t len, unsigned char out[32]) {
+    static const CompressFn compress = compress_for(select_single());
+    hash_one(compress, Sha256Message{data, len}, out);
+}
+
+void sha256_many(const Sha256Message* messages, size_t count, unsigned char* out) {
+    static const Sha256Backend backend = select_many();
+    sha256_many(backend, messages, count, out);
+}
+
+void sha256_many(Sha256Backend backend, const Sha256Message* messages, size_t count, unsigned char* out) {
+#ifdef IMKVS_HAVE_X86_SHA256
+    if (backend == Sha256Backend::Avx2) {
+        for (size_t first = 0; first < count; first += 8) {
+            size_t n = count - first < 8 ? count - first : 8;
+            PaddedMessage padded[8];
+            const PaddedMessage* lanes[8];
+            unsigned char* digests[8];
+            for (size_t l = 0; l < n; ++l) {
+                padded[l].reset(messages[first + l]);
+                lanes[l] = &padded[l];
+                digests[l] = out + 32 * (first + l);
+            }
+            hash_lanes_avx2(lanes, n, digests);
+        }
+        return;
+    }
+#endif
+    CompressFn compress = compress_for(backend);
+    for (size_t i = 0; i < count; ++i) {
+        hash_one(compress, messages[i], out + 32 * i);
+    }
+}
+
+std::string sha256_hex(const unsigned char digest[32]) {
+    static const char HEX[] = "0123456789abcdef";
+    std::string hex(64, '0');
+    for (int i = 0; i < 32; ++i) {
+        hex[2 * i] = HEX[digest[i] >> 4];
+        hex[2 * i + 1] = HEX[digest[i] & 0xF];
+    }
+    return hex;
+}
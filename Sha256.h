@@ -0,0 +1,35 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <string>
+
+// SHA-256 with runtime CPU dispatch. Every backend produces the standard
+// digest, so files hashed by one verify under any other.
+enum class Sha256Backend {
+    Scalar, // Portable C++
+    ShaNi,  // x86 SHA extensions, one message at a time
+    Avx2    // Eight messages at once, one per 32-bit AVX2 lane
+};
+
+struct Sha256Message {
+    const void* data;
+    size_t len;
+};
+
+bool sha256_supported(Sha256Backend backend);
+const char* sha256_backend_name(Sha256Backend backend);
+
+// SHA-256 of data into out, on the fastest single-message backend.
+void sha256(const void* data, size_t len, unsigned char out[32]);
+// Hashes count independent messages into out (32 bytes each, in order).
+// Small values are where multi-buffer hashing pays off, so this prefers
+// SHA-NI, then AVX2 lanes, then the portable code.
+void sha256_many(const Sha256Message* messages, size_t count, unsigned char* out);
+// As sha256_many(), on a specific backend, which must be supported.
+void sha256_many(Sha256Backend backend, const Sha256Message* messages, size_t count, unsigned char* out);
+
+// Lowercase hex form of a digest, as stored in JSON snapshots.
+std::string sha256_hex(const unsigned char digest[32]);
+
+#endif // SHA256_H
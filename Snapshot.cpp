@@ -0,0 +1,250 @@
+#include "Snapshot.h"
+#include "Checksum.h"
+#include "Encoding.h"
+#include <cstring>
+
+namespace {
+
+// Sanity limit so a corrupt length field cannot trigger a huge allocation.
+constexpr uint32_t MAX_BLOCK_PAYLOAD = 256u * 1024 * 1024;
+
+} // namespace
+
+SnapshotWriter::SnapshotWriter(std::ostream& out, SnapshotIntegrity integrity, SnapshotChain chain,
+                               Compression compression)
+    : out(out), integrity(integrity), compression(compression) {
+    std::string header(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put_u32(header, SNAPSHOT_VERSION);
+    put_u32(header, static_cast<uint32_t>(integrity.checksum)
+        | (integrity.per_entry ? SNAPSHOT_FLAG_PER_ENTRY : 0)
+        | (chain.base_id ? SNAPSHOT_FLAG_CHAINED : 0)
+        | (compression == Compression::Lz4 ? SNAPSHOT_FLAG_LZ4 : 0)
+        | (integrity.merkle ? SNAPSHOT_FLAG_MERKLE : 0));
+    if (chain.base_id) {
+        put_u64(header, chain.base_id);
+        put_u32(header, chain.sequence);
+    }
+    write(header);
+    block.reserve(BLOCK_SIZE + 1024);
+    if (integrity.merkle) {
+        manifest = std::make_unique<MerkleTree>();
+    }
+}
+
+void SnapshotWriter::write(const std::string& bytes) {
+    out.write(bytes.data(), bytes.size());
+    written += bytes.size();
+}
+
+void SnapshotWriter::add(const std::string& key, const ValueWithTTL& value) {
+    size_t start = block.size();
+    put_varint(block, key.size());
+    block.append(key);
+    put_value(block, value);
+    const bool sha_entry = integrity.per_entry && integrity.checksum == ChecksumType::Sha256;
+    if ((sha_entry || manifest) && !value.has_digest(DigestKind::EntrySha256)) {
+        // SHA-256 is the one worth caching; see ValueWithTTL::digest
+        unsigned char digest[32];
+        sha256(block.data() + start, block.size() - start, digest);
+        value.cache_digest(DigestKind::EntrySha256, digest);
+    }
+    if (manifest) {
+        manifest->add(MerkleTree::leaf_of(key), value.digest);
+    }
+    if (sha_entry) {
+        block.append(reinterpret_cast<const char*>(value.digest.data()), value.digest.size());
+    } else if (integrity.per_entry) {
+        append_checksum(integrity.checksum, block.data() + start, block.size() - start, block);
+    }
+    ++block_entries;
+    ++total_entries;
+    if (block.size() >= BLOCK_SIZE) {
+        flush_block();
+    }
+}
+
+void SnapshotWriter::flush_block() {
+    if (block_entries == 0) {
+        return;
+    }
+    const std::string* stored = &block;
+    uint32_t raw_len = 0;
+    if (compression == Compression::Lz4) {
+        packed.clear();
+        lz4_compress(block.data(), block.size(), packed);
+        if (packed.size() < block.size()) {
+            stored = &packed;
+            raw_len = static_cast<uint32_t>(block.size());
+        }
+    }
+    std::string frame;
+    put_u32(frame, static_cast<uint32_t>(stored->size()));
+    put_u32(frame, block_entries);
+    if (compression != Compression::None) {
+        put_u32(frame, raw_len);
+    }
+    write(frame);
+    write(*stored);
+    frame.clear();
+    append_checksum(integrity.checksum, stored->data(), stored->size(), frame);
+    total_raw += block.size();
+    total_stored += stored->size();
+    write(frame);
+    block.clear();
+    block_entries = 0;
+}
+
+bool SnapshotWriter::finish() {
+    flush_block();
+    std::string end_marker;
+    put_u32(end_marker, 0);
+    put_u32(end_marker, 0);
+    write(end_marker);
+    if (manifest) {
+        manifest->build();
+        const uint64_t offset = written;
+        std::string trailer = manifest->encode();
+        put_u64(trailer, offset);
+        trailer.append(SNAPSHOT_MANIFEST_MAGIC, sizeof(SNAPSHOT_MANIFEST_MAGIC));
+        write(trailer);
+    }
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+SnapshotReader::SnapshotReader(std::istream& in) : in(in) {
+    char header[16];
+    if (!in.read(header, sizeof(header))) {
+        return;
+    }
+    uint32_t flags = get_u32(header + 12);
+    uint32_t checksum = flags & SNAPSHOT_FLAG_CHECKSUM_MASK;
+    file_integrity.checksum = static_cast<ChecksumType>(checksum);
+    file_integrity.per_entry = (flags & SNAPSHOT_FLAG_PER_ENTRY) != 0;
+    file_compression = (flags & SNAPSHOT_FLAG_LZ4) ? Compression::Lz4 : Compression::None;
+    file_merkle = (flags & SNAPSHOT_FLAG_MERKLE) != 0;
+    valid_header = std::memcmp(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+        && get_u32(header + 8) == SNAPSHOT_VERSION
+        && checksum <= static_cast<uint32_t>(ChecksumType::Sha256)
+        && (flags & ~(SNAPSHOT_FLAG_CHECKSUM_MASK | SNAPSHOT_FLAG_PER_ENTRY | SNAPSHOT_FLAG_CHAINED
+                      | SNAPSHOT_FLAG_LZ4 | SNAPSHOT_FLAG_MERKLE)) == 0;
+    if (valid_header && (flags & SNAPSHOT_FLAG_CHAINED)) {
+        char chain[12];
+        if (!in.read(chain, sizeof(chain))) {
+            valid_header = false;
+            return;
+        }
+        file_chain.base_id = get_u64(chain);
+        file_chain.sequence = get_u32(chain + 8);
+    }
+}
+
+bool SnapshotReader::is_snapshot(std::istream& in) {
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    auto start = in.tellg();
+    bool match = in.read(magic, sizeof(magic))
+        && std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+    in.clear();
+    in.seekg(start);
+    return match;
+}
+
+bool SnapshotReader::read_block(SnapshotBlock& block) {
+    if (!valid_header || is_truncated) {
+        return false;
+    }
+    char frame[8];
+    if (!in.read(frame, sizeof(frame))) {
+        is_truncated = true;
+        return false;
+    }
+    uint32_t len = get_u32(frame);
+    block.entry_count = get_u32(frame + 4);
+    if (len == 0 && block.entry_count == 0) {
+        return false;
+    }
+    block.raw_size = 0;
+    if (file_compression != Compression::None) {
+        char raw[4];
+        if (!in.read(raw, sizeof(raw))) {
+            is_truncated = true;
+            return false;
+        }
+        block.raw_size = get_u32(raw);
+    }
+    if (len > MAX_BLOCK_PAYLOAD || block.raw_size > MAX_BLOCK_PAYLOAD) {
+        is_truncated = true;
+        return false;
+    }
+    block.payload.resize(len);
+    block.checksum.resize(checksum_size(file_integrity.checksum));
+    if (!in.read(&block.payload[0], len) || !in.read(&block.checksum[0], block.checksum.size())) {
+        is_truncated = true;
+        return false;
+    }
+    block.integrity = file_integrity;
+    return true;
+}
+
+bool SnapshotReader::read_manifest(MerkleTree& tree) {
+    if (!valid_header || is_truncated || !file_merkle) {
+        return false;
+    }
+    std::string manifest(8, '\0');
+    if (!in.read(&manifest[0], 8)) {
+        return false;
+    }
+    const size_t size = MerkleTree::encoded_size(manifest.data());
+    if (size > MAX_BLOCK_PAYLOAD) {
+        return false;
+    }
+    manifest.resize(size);
+    return in.read(&manifest[8], size - 8) && MerkleTree::decode(manifest.data(), manifest.size(), tree);
+}
+
+bool SnapshotReader::verify(const SnapshotBlock& block) {
+    return block.checksum.size() == checksum_size(block.integrity.checksum)
+        && verify_checksum(block.integrity.checksum, block.payload.data(), block.payload.size(), block.checksum.data());
+}
+
+bool SnapshotReader::decode_block(const SnapshotBlock& block, std::vector<std::pair<std::string, ValueWithTTL>>& out,
+                                  bool verify_entries, size_t* rejected) {
+    std::string raw;
+    const std::string* payload = &block.payload;
+    if (block.raw_size != 0) {
+        raw.resize(block.raw_size);
+        if (!lz4_decompress(block.payload.data(), block.payload.size(), &raw[0], raw.size())) {
+            return false;
+        }
+        payload = &raw;
+    }
+    Cursor cur{payload->data(), payload->data() + payload->size()};
+    const size_t digest_size = block.integrity.per_entry ? checksum_size(block.integrity.checksum) : 0;
+    out.reserve(out.size() + block.entry_count);
+    for (uint32_t i = 0; i < block.entry_count; ++i) {
+        const char* start = cur.p;
+        std::string key;
+        ValueWithTTL value;
+        if (!cur.string(key) || !get_value(cur, value)) {
+            return false;
+        }
+        if (digest_size) {
+            if (static_cast<size_t>(cur.end - cur.p) < digest_size) {
+                return false;
+            }
+            const char* digest = cur.p;
+            cur.p += digest_size;
+            if (verify_entries && !verify_checksum(block.integrity.checksum, start, digest - start, digest)) {
+                if (rejected) {
+                    ++*rejected;
+                }
+                continue;
+            }
+            if (block.integrity.checksum == ChecksumType::Sha256) {
+                value.cache_digest(DigestKind::EntrySha256, reinterpret_cast<const unsigned char*>(digest));
+            }
+        }
+        out.emplace_back(std::move(key), std::move(value));
+    }
+    return cur.p == cur.end;
+}
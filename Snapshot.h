@@ -0,0 +1,173 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+
+#include "ValueWithTTL.h"
+#include "Checksum.h"
+#include "Compression.h"
+#include "MerkleTree.h"
+
+// Binary snapshot format
+// ----------------------
+//   header : "IMKVSNAP" | u32 version | u32 flags
+//   block  : u32 payload_len | u32 entry_count | payload | checksum(payload)
+//   end    : a block header with payload_len == 0 and entry_count == 0
+//
+// Every entry inside a payload is
+//   varint key_len | key | u8 type | zigzag expiration_time_ms | value
+//   [ | checksum(entry) ]
+// where value is varint len + bytes for strings, a zigzag varint for
+// integers and 8 little-endian bytes for floats. All fixed-width fields are
+// little-endian. Blocks are checksummed independently, so a damaged block
+// only loses the entries it holds.
+//
+// The low byte of flags is the ChecksumType used for every checksum in the
+// file (0, CRC-32C, in files written before it was selectable). With
+// SNAPSHOT_FLAG_PER_ENTRY each entry also carries its own checksum, so the
+// intact entries of a damaged block can still be loaded.
+//
+// With SNAPSHOT_FLAG_CHAINED the header continues with u64 base_id and
+// u32 sequence. Sequence 0 is a full base snapshot; sequence N is the Nth
+// delta on top of the base with that id, holding only the keys written
+// since the previous one. A deleted key is stored as an entry that expired
+// at time 0, so applying it removes the key.
+//
+// With SNAPSHOT_FLAG_LZ4 every block header gains a third field,
+//   block  : u32 stored_len | u32 entry_count | u32 raw_len | stored | checksum(stored)
+// where stored is the payload compressed as one LZ4 block, or the payload
+// itself when raw_len is 0 because compressing it did not pay off. Blocks
+// are compressed independently, so they can still be verified and decoded
+// in parallel; the checksum covers the stored bytes and is checked before
+// anything is decompressed.
+//
+// With SNAPSHOT_FLAG_MERKLE a Merkle manifest of every entry written (see
+// MerkleTree) follows the end marker, and the file closes with
+//   footer : u64 manifest_offset | "IMKVMRKL"
+// so the manifest can be read without walking the blocks. Readers that
+// stop at the end marker never see either. Delta snapshots carry none.
+
+constexpr char SNAPSHOT_MAGIC[8] = {'I', 'M', 'K', 'V', 'S', 'N', 'A', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_FLAG_CHECKSUM_MASK = 0xFF;
+constexpr uint32_t SNAPSHOT_FLAG_PER_ENTRY = 1u << 8;
+constexpr uint32_t SNAPSHOT_FLAG_CHAINED = 1u << 9;
+constexpr uint32_t SNAPSHOT_FLAG_LZ4 = 1u << 10;
+constexpr uint32_t SNAPSHOT_FLAG_MERKLE = 1u << 11;
+constexpr char SNAPSHOT_MANIFEST_MAGIC[8] = {'I', 'M', 'K', 'V', 'M', 'R', 'K', 'L'};
+constexpr long long SNAPSHOT_TOMBSTONE_EXPIRATION = 0;
+
+enum class SnapshotFormat {
+    Json,
+    Binary
+};
+
+struct SnapshotIntegrity {
+    ChecksumType checksum = ChecksumType::Crc32c;
+    bool per_entry = false;
+    bool merkle = false; // Append a Merkle manifest; see MerkleTree
+};
+
+// Position of a snapshot in a base + delta chain; base_id 0 means the
+// snapshot is not part of one.
+struct SnapshotChain {
+    uint64_t base_id = 0;
+    uint32_t sequence = 0;
+};
+
+struct SnapshotBlock {
+    std::string payload;  // As stored, i.e. still compressed if raw_size != 0
+    uint32_t entry_count = 0;
+    uint32_t raw_size = 0; // Decompressed payload size, 0 if stored as is
+    std::string checksum; // As stored in the file; see SnapshotReader::verify()
+    SnapshotIntegrity integrity;
+};
+
+class SnapshotWriter {
+public:
+    // Target uncompressed payload size of one block.
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    explicit SnapshotWriter(std::ostream& out, SnapshotIntegrity integrity = {}, SnapshotChain chain = {},
+                            Compression compression = Compression::None);
+
+    // With per-entry SHA-256 or a Merkle manifest, reuses the digest cached
+    // on value when it is still valid, and caches the one it computes
+    // otherwise.
+    void add(const std::string& key, const ValueWithTTL& value);
+    // Flushes the last block and writes the end marker, and the manifest if
+    // there is one. Returns false if the stream went bad at any point.
+    bool finish();
+
+    uint64_t entries_written() const { return total_entries; }
+    // Payload bytes before and after compression, excluding block framing.
+    uint64_t raw_bytes() const { return total_raw; }
+    uint64_t stored_bytes() const { return total_stored; }
+
+private:
+    std::ostream& out;
+    SnapshotIntegrity integrity;
+    Compression compression;
+    std::string block;
+    std::string packed;
+    uint32_t block_entries = 0;
+    uint64_t total_entries = 0;
+    uint64_t total_raw = 0;
+    uint64_t total_stored = 0;
+    uint64_t written = 0;
+    std::unique_ptr<MerkleTree> manifest; // Only with integrity.merkle
+
+    void write(const std::string& bytes);
+    void flush_block();
+};
+
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::istream& in);
+
+    // True if the stream starts with the snapshot magic. Does not consume it.
+    static bool is_snapshot(std::istream& in);
+
+    // False for unknown versions and for flags this build does not know.
+    bool header_ok() const { return valid_header; }
+    const SnapshotIntegrity& integrity() const { return file_integrity; }
+    const SnapshotChain& chain() const { return file_chain; }
+    Compression compression() const { return file_compression; }
+    // Reads the next block. Returns false at the end marker, or if the file
+    // ends early or is malformed, in which case truncated() is set.
+    bool read_block(SnapshotBlock& block);
+    bool truncated() const { return is_truncated; }
+    bool has_manifest() const { return file_merkle; }
+    // Reads the Merkle manifest that follows the end marker; call it once
+    // read_block() has returned false without truncated().
+    bool read_manifest(MerkleTree& tree);
+
+    // Recomputes the payload checksum and compares it with the stored one.
+    // Kept apart from read_block() so blocks can be verified off the
+    // reading thread.
+    static bool verify(const SnapshotBlock& block);
+    // Decodes every entry of a block payload into out, decompressing it
+    // first if needed. Returns false if the payload is malformed; entries
+    // decoded before the fault are kept. With
+    // verify_entries, entries of a per-entry checksummed block whose own
+    // checksum does not match are left out and counted in *rejected.
+    static bool decode_block(const SnapshotBlock& block, std::vector<std::pair<std::string, ValueWithTTL>>& out,
+                             bool verify_entries = false, size_t* rejected = nullptr);
+
+private:
+    std::istream& in;
+    SnapshotIntegrity file_integrity;
+    SnapshotChain file_chain;
+    Compression file_compression = Compression::None;
+    bool file_merkle = false;
+    bool valid_header = false;
+    bool is_truncated = false;
+};
+
+#endif // SNAPSHOT_H
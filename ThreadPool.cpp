@@ -0,0 +1,62 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queued)
+    : max_queued(max_queued ? max_queued : 2 * (threads ? threads : 1)) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::default_size() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mtx);
+    task_taken.wait(lock, [this] { return tasks.size() < max_queued; });
+    tasks.push_back(std::move(task));
+    lock.unlock();
+    task_ready.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    idle.wait(lock, [this] { return tasks.empty() && running == 0; });
+}
+
+void ThreadPool::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        task_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+            return; // stopping, and nothing left to do
+        }
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        ++running;
+        lock.unlock();
+        task_taken.notify_one();
+        task();
+        lock.lock();
+        --running;
+        if (tasks.empty() && running == 0) {
+            idle.notify_all();
+        }
+    }
+}
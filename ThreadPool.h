@@ -0,0 +1,46 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+// Fixed set of worker threads draining a FIFO task queue. submit() blocks
+// while max_queued tasks are already waiting, so a producer that reads
+// faster than the workers can process cannot buffer a whole file in memory.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = default_size(), size_t max_queued = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task);
+    // Blocks until every task submitted so far has finished.
+    void wait();
+
+    size_t size() const { return workers.size(); }
+    // One worker per hardware thread.
+    static size_t default_size();
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    size_t max_queued;
+    size_t running = 0;
+    bool stopping = false;
+
+    std::mutex mtx;
+    std::condition_variable task_ready;
+    std::condition_variable task_taken;
+    std::condition_variable idle;
+
+    void run();
+};
+
+#endif // THREADPOOL_H
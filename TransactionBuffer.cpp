@@ -0,0 +1,65 @@
+#include "TransactionBuffer.h"
+#include "Checksum.h"
+#include <functional>
+#include <utility>
+
+size_t TransactionBuffer::slot_for(const std::string& key, uint64_t hash) const {
+    const size_t mask = index.size() - 1;
+    size_t slot = hash & mask;
+    while (index[slot] != 0) {
+        const Record& rec = records[index[slot] - 1];
+        if (rec.hash == hash && rec.key == key) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void TransactionBuffer::grow_index() {
+    std::vector<uint32_t> old;
+    old.swap(index);
+    index.assign(old.empty() ? 16 : old.size() * 2, 0);
+    const size_t mask = index.size() - 1;
+    // Hashes are cached in the records, so growing never rehashes a key.
+    for (uint32_t pos : old) {
+        if (pos == 0) continue;
+        size_t slot = records[pos - 1].hash & mask;
+        while (index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = pos;
+    }
+}
+
+const std::optional<ValueWithTTL>* TransactionBuffer::find(const std::string& key) const {
+    if (records.empty()) {
+        return nullptr;
+    }
+    uint32_t pos = index[slot_for(key, key_hash(key))];
+    return pos == 0 ? nullptr : &records[pos - 1].value;
+}
+
+std::optional<ValueWithTTL>* TransactionBuffer::find(const std::string& key) {
+    return const_cast<std::optional<ValueWithTTL>*>(std::as_const(*this).find(key));
+}
+
+std::optional<ValueWithTTL>& TransactionBuffer::put(const std::string& key, std::optional<ValueWithTTL> value) {
+    if ((records.size() + 1) * 2 > index.size()) {
+        grow_index();
+    }
+    uint64_t hash = key_hash(key);
+    size_t slot = slot_for(key, hash);
+    if (index[slot] != 0) {
+        return records[index[slot] - 1].value = std::move(value);
+    }
+    records.push_back({key, std::move(value), hash});
+    index[slot] = static_cast<uint32_t>(records.size());
+    return records.back().value;
+}
+
+void TransactionBuffer::clear() {
+    // Release the memory of a bulk transaction instead of keeping it around.
+    std::vector<Record>().swap(records);
+    std::vector<uint32_t>().swap(index);
+}
@@ -0,0 +1,41 @@
+#ifndef TRANSACTIONBUFFER_H
+#define TRANSACTIONBUFFER_H
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+#include "ValueWithTTL.h"
+
+// Write set of an open transaction. Staged writes are kept in a flat append
+// buffer with a small open-addressing index of record positions, so a bulk
+// transaction of millions of writes costs one record each instead of a second
+// full std::unordered_map with a node and key copy per entry.
+class TransactionBuffer {
+public:
+    struct Record {
+        std::string key;
+        std::optional<ValueWithTTL> value; // std::nullopt stages a delete
+        uint64_t hash; // key_hash(key)
+    };
+
+    // Returns the staged write for key, or nullptr if the key is untouched.
+    const std::optional<ValueWithTTL>* find(const std::string& key) const;
+    std::optional<ValueWithTTL>* find(const std::string& key);
+    std::optional<ValueWithTTL>& put(const std::string& key, std::optional<ValueWithTTL> value);
+    void clear();
+
+    size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+    const std::vector<Record>& entries() const { return records; }
+
+private:
+    std::vector<Record> records;
+    std::vector<uint32_t> index; // record position + 1, 0 marks an empty slot
+
+    size_t slot_for(const std::string& key, uint64_t hash) const;
+    void grow_index();
+};
+
+#endif // TRANSACTIONBUFFER_H
@@ -0,0 +1,54 @@
+#ifndef VALUEWITHTTL_H
+#define VALUEWITHTTL_H
+
+#include <string>
+#include <chrono>
+#include <variant>
+#include <array>
+#include <cstring>
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+// What a digest cached on an entry was computed over.
+enum class DigestKind : unsigned char {
+    None,
+    JsonValueSha256, // The compact JSON of the value, as in JSON snapshots
+    EntrySha256      // The encoded entry, as in per-entry binary checksums
+};
+
+struct ValueWithTTL {
+    std::variant<std::string, long long, double> data;
+    long long expiration_time_ms = -1;
+    unsigned long long version = 0; // Bumped on every write, used by cas_version()
+
+    // SHA-256 left by the last save or load. Every write bumps version, so
+    // the digest is only reused while the entry is unchanged since then.
+    mutable DigestKind digest_kind = DigestKind::None;
+    mutable unsigned long long digest_version = 0;
+    mutable std::array<unsigned char, 32> digest{};
+
+    bool has_digest(DigestKind kind) const {
+        return digest_kind == kind && digest_version == version;
+    }
+    void cache_digest(DigestKind kind, const unsigned char* bytes) const {
+        digest_kind = kind;
+        digest_version = version;
+        std::memcpy(digest.data(), bytes, digest.size());
+    }
+
+    bool is_expired() const {
+        if (expiration_time_ms == -1) {
+            return false;
+        }
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+        return now > expiration_time_ms;
+    }
+};
+
+void to_json(json& j, const ValueWithTTL& v);
+void from_json(const json& j, ValueWithTTL& v);
+
+#endif // VALUEWITHTTL_H
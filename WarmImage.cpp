@@ -0,0 +1,343 @@
+#include "WarmImage.h"
+#include "Checksum.h"
+#include "Encoding.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+constexpr char WARM_MAGIC[8] = {'I', 'M', 'K', 'V', 'W', 'A', 'R', 'M'};
+constexpr uint32_t WARM_VERSION = 1;
+constexpr uint32_t STATE_DIRTY = 0;
+constexpr uint32_t STATE_CLEAN = 1;
+constexpr size_t STATE_OFFSET = 12;
+constexpr size_t DIRECTORY_OFFSET = 32;
+constexpr size_t CRC_OFFSET = DIRECTORY_OFFSET + WarmImage::PARTITIONS * 16;
+constexpr size_t HEADER_SIZE = CRC_OFFSET + 8; // crc padded so the partitions start 8-aligned
+constexpr size_t SLOT_SIZE = 16;
+// Set in the entry_offset of a slot whose entry was taken. Entries never
+// start anywhere near that far into the file.
+constexpr unsigned char TAKEN = 0x80;
+
+void set_u32(char* p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+    }
+}
+
+void set_u64(char* p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+    }
+}
+
+bool write_all(int fd, const char* p, size_t left) {
+    while (left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, const char* p, size_t left, off_t offset) {
+    while (left > 0) {
+        ssize_t n = ::pwrite(fd, p, left, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+        offset += n;
+    }
+    return true;
+}
+
+bool fsync_parent(const std::string& path) {
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+} // namespace
+
+WarmImage::Writer::~Writer() {
+    if (fd >= 0) {
+        ::close(fd);
+        std::remove(temp.c_str());
+    }
+}
+
+bool WarmImage::Writer::open(const std::string& path) {
+    target = path;
+    temp = path + ".tmp";
+    fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    // Left zeroed, and so dirty, until finish()
+    const std::string header(HEADER_SIZE, '\0');
+    offset = HEADER_SIZE;
+    return write_all(fd, header.data(), header.size());
+}
+
+bool WarmImage::Writer::add_partition(const Entries& entries) {
+    if (fd < 0 || partition == PARTITIONS) {
+        return false;
+    }
+    ++partition;
+    uint32_t capacity = 0;
+    if (!entries.empty()) {
+        // At most half full, so probes stay short
+        capacity = 2;
+        while (capacity < 2 * entries.size()) {
+            capacity <<= 1;
+        }
+    }
+    const uint64_t slots_offset = capacity ? offset : 0;
+    const uint64_t arena_offset = offset + static_cast<uint64_t>(capacity) * SLOT_SIZE;
+    std::string slots(static_cast<size_t>(capacity) * SLOT_SIZE, '\0');
+    std::string arena;
+    for (const auto& [key, value] : entries) {
+        const uint64_t hash = key_hash(key);
+        size_t i = hash & (capacity - 1);
+        while (get_u64(&slots[i * SLOT_SIZE + 8]) != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        set_u64(&slots[i * SLOT_SIZE], hash);
+        set_u64(&slots[i * SLOT_SIZE + 8], arena_offset + arena.size());
+        put_varint(arena, key.size());
+        arena.append(key);
+        put_value(arena, value);
+    }
+    put_u64(directory, slots_offset);
+    put_u32(directory, capacity);
+    put_u32(directory, static_cast<uint32_t>(entries.size()));
+    offset = arena_offset + arena.size();
+    return write_all(fd, slots.data(), slots.size()) && write_all(fd, arena.data(), arena.size());
+}
+
+bool WarmImage::Writer::finish(unsigned long long next_version) {
+    if (fd < 0 || partition != PARTITIONS) {
+        return false;
+    }
+    std::string header(WARM_MAGIC, sizeof(WARM_MAGIC));
+    put_u32(header, WARM_VERSION);
+    put_u32(header, STATE_CLEAN);
+    put_u64(header, next_version);
+    put_u64(header, offset);
+    header += directory;
+    put_u32(header, crc32c(header.data() + 16, header.size() - 16));
+    header.resize(HEADER_SIZE, '\0');
+    // The image only appears under target once all of it is durable
+    bool ok = pwrite_all(fd, header.data(), header.size(), 0) && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    fd = -1;
+    if (!ok || std::rename(temp.c_str(), target.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return fsync_parent(target);
+}
+
+std::unique_ptr<WarmImage> WarmImage::attach(const std::string& path, std::string& error) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    char header[HEADER_SIZE];
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE
+        || ::pread(fd, header, HEADER_SIZE, 0) != static_cast<ssize_t>(HEADER_SIZE)
+        || std::memcmp(header, WARM_MAGIC, sizeof(WARM_MAGIC)) != 0 || get_u32(header + 8) != WARM_VERSION) {
+        error = "not a warm image this build understands";
+        ::close(fd);
+        return nullptr;
+    }
+    if (get_u32(header + STATE_OFFSET) != STATE_CLEAN) {
+        error = "it was not shut down cleanly";
+        ::close(fd);
+        return nullptr;
+    }
+    if (get_u32(header + CRC_OFFSET) != crc32c(header + 16, CRC_OFFSET - 16)
+        || get_u64(header + 24) != static_cast<uint64_t>(st.st_size)) {
+        error = "damaged header";
+        ::close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<WarmImage> image(new WarmImage());
+    image->file_path = path;
+    image->length = static_cast<size_t>(st.st_size);
+    image->stored_version = get_u64(header + 16);
+    for (size_t p = 0; p < PARTITIONS; ++p) {
+        const char* d = header + DIRECTORY_OFFSET + p * 16;
+        const uint64_t slots_offset = get_u64(d);
+        const uint32_t capacity = get_u32(d + 8);
+        const uint32_t entries = get_u32(d + 12);
+        if (entries > capacity
+            || (capacity && ((capacity & (capacity - 1)) != 0 || slots_offset < HEADER_SIZE
+                             || slots_offset > image->length
+                             || (image->length - slots_offset) / SLOT_SIZE < capacity))) {
+            error = "damaged header";
+            ::close(fd);
+            return nullptr;
+        }
+        image->tables[p].capacity = capacity;
+        image->tables[p].live = entries;
+        image->tables[p].slots_offset = slots_offset;
+    }
+
+    // Private, so taking entries out never writes to the file
+    void* addr = ::mmap(nullptr, image->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        error = std::strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    image->base = static_cast<char*>(addr);
+
+    // In use from here on: a crash must not leave it looking clean
+    char dirty[4];
+    set_u32(dirty, STATE_DIRTY);
+    if (!pwrite_all(fd, dirty, sizeof(dirty), STATE_OFFSET) || ::fdatasync(fd) != 0) {
+        error = std::string("cannot mark it in use: ") + std::strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    ::close(fd);
+    return image;
+}
+
+WarmImage::~WarmImage() {
+    if (base) {
+        ::munmap(base, length);
+    }
+}
+
+size_t WarmImage::entries() const {
+    size_t total = 0;
+    for (const auto& table : tables) {
+        total += table.live;
+    }
+    return total;
+}
+
+const char* WarmImage::entry_at(size_t p, size_t slot) const {
+    const char* s = slot_at(p, slot);
+    const uint64_t offset = get_u64(s + 8);
+    if (offset == 0 || (static_cast<unsigned char>(s[15]) & TAKEN) || offset >= length) {
+        return nullptr;
+    }
+    return base + offset;
+}
+
+size_t WarmImage::find(size_t p, const std::string& key) const {
+    const Table& table = tables[p];
+    if (table.capacity == 0 || table.live == 0) {
+        return npos;
+    }
+    const uint64_t hash = key_hash(key);
+    const size_t mask = table.capacity - 1;
+    size_t i = hash & mask;
+    for (size_t probes = 0; probes < table.capacity; ++probes, i = (i + 1) & mask) {
+        const char* s = slot_at(p, i);
+        if (get_u64(s + 8) == 0) {
+            return npos;
+        }
+        if (get_u64(s) != hash) {
+            continue;
+        }
+        const char* entry = entry_at(p, i);
+        if (!entry) {
+            continue;
+        }
+        Cursor cur{entry, base + length};
+        uint64_t len;
+        if (cur.varint(len) && len == key.size() && static_cast<uint64_t>(cur.end - cur.p) >= len
+            && std::memcmp(cur.p, key.data(), key.size()) == 0) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+bool WarmImage::decode(size_t p, size_t slot, ValueWithTTL& value) const {
+    const char* entry = entry_at(p, slot);
+    if (!entry) {
+        return false;
+    }
+    Cursor cur{entry, base + length};
+    uint64_t len;
+    if (!cur.varint(len) || static_cast<uint64_t>(cur.end - cur.p) < len) {
+        return false;
+    }
+    cur.p += len;
+    return get_value(cur, value);
+}
+
+std::string WarmImage::encoded(size_t p, size_t slot) const {
+    const char* entry = entry_at(p, slot);
+    if (!entry) {
+        return {};
+    }
+    Cursor cur{entry, base + length};
+    uint64_t len;
+    long long expiration;
+    if (!cur.varint(len) || static_cast<uint64_t>(cur.end - cur.p) < len) {
+        return std::string(entry, cur.p);
+    }
+    cur.p += len;
+    skip_value(cur, expiration);
+    return std::string(entry, cur.p);
+}
+
+void WarmImage::take(size_t p, size_t slot) {
+    slot_at(p, slot)[15] |= static_cast<char>(TAKEN);
+    --tables[p].live;
+}
+
+bool WarmImage::drop(size_t p, const std::string& key) {
+    size_t slot = find(p, key);
+    if (slot == npos) {
+        return false;
+    }
+    take(p, slot);
+    return true;
+}
+
+void WarmImage::visit(size_t p, const std::function<void(std::string&, ValueWithTTL&)>& fn) const {
+    const Table& table = tables[p];
+    if (table.live == 0) {
+        return;
+    }
+    std::string key;
+    for (size_t i = 0; i < table.capacity; ++i) {
+        const char* entry = entry_at(p, i);
+        if (!entry) {
+            continue;
+        }
+        Cursor cur{entry, base + length};
+        ValueWithTTL value;
+        if (cur.string(key) && get_value(cur, value)) {
+            fn(key, value);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef WARMIMAGE_H
+#define WARMIMAGE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <array>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#include "ValueWithTTL.h"
+
+// Warm-restart image
+// ------------------
+// The whole store as it stood at a clean shutdown, laid out so a restarted
+// process can map it and serve from it straight away: every partition has
+// an open-addressing table of slots that point at encoded entries by file
+// offset, so nothing is parsed, hashed or rebuilt up front.
+//   header    : "IMKVWARM" | u32 version | u32 state | u64 next_version | u64 length
+//               | PARTITIONS * (u64 slots_offset | u32 capacity | u32 entries) | u32 crc32c
+//   partition : capacity * (u64 key_hash | u64 entry_offset) | entry*
+//   entry     : varint key_len | key | value (as in binary snapshots)
+// An entry_offset of 0 marks an empty slot. The crc covers the header from
+// next_version on. state is only set to clean once the rest is durable, and
+// attach() sets it back to dirty before the image is used, so an image is
+// trusted at most once and never after a crash.
+class WarmImage {
+public:
+    static constexpr size_t PARTITIONS = 64;
+    static constexpr size_t npos = SIZE_MAX;
+    using Entries = std::vector<std::pair<std::string, ValueWithTTL>>;
+
+    // Writes an image to <path>.tmp, one partition at a time in order, and
+    // renames it over path once finish() has made it durable.
+    class Writer {
+    public:
+        ~Writer();
+        bool open(const std::string& path);
+        bool add_partition(const Entries& entries);
+        bool finish(unsigned long long next_version);
+
+    private:
+        int fd = -1;
+        std::string target;
+        std::string temp;
+        uint64_t offset = 0;
+        size_t partition = 0;
+        std::string directory;
+    };
+
+    // Maps a cleanly shut down image at path and marks it dirty. Returns
+    // nullptr, with the reason in error, otherwise.
+    static std::unique_ptr<WarmImage> attach(const std::string& path, std::string& error);
+    ~WarmImage();
+
+    WarmImage(const WarmImage&) = delete;
+    WarmImage& operator=(const WarmImage&) = delete;
+
+    const std::string& path() const { return file_path; }
+    unsigned long long next_version() const { return stored_version; }
+    // Entries not taken yet.
+    size_t entries() const;
+
+    // Slot of key in partition p, or npos if it is not there or was taken.
+    size_t find(size_t p, const std::string& key) const;
+    bool decode(size_t p, size_t slot, ValueWithTTL& value) const;
+    // The encoded entry in slot, for quarantining one that does not decode.
+    std::string encoded(size_t p, size_t slot) const;
+    // Removes the entry in slot from the image. Only the private mapping
+    // changes, never the file. Different partitions may be changed at once.
+    void take(size_t p, size_t slot);
+    bool drop(size_t p, const std::string& key);
+    // Calls visit(key, value) for every entry of partition p not taken yet.
+    // Entries that do not decode are skipped.
+    void visit(size_t p, const std::function<void(std::string&, ValueWithTTL&)>& fn) const;
+
+private:
+    WarmImage() = default;
+
+    struct Table {
+        uint64_t slots_offset = 0;
+        uint32_t capacity = 0;
+        size_t live = 0;
+    };
+
+    char* slot_at(size_t p, size_t slot) const { return base + tables[p].slots_offset + slot * 16; }
+    const char* entry_at(size_t p, size_t slot) const;
+
+    std::string file_path;
+    char* base = nullptr;
+    size_t length = 0;
+    unsigned long long stored_version = 0;
+    std::array<Table, PARTITIONS> tables;
+};
+
+#endif // WARMIMAGE_H
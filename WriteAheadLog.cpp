@@ -0,0 +1,810 @@
+#include "WriteAheadLog.h"
+#include "Checksum.h"
+#include "Encoding.h"
+#include "Compression.h"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+constexpr char LOG_MAGIC[8] = {'I', 'M', 'K', 'V', 'S', 'L', 'O', 'G'};
+constexpr uint32_t LOG_VERSION = 2;
+constexpr uint32_t LOG_MIN_VERSION = 1; // Read, and upgraded before appending
+constexpr off_t LOG_HEADER_SIZE = 12;
+constexpr uint32_t MAX_RECORD_PAYLOAD = WriteAheadLog::MAX_RECORD_PAYLOAD;
+
+constexpr unsigned char FLAG_IN_TRXN = 0x01;
+// Payload type of a batch of LZ4-compressed records
+constexpr unsigned char BATCH_LZ4 = 0x80;
+// Smaller writes are left alone; they would barely compress.
+constexpr size_t MIN_BATCH_COMPRESS = 4096;
+// Compaction writes and copies in pieces of this size.
+constexpr size_t REWRITE_CHUNK = 256 * 1024;
+
+std::string log_header() {
+    std::string header(LOG_MAGIC, sizeof(LOG_MAGIC));
+    put_u32(header, LOG_VERSION);
+    return header;
+}
+
+// Packs the leading records of frames into one compressed batch record, up
+// to the end of the last record that is not part of an open transaction.
+// Whatever follows is kept as plain frames. Returns frames unchanged if
+// compression does not pay off.
+std::string pack_batch(std::string frames) {
+    size_t settled = 0;
+    size_t pos = 0;
+    while (frames.size() - pos >= 10) {
+        uint32_t len = get_u32(frames.data() + pos);
+        unsigned char type = static_cast<unsigned char>(frames[pos + 8]);
+        unsigned char flags = static_cast<unsigned char>(frames[pos + 9]);
+        pos += 8 + len;
+        if (type == LogRecord::COMMIT || !(flags & FLAG_IN_TRXN)) {
+            settled = pos;
+        }
+    }
+    if (settled < MIN_BATCH_COMPRESS) {
+        return frames;
+    }
+    std::string payload;
+    payload.push_back(static_cast<char>(BATCH_LZ4));
+    payload.push_back(0);
+    put_varint(payload, settled);
+    lz4_compress(frames.data(), settled, payload);
+    if (payload.size() + 8 >= settled) {
+        return frames;
+    }
+    std::string packed;
+    packed.reserve(8 + payload.size() + frames.size() - settled);
+    put_u32(packed, static_cast<uint32_t>(payload.size()));
+    put_u32(packed, crc32c(payload.data(), payload.size()));
+    packed.append(payload);
+    packed.append(frames, settled, std::string::npos);
+    return packed;
+}
+
+bool decode_record(const char* data, size_t len, LogRecord& rec) {
+    Cursor cur{data, data + len};
+    unsigned char type, flags;
+    if (!cur.u8(type) || !cur.u8(flags) || !cur.string(rec.key)) {
+        return false;
+    }
+    rec.type = static_cast<LogRecord::Type>(type);
+    rec.in_trxn = flags & FLAG_IN_TRXN;
+    bool ok = false;
+    switch (rec.type) {
+        case LogRecord::SET:
+            ok = get_value(cur, rec.value);
+            break;
+        case LogRecord::REMOVE:
+        case LogRecord::COMMIT:
+            ok = true;
+            break;
+        case LogRecord::INCRBY:
+            ok = cur.zigzag(rec.delta) && get_value(cur, rec.value);
+            break;
+        case LogRecord::INCRBYFLOAT:
+            ok = cur.f64(rec.fdelta) && get_value(cur, rec.value);
+            break;
+        case LogRecord::TRANSACTION: {
+            uint64_t count;
+            if (!cur.varint(count) || count > static_cast<uint64_t>(cur.end - cur.p)) {
+                return false;
+            }
+            rec.writes.resize(count);
+            for (auto& write : rec.writes) {
+                // Checked before decoding, so transactions never nest
+                uint64_t write_len;
+                if (!cur.varint(write_len) || write_len == 0 || static_cast<uint64_t>(cur.end - cur.p) < write_len
+                    || (*cur.p != LogRecord::SET && *cur.p != LogRecord::REMOVE)
+                    || !decode_record(cur.p, write_len, write) || write.in_trxn) {
+                    return false;
+                }
+                cur.p += write_len;
+            }
+            ok = true;
+            break;
+        }
+    }
+    return ok && cur.p == cur.end;
+}
+
+bool decode_record(const std::string& payload, LogRecord& rec) {
+    return decode_record(payload.data(), payload.size(), rec);
+}
+
+void put_payload(std::string& payload, const LogRecord& record) {
+    payload.push_back(static_cast<char>(record.type));
+    payload.push_back(static_cast<char>(record.in_trxn ? FLAG_IN_TRXN : 0));
+    put_varint(payload, record.key.size());
+    payload.append(record.key);
+    switch (record.type) {
+        case LogRecord::SET:
+            put_value(payload, record.value);
+            break;
+        case LogRecord::REMOVE:
+        case LogRecord::COMMIT:
+            break;
+        case LogRecord::INCRBY:
+            put_zigzag(payload, record.delta);
+            put_value(payload, record.value);
+            break;
+        case LogRecord::INCRBYFLOAT:
+            put_double(payload, record.fdelta);
+            put_value(payload, record.value);
+            break;
+        case LogRecord::TRANSACTION: {
+            put_varint(payload, record.writes.size());
+            std::string write;
+            for (const auto& w : record.writes) {
+                write.clear();
+                put_payload(write, w);
+                put_varint(payload, write.size());
+                payload.append(write);
+            }
+            break;
+        }
+    }
+}
+
+// Reads the frames of a batch record back into records. False if anything
+// in it is malformed.
+bool unpack_batch(const std::string& payload, std::vector<LogRecord>& records) {
+    Cursor cur{payload.data() + 2, payload.data() + payload.size()};
+    uint64_t raw_len;
+    if (payload.size() < 2 || !cur.varint(raw_len) || raw_len > MAX_RECORD_PAYLOAD) {
+        return false;
+    }
+    std::string frames(raw_len, '\0');
+    if (!lz4_decompress(cur.p, cur.end - cur.p, &frames[0], frames.size())) {
+        return false;
+    }
+    size_t pos = 0;
+    std::string record_payload;
+    while (pos < frames.size()) {
+        if (frames.size() - pos < 8) {
+            return false;
+        }
+        uint32_t len = get_u32(frames.data() + pos);
+        if (len > frames.size() - pos - 8) {
+            return false;
+        }
+        record_payload.assign(frames, pos + 8, len);
+        records.emplace_back();
+        if (crc32c(record_payload.data(), len) != get_u32(frames.data() + pos + 4)
+            || !decode_record(record_payload, records.back())) {
+            return false;
+        }
+        pos += 8 + len;
+    }
+    return true;
+}
+
+bool fsync_directory(const std::string& path) {
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Marks an older log at path as the current version, so that records only
+// this version has can be appended. False if it could not be; a missing or
+// empty file, or one that is not a log, is left alone.
+bool upgrade_header(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+    char header[LOG_HEADER_SIZE];
+    bool ok = true;
+    if (::pread(fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))
+        && std::memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0 && get_u32(header + 8) < LOG_VERSION) {
+        std::string version;
+        put_u32(version, LOG_VERSION);
+        ok = ::pwrite(fd, version.data(), version.size(), 8) == static_cast<ssize_t>(version.size()) && ::fsync(fd) == 0;
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool read_header(std::istream& file) {
+    char header[LOG_HEADER_SIZE];
+    return file.read(header, sizeof(header))
+        && std::memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0
+        && get_u32(header + 8) >= LOG_MIN_VERSION && get_u32(header + 8) <= LOG_VERSION;
+}
+
+// Feeds the records of file, from just after its header up to offset limit,
+// through apply. The writes of a TRANSACTION record are applied one by one;
+// flagged records of an older transaction are held back until its COMMIT.
+// settled is set to the end of the last frame after which no transaction
+// was open, and pending to the number of records still held back at the
+// end. Returns false if it stopped at a torn or corrupt frame.
+bool scan_records(std::istream& file, uint64_t limit, const std::function<void(LogRecord&)>& apply,
+                  uint64_t& settled, size_t& pending) {
+    std::vector<LogRecord> trxn;
+    std::vector<LogRecord> batch;
+    // Applies rec, or stages it until its transaction commits. Returns true
+    // if everything read so far has taken effect.
+    auto take = [&](LogRecord& rec) {
+        if (rec.type == LogRecord::TRANSACTION) {
+            for (auto& write : rec.writes) {
+                apply(write);
+            }
+            return true;
+        }
+        if (rec.type == LogRecord::COMMIT) {
+            for (auto& staged : trxn) {
+                apply(staged);
+            }
+            trxn.clear();
+            return true;
+        }
+        if (rec.in_trxn) {
+            trxn.push_back(std::move(rec));
+            return false;
+        }
+        apply(rec);
+        return true;
+    };
+    settled = LOG_HEADER_SIZE;
+    uint64_t offset = LOG_HEADER_SIZE;
+    bool torn = false;
+    std::string payload;
+    char frame[8];
+    while (offset < limit && file.read(frame, sizeof(frame))) {
+        uint32_t len = get_u32(frame);
+        if (len > MAX_RECORD_PAYLOAD) {
+            torn = true;
+            break;
+        }
+        payload.resize(len);
+        if (!file.read(&payload[0], len) || crc32c(payload.data(), len) != get_u32(frame + 4)) {
+            torn = true;
+            break;
+        }
+        batch.clear();
+        if (len > 0 && static_cast<unsigned char>(payload[0]) == BATCH_LZ4) {
+            if (!unpack_batch(payload, batch)) {
+                torn = true;
+                break;
+            }
+        } else if (!decode_record(payload, batch.emplace_back())) {
+            torn = true;
+            break;
+        }
+        offset += sizeof(frame) + len;
+        bool done = false;
+        for (auto& record : batch) {
+            done = take(record);
+        }
+        if (done) {
+            settled = offset;
+        }
+    }
+    if (offset < limit && file.gcount() != 0 && !torn) {
+        torn = true; // A partial frame header
+    }
+    pending = trxn.size();
+    return !torn;
+}
+
+} // namespace
+
+std::string WriteAheadLog::encode(const LogRecord& record) {
+    std::string payload;
+    put_payload(payload, record);
+    std::string frame;
+    frame.reserve(payload.size() + 8);
+    put_u32(frame, static_cast<uint32_t>(payload.size()));
+    put_u32(frame, crc32c(payload.data(), payload.size()));
+    frame.append(payload);
+    return frame;
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path, FsyncPolicy policy, Compression compression, IoBackend backend)
+    : path(path), policy(policy), compression(compression), backend(backend), last_sync(std::chrono::steady_clock::now()) {
+    if (open_file()) {
+        writer = std::thread(&WriteAheadLog::run, this);
+    }
+}
+
+bool WriteAheadLog::open_file() {
+    // The current descriptor, if any, is only given up once the new one is
+    // open, so a failure leaves the log writing where it did.
+    // Not O_APPEND: the writer thread places every batch at file_bytes
+    // itself, which pwrite() and io_uring would otherwise ignore.
+    if (!upgrade_header(path)) {
+        std::cerr << "[ERROR] Could not upgrade write-ahead log " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    int next = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (next < 0) {
+        std::cerr << "[ERROR] Could not open write-ahead log " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (::fstat(next, &st) == 0 && st.st_size == 0) {
+        // Created just now, unless an earlier attempt left it empty
+        if (!write_all(next, log_header()) || ::fsync(next) != 0 || !fsync_directory(path)) {
+            std::cerr << "[ERROR] Could not initialise write-ahead log " << path << std::endl;
+        }
+    }
+    io_queue.reset();
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = next;
+    file_bytes = ::fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    base_bytes = file_bytes;
+    io_queue = IoQueue::create(fd, backend, 2);
+    return true;
+}
+
+IoBackend WriteAheadLog::io_backend() const {
+    std::lock_guard<std::mutex> io(io_mtx);
+    return io_queue ? io_queue->backend() : backend;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        stopping = true;
+    }
+    queue_cv.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+    io_queue.reset();
+    if (fd < 0) {
+        return;
+    }
+    if (policy != FsyncPolicy::No) {
+        ::fsync(fd);
+    }
+    ::close(fd);
+}
+
+uint64_t WriteAheadLog::append(const LogRecord& record) {
+    std::string frame = encode(record);
+    if (frame.size() - 8 > MAX_RECORD_PAYLOAD) {
+        std::cerr << "[ERROR] Not logging a record of " << frame.size() - 8 << " bytes to " << path
+                  << ". Records are limited to " << MAX_RECORD_PAYLOAD << " bytes." << std::endl;
+        return 0;
+    }
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        if (write_failed) {
+            return 0;
+        }
+        pending.append(frame);
+        seq = ++queued_seq;
+    }
+    queue_cv.notify_one();
+    return seq;
+}
+
+uint64_t WriteAheadLog::last_sequence() const {
+    std::lock_guard<std::mutex> lock(queue_mtx);
+    return queued_seq;
+}
+
+bool WriteAheadLog::wait_durable(uint64_t seq) {
+    std::unique_lock<std::mutex> lock(queue_mtx);
+    if (policy != FsyncPolicy::Always || fd < 0) {
+        return !write_failed;
+    }
+    written_cv.wait(lock, [&] { return synced_seq >= seq || write_failed; });
+    return synced_seq >= seq;
+}
+
+bool WriteAheadLog::failed() const {
+    std::lock_guard<std::mutex> lock(queue_mtx);
+    return write_failed;
+}
+
+void WriteAheadLog::flush() {
+    if (fd < 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(queue_mtx);
+    written_cv.wait(lock, [&] { return written_seq >= queued_seq || write_failed; });
+}
+
+bool WriteAheadLog::rotate() {
+    if (fd < 0) {
+        return false;
+    }
+    // Once the queue is drained, holding queue_mtx keeps the writer thread
+    // from starting another batch, and io_mtx waits out a periodic fsync.
+    std::unique_lock<std::mutex> lock(queue_mtx);
+    written_cv.wait(lock, [&] { return written_seq >= queued_seq || write_failed; });
+    if (write_failed) {
+        std::cerr << "[ERROR] Not rotating write-ahead log " << path << ": a write to it failed." << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> io(io_mtx);
+    ::fsync(fd);
+    ++generation; // A compaction under way is abandoned
+
+    const std::string archive = archive_path(path);
+    std::error_code ec;
+    if (!std::filesystem::exists(archive, ec)) {
+        std::filesystem::rename(path, archive, ec);
+        if (!ec) {
+            fsync_directory(path);
+        }
+    } else {
+        // An earlier snapshot never completed: its records must stay in the
+        // archive, so the current ones are added behind them, and made
+        // durable there before the log lets go of them.
+        if (std::filesystem::file_size(path, ec) > static_cast<uintmax_t>(LOG_HEADER_SIZE)) {
+            if (!upgrade_header(archive) || !append_records(path, archive)) {
+                ec = std::error_code(errno, std::system_category());
+            }
+        }
+        if (!ec) {
+            std::filesystem::resize_file(path, LOG_HEADER_SIZE, ec);
+        }
+    }
+    if (ec) {
+        std::cerr << "[ERROR] Could not rotate write-ahead log " << path << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return open_file();
+}
+
+void WriteAheadLog::drop_archive() {
+    std::error_code ec;
+    std::filesystem::remove(archive_path(path), ec);
+}
+
+bool WriteAheadLog::compact() {
+    if (fd < 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> serial(rewrite_mtx);
+    // The writer thread holds io_mtx for a whole batch, so this is the end
+    // of a frame.
+    auto live_size = [this] {
+        std::lock_guard<std::mutex> io(io_mtx);
+        struct stat st;
+        return ::fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    };
+    uint64_t started_generation;
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        started_generation = generation;
+    }
+    const std::string temp = path + ".rewrite";
+    int out = -1;
+    // Also cleans up after a rotation, which makes the rewrite moot
+    auto fail = [&](const std::string& why) {
+        bool rotated;
+        {
+            std::lock_guard<std::mutex> lock(queue_mtx);
+            rotated = generation != started_generation;
+        }
+        if (!rotated) {
+            std::cerr << "[ERROR] Could not compact write-ahead log " << path << ": " << why << std::endl;
+        }
+        if (out >= 0) {
+            ::close(out);
+        }
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        // Wait for another doubling rather than retrying on every write
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        base_bytes = file_bytes;
+        return false;
+    };
+
+    uint64_t scan_end = live_size();
+    std::unordered_map<std::string, LogRecord> latest;
+    uint64_t settled;
+    size_t unfinished;
+    auto keep_latest = [&](LogRecord& rec) {
+        LogRecord& slot = latest[rec.key];
+        slot = std::move(rec);
+    };
+    std::ifstream live(path, std::ios::binary);
+    if (!read_header(live) || !scan_records(live, scan_end, keep_latest, settled, unfinished)) {
+        return fail("it is corrupt");
+    }
+
+    out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return fail(std::strerror(errno));
+    }
+    // The header stays uncompressed; pack_batch() only understands frames
+    if (!write_all(out, log_header())) {
+        return fail(std::strerror(errno));
+    }
+    std::string chunk;
+    auto write_chunk = [&] {
+        bool ok = write_all(out, compression == Compression::Lz4 ? pack_batch(std::move(chunk)) : chunk);
+        chunk.clear();
+        return ok;
+    };
+    for (auto& [key, rec] : latest) {
+        // Counters collapse into the value they ended at
+        if (rec.type != LogRecord::REMOVE) {
+            rec.type = rec.value.is_expired() ? LogRecord::REMOVE : LogRecord::SET;
+        }
+        rec.in_trxn = false;
+        chunk.append(encode(rec));
+        if (chunk.size() >= REWRITE_CHUNK && !write_chunk()) {
+            return fail(std::strerror(errno));
+        }
+    }
+    latest.clear();
+    if (!write_chunk()) {
+        return fail(std::strerror(errno));
+    }
+    // Growth is measured from here: the records carried over below have
+    // not been compacted yet.
+    struct stat compacted;
+    if (::fstat(out, &compacted) != 0) {
+        return fail(std::strerror(errno));
+    }
+
+    // Everything from the first record that had not taken effect at
+    // scan_end onwards is carried over verbatim: most of it now, and
+    // whatever is still arriving once appends are held off for the swap.
+    live.clear();
+    live.seekg(static_cast<std::streamoff>(settled));
+    auto copy_until = [&](uint64_t end) {
+        while (settled < end) {
+            chunk.resize(std::min<uint64_t>(REWRITE_CHUNK, end - settled));
+            if (!live.read(&chunk[0], static_cast<std::streamsize>(chunk.size())) || !write_all(out, chunk)) {
+                return false;
+            }
+            settled += chunk.size();
+        }
+        return true;
+    };
+    if (!copy_until(live_size())) {
+        return fail("could not copy the records appended meanwhile");
+    }
+    std::string error;
+    {
+        std::unique_lock<std::mutex> lock(queue_mtx);
+        written_cv.wait(lock, [&] { return written_seq >= queued_seq || write_failed; });
+        std::lock_guard<std::mutex> io(io_mtx);
+        struct stat st;
+        if (generation != started_generation) {
+            error = "it was rotated meanwhile";
+        } else if (write_failed) {
+            error = "a write to it failed";
+        } else if (::fstat(fd, &st) != 0 || !copy_until(static_cast<uint64_t>(st.st_size))) {
+            error = "could not copy the records appended meanwhile";
+        } else if (::fsync(out) != 0 || std::rename(temp.c_str(), path.c_str()) != 0) {
+            error = std::strerror(errno);
+        } else {
+            fsync_directory(path);
+            // The rewritten file is the log from here on. Carrying on with
+            // the descriptor it was written through leaves nothing to fail
+            // once it has been renamed into place.
+            io_queue.reset();
+            ::close(fd);
+            fd = out;
+            file_bytes = ::fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+            base_bytes = static_cast<uint64_t>(compacted.st_size);
+            io_queue = IoQueue::create(fd, backend, 2);
+            return true;
+        }
+    }
+    return fail(error);
+}
+
+bool WriteAheadLog::start_compaction() {
+    if (stopping || compacting.exchange(true)) {
+        return false;
+    }
+    // The previous run has finished; all that is left is to reap it.
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+    compactor = std::thread([this] {
+        compact();
+        compacting = false;
+    });
+    return true;
+}
+
+bool WriteAheadLog::compact_in_background() {
+    if (fd < 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(queue_mtx);
+    return start_compaction();
+}
+
+void WriteAheadLog::set_auto_compact(unsigned growth_percent, uint64_t min_bytes) {
+    std::lock_guard<std::mutex> lock(queue_mtx);
+    auto_growth = growth_percent;
+    auto_min_bytes = min_bytes;
+}
+
+uint64_t WriteAheadLog::size() const {
+    std::lock_guard<std::mutex> lock(queue_mtx);
+    return file_bytes;
+}
+
+bool WriteAheadLog::append_records(const std::string& from, const std::string& to) {
+    int in = ::open(from.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = ::open(to.c_str(), O_WRONLY | O_APPEND);
+    bool ok = out >= 0 && ::lseek(in, LOG_HEADER_SIZE, SEEK_SET) == static_cast<off_t>(LOG_HEADER_SIZE);
+    std::string chunk;
+    while (ok) {
+        chunk.resize(REWRITE_CHUNK);
+        ssize_t n = ::read(in, &chunk[0], chunk.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        chunk.resize(static_cast<size_t>(n));
+        ok = write_all(out, chunk);
+    }
+    ok = ok && ::fsync(out) == 0;
+    int error = errno;
+    if (out >= 0) {
+        ::close(out);
+    }
+    ::close(in);
+    errno = error;
+    return ok;
+}
+
+bool WriteAheadLog::write_all(int fd, const std::string& buf) {
+    const char* p = buf.data();
+    size_t left = buf.size();
+    while (left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void WriteAheadLog::fail_writes(int error) {
+    if (!write_failed) {
+        write_failed = true;
+        std::cerr << "[ERROR] Write-ahead log write to " << path << " failed: " << std::strerror(error)
+                  << ". No further writes will be logged." << std::endl;
+    }
+}
+
+void WriteAheadLog::run() {
+    using namespace std::chrono_literals;
+    std::unique_lock<std::mutex> lock(queue_mtx);
+    int error = 0;
+    while (true) {
+        queue_cv.wait_for(lock, 1s, [this] { return stopping || !pending.empty(); });
+        auto now = std::chrono::steady_clock::now();
+        bool due = policy == FsyncPolicy::EverySec && now - last_sync >= 1s;
+
+        if (!pending.empty() && write_failed) {
+            // Queued behind the failed batch; written now, they would
+            // follow a gap that replay stops at.
+            pending.clear();
+        } else if (!pending.empty()) {
+            // Everything queued since the last pass goes out in one write,
+            // and for Always, one fsync covers every waiting thread.
+            std::string batch;
+            batch.swap(pending);
+            uint64_t batch_seq = queued_seq;
+            uint64_t offset = file_bytes;
+            lock.unlock();
+            if (compression == Compression::Lz4) {
+                batch = pack_batch(std::move(batch));
+            }
+            bool ok, sync_now = policy == FsyncPolicy::Always || due;
+            {
+                // The fsync is linked behind the write, so both cost one
+                // system call with io_uring.
+                std::lock_guard<std::mutex> io(io_mtx);
+                io_queue->write(batch.data(), batch.size(), offset, -1, sync_now);
+                ok = io_queue->wait();
+                error = errno;
+                if (sync_now) {
+                    last_sync = now;
+                }
+            }
+            lock.lock();
+            if (ok) {
+                written_seq = batch_seq;
+                if (sync_now) {
+                    synced_seq = batch_seq;
+                }
+                file_bytes += batch.size();
+            } else {
+                fail_writes(error);
+            }
+            written_cv.notify_all();
+            if (ok && auto_growth && file_bytes >= std::max(auto_min_bytes, base_bytes + base_bytes / 100 * auto_growth)) {
+                start_compaction();
+            }
+        } else if (due && synced_seq < written_seq) {
+            uint64_t target = written_seq;
+            lock.unlock();
+            bool ok;
+            {
+                std::lock_guard<std::mutex> io(io_mtx);
+                ok = ::fsync(fd) == 0;
+                error = errno;
+                last_sync = now;
+            }
+            lock.lock();
+            if (ok) {
+                synced_seq = target;
+            } else {
+                fail_writes(error);
+                written_cv.notify_all();
+            }
+        }
+
+        if (stopping && pending.empty()) {
+            break;
+        }
+    }
+}
+
+bool WriteAheadLog::replay(const std::string& path, const std::function<void(LogRecord&)>& apply) {
+    return replay_file(archive_path(path), apply) && replay_file(path, apply);
+}
+
+bool WriteAheadLog::replay_file(const std::string& path, const std::function<void(LogRecord&)>& apply) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open() || file.peek() == std::ifstream::traits_type::eof()) {
+        return true;
+    }
+    if (!read_header(file)) {
+        std::cerr << "[ERROR] " << path << " is not a supported write-ahead log. It will not be replayed." << std::endl;
+        return false;
+    }
+
+    uint64_t valid_end; // end of the last fully applied record
+    size_t pending;
+    bool torn = !scan_records(file, UINT64_MAX, apply, valid_end, pending);
+    file.close();
+
+    if (pending) {
+        std::cerr << "[WARNING] Discarding " << pending << " records of an uncommitted transaction at the end of " << path << "." << std::endl;
+    }
+    if (torn) {
+        std::cerr << "[WARNING] " << path << " ends with a torn or corrupt record. Replayed everything before it." << std::endl;
+    }
+    if (torn || pending) {
+        std::error_code ec;
+        std::filesystem::resize_file(path, valid_end, ec);
+    }
+    return true;
+}
@@ -0,0 +1,184 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ValueWithTTL.h"
+#include "Compression.h"
+#include "AsyncIo.h"
+
+// Append-only log format
+// ----------------------
+//   header : "IMKVSLOG" | u32 version
+//   record : u32 payload_len | u32 crc32c(payload) | payload
+//   payload: u8 type | u8 flags | varint key_len | key | body
+//
+// SET bodies hold the full entry (with its absolute expiration), INCRBY and
+// INCRBYFLOAT hold the delta followed by the resulting entry. Recording the
+// result keeps replay idempotent, so replaying a log over a snapshot that
+// already contains some of its records is harmless.
+//
+// A committed transaction is a single TRANSACTION record with an empty key,
+//   body   : varint count | (varint payload_len | payload)*
+// holding the payload of each of its writes. One crc covers the whole write
+// set, so recovery applies all of it or, if the frame is torn, none of it.
+// Logs written before that record existed hold a transaction as records
+// flagged as part of it, which only take effect once the COMMIT record that
+// closes them has been read; those are still replayed.
+//
+// With compression enabled, the writer thread may pack the records of one
+// write into a single batch record,
+//   payload: u8 0x80 | u8 flags | varint raw_len | LZ4 block of the records
+// whose records are complete frames as above. A batch never ends inside a
+// transaction, so the records of an unfinished one at the end of the log
+// are always plain frames that can be cut off.
+//
+// Batches and TRANSACTION records only appear in version 2 logs. A version 1
+// log is upgraded in place before anything is appended to it, so builds that
+// predate them refuse the file instead of cutting it off at the first record
+// they do not know.
+
+enum class FsyncPolicy {
+    Always,   // Every write waits until its record has been fsynced
+    EverySec, // The writer thread fsyncs at most once per second
+    No        // Leave flushing to the operating system
+};
+
+struct LogRecord {
+    enum Type : unsigned char {
+        SET = 1,
+        REMOVE = 2,
+        INCRBY = 3,
+        INCRBYFLOAT = 4,
+        COMMIT = 5,
+        TRANSACTION = 6
+    };
+
+    Type type = SET;
+    bool in_trxn = false;
+    std::string key;
+    ValueWithTTL value;   // SET: the new entry, INCRBY*: the resulting entry
+    long long delta = 0;  // INCRBY
+    double fdelta = 0;    // INCRBYFLOAT
+    std::vector<LogRecord> writes; // TRANSACTION: SET and REMOVE records, in order
+};
+
+class WriteAheadLog {
+public:
+    // Writes go through an IoQueue on backend. With FsyncPolicy::Always,
+    // each batch and its fsync are submitted together.
+    WriteAheadLog(const std::string& path, FsyncPolicy policy, Compression compression = Compression::None,
+                  IoBackend backend = IoBackend::Auto);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    FsyncPolicy fsync_policy() const { return policy; }
+    IoBackend io_backend() const;
+
+    // Replay takes a larger record for a damaged one, so none is written.
+    static constexpr uint32_t MAX_RECORD_PAYLOAD = 256u * 1024 * 1024;
+
+    // Queues a record for the writer thread and returns its sequence number,
+    // or 0, logging nothing, if it is larger than MAX_RECORD_PAYLOAD or the
+    // log has failed.
+    uint64_t append(const LogRecord& record);
+    uint64_t last_sequence() const;
+    // Blocks until record seq is as durable as the fsync policy promises:
+    // fsynced for Always, handed to the writer thread otherwise. Returns
+    // false if the log failed first.
+    bool wait_durable(uint64_t seq);
+    // Whether a write or fsync of the log has failed. The records queued
+    // then are dropped and no more are accepted, since they would land
+    // behind a gap; rotate() and compact() refuse too. A new WriteAheadLog
+    // on the same path cuts off whatever the failure left behind.
+    bool failed() const;
+    // Waits for every queued record to reach the file.
+    void flush();
+    // Moves every record logged so far into the archive (path + ".prev") and
+    // carries on with an empty log. Called when a snapshot begins; the
+    // archive is appended to, not replaced, if an earlier snapshot never
+    // completed.
+    bool rotate();
+    // Deletes the archive once a snapshot covering it has been written.
+    void drop_archive();
+    // Rewrites the log as one record per key it touches, holding that key's
+    // final committed state, and swaps the result in atomically. Appends
+    // carry on meanwhile: whatever reached the file after the scan started,
+    // and any unfinished transaction, is copied behind the rewritten records
+    // at the swap. The archive is left alone, and a rotate() meanwhile
+    // abandons the rewrite.
+    bool compact();
+    // Runs compact() on a background thread. Returns false if one is
+    // already running.
+    bool compact_in_background();
+    // Compacts in the background whenever the log has grown by
+    // growth_percent since it was last compacted or rotated, and is at least
+    // min_bytes large. 0 turns it off.
+    void set_auto_compact(unsigned growth_percent, uint64_t min_bytes);
+    uint64_t size() const;
+
+    static std::string archive_path(const std::string& path) { return path + ".prev"; }
+
+    // Calls apply for every committed record in the archive of path and then
+    // in the log at path itself. A torn or corrupt tail, e.g. from a crash in
+    // the middle of a write, is reported and cut off so later appends are not
+    // stranded behind it. Returns false only if a file exists but is not a log.
+    // apply may move from the record it is handed.
+    static bool replay(const std::string& path, const std::function<void(LogRecord&)>& apply);
+
+    static std::string encode(const LogRecord& record);
+
+private:
+    std::string path;
+    FsyncPolicy policy;
+    Compression compression;
+    IoBackend backend;
+    int fd = -1;
+    std::unique_ptr<IoQueue> io_queue; // Replaced along with fd, under io_mtx
+
+    mutable std::mutex io_mtx; // Held while the file descriptor is written or swapped
+    mutable std::mutex queue_mtx;
+    std::condition_variable queue_cv;   // wakes the writer thread
+    std::condition_variable written_cv; // wakes threads waiting on progress
+    std::string pending;
+    uint64_t queued_seq = 0;
+    uint64_t written_seq = 0;
+    uint64_t synced_seq = 0;
+    bool stopping = false;
+    bool write_failed = false; // Latched by fail_writes()
+    std::chrono::steady_clock::time_point last_sync;
+    std::thread writer;
+
+    std::mutex rewrite_mtx; // Serialises compact()
+    uint64_t generation = 0; // Bumped by rotate(); guarded by queue_mtx
+    std::atomic<bool> compacting{false};
+    std::thread compactor;
+    unsigned auto_growth = 0;
+    uint64_t auto_min_bytes = 0;
+    uint64_t file_bytes = 0; // Guarded by queue_mtx, like the two below
+    uint64_t base_bytes = 0; // Size the last compaction or rotation left the log at, before anything appended meanwhile
+
+    void run();
+    // Called by the writer thread, holding queue_mtx, once a write or fsync fails.
+    void fail_writes(int error);
+    bool open_file();
+    bool start_compaction();
+    static bool write_all(int fd, const std::string& buf);
+    // Appends the records of the log at from to the one at to, and fsyncs it.
+    static bool append_records(const std::string& from, const std::string& to);
+    static bool replay_file(const std::string& path, const std::function<void(LogRecord&)>& apply);
+};
+
+#endif // WRITEAHEADLOG_H
@@ -1,6 +1,16 @@
 #include <benchmark/benchmark.h>
 #include "KeyValueStore.h"
+#include "ThreadPool.h"
 #include <string>
+#include <iostream>
+#include <memory>
+#include <filesystem>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 // Global instance of our store to use in all benchmarks
 static KeyValueStore kvs;
@@ -46,6 +56,502 @@ static void BM_Incr(benchmark::State& state) {
 }
 BENCHMARK(BM_Incr);
 
+// --- Benchmark for the INCRBY and INCRBYFLOAT operations ---
+static void BM_IncrBy(benchmark::State& state) {
+    for (auto _ : state) {
+        kvs.incrby("atomic_meter", 7);
+    }
+}
+BENCHMARK(BM_IncrBy);
+
+static void BM_IncrByFloat(benchmark::State& state) {
+    for (auto _ : state) {
+        kvs.incrbyfloat("atomic_gauge", 0.5);
+    }
+}
+BENCHMARK(BM_IncrByFloat);
+
+// --- Benchmark for the COMMIT pause of a bulk transaction ---
+// Only the commit itself is timed; staging the writes is excluded.
+static void BM_CommitLargeTransaction(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto store = std::make_unique<KeyValueStore>();
+        store->begin();
+        for (int i = 0; i < n; ++i) {
+            store->set("key" + std::to_string(i), "some_value");
+        }
+        state.ResumeTiming();
+        store->commit();
+        state.PauseTiming();
+        store.reset(); // Keep tearing down the store out of the measurement
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_CommitLargeTransaction)->Arg(10000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+
+// --- Benchmarks for snapshot save/load, JSON vs binary format ---
+static void fill_store(KeyValueStore& store, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (i % 2 == 0) {
+            store.set("key" + std::to_string(i), "some_value_" + std::to_string(i));
+        } else {
+            store.incrby("key" + std::to_string(i), i);
+        }
+    }
+}
+
+static std::string snapshot_path(SnapshotFormat format) {
+    const char* name = format == SnapshotFormat::Json ? "imkvs_bench.json" : "imkvs_bench.snap";
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+static void BM_Save(benchmark::State& state, SnapshotFormat format) {
+    KeyValueStore store;
+    fill_store(store, static_cast<int>(state.range(0)));
+    const std::string path = snapshot_path(format);
+    for (auto _ : state) {
+        store.save(path, format);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["file_bytes"] = static_cast<double>(std::filesystem::file_size(path));
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_Save, json, SnapshotFormat::Json)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Save, binary, SnapshotFormat::Binary)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// Benchmark for a binary save of 1M keys through each I/O backend
+static void BM_SaveIo(benchmark::State& state, IoBackend backend) {
+    KeyValueStore store;
+    store.set_io_backend(backend);
+    fill_store(store, 1000000);
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    for (auto _ : state) {
+        store.save(path);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(std::filesystem::file_size(path)));
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveIo, uring, IoBackend::Uring)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_SaveIo, threads, IoBackend::Threads)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_Load(benchmark::State& state, SnapshotFormat format) {
+    const std::string path = snapshot_path(format);
+    {
+        KeyValueStore source;
+        fill_store(source, static_cast<int>(state.range(0)));
+        source.save(path, format);
+    }
+    const auto file_bytes = static_cast<int64_t>(std::filesystem::file_size(path));
+    for (auto _ : state) {
+        auto store = std::make_unique<KeyValueStore>();
+        store->load(path);
+        state.PauseTiming();
+        store.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * file_bytes);
+    state.counters["threads"] = static_cast<double>(ThreadPool::default_size());
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_Load, json, SnapshotFormat::Json)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Load, binary, SnapshotFormat::Binary)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Time until load() returns for 200k keys with values of range(0) bytes,
+// decoding everything (range(1) == 0), only mapping and indexing (1), or
+// also leaving block checksums for later (2).
+static void BM_LoadLazy(benchmark::State& state) {
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    {
+        KeyValueStore source;
+        const std::string value(static_cast<size_t>(state.range(0)), 'v');
+        for (int i = 0; i < 200000; ++i) {
+            source.set("key" + std::to_string(i), value);
+        }
+        source.save(path);
+    }
+    for (auto _ : state) {
+        auto store = std::make_unique<KeyValueStore>();
+        store->set_lazy_load(state.range(1) != 0, false, state.range(1) == 2);
+        store->load(path);
+        state.PauseTiming();
+        store.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * 200000);
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(std::filesystem::file_size(path)));
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_LoadLazy)->Args({16, 0})->Args({16, 1})->Args({1024, 0})->Args({1024, 1})->Args({1024, 2})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Time from restart until the first key of 1M is served, by loading the
+// binary snapshot (Arg 0) or attaching a warm-restart image (1). The image
+// is rewritten before every attach, so the iterations are kept few.
+static void BM_WarmRestart(benchmark::State& state) {
+    const std::string snapshot = snapshot_path(SnapshotFormat::Binary);
+    const std::string image = (std::filesystem::temp_directory_path() / "imkvs_bench.warm").string();
+    KeyValueStore source;
+    for (int i = 0; i < 1000000; ++i) {
+        source.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    source.save(snapshot);
+    for (auto _ : state) {
+        state.PauseTiming();
+        if (state.range(0)) {
+            source.save_warm_image(image); // Attaching marks it used
+        }
+        auto store = std::make_unique<KeyValueStore>();
+        state.ResumeTiming();
+        if (state.range(0)) {
+            store->attach_warm_image(image);
+        } else {
+            store->load(snapshot);
+        }
+        benchmark::DoNotOptimize(store->get("key123456"));
+        state.PauseTiming();
+        store.reset();
+        state.ResumeTiming();
+    }
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove(image);
+}
+BENCHMARK(BM_WarmRestart)->Arg(0)->Arg(1)->Iterations(5)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+// --- Benchmark for SET with the write-ahead log under each fsync policy ---
+// All threads share one store, so with "always" their records are batched
+// by the log's writer thread into a shared fsync.
+static std::unique_ptr<KeyValueStore> logged_kvs;
+
+static void BM_SetLogged(benchmark::State& state, FsyncPolicy policy, IoBackend backend) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_bench.log").string();
+    if (state.thread_index() == 0) {
+        std::filesystem::remove(path);
+        logged_kvs = std::make_unique<KeyValueStore>();
+        logged_kvs->set_io_backend(backend);
+        logged_kvs->open_log(path, policy);
+    }
+    const std::string prefix = "key" + std::to_string(state.thread_index()) + "_";
+    int i = 0;
+    for (auto _ : state) {
+        logged_kvs->set(prefix + std::to_string(i++), "some_value");
+    }
+    if (state.thread_index() == 0) {
+        logged_kvs.reset();
+        std::filesystem::remove(path);
+    }
+}
+BENCHMARK_CAPTURE(BM_SetLogged, always, FsyncPolicy::Always, IoBackend::Uring)->Threads(1)->Threads(8)->UseRealTime();
+BENCHMARK_CAPTURE(BM_SetLogged, always_threads, FsyncPolicy::Always, IoBackend::Threads)->Threads(1)->Threads(8)->UseRealTime();
+BENCHMARK_CAPTURE(BM_SetLogged, everysec, FsyncPolicy::EverySec, IoBackend::Uring)->Threads(1)->Threads(8)->UseRealTime();
+BENCHMARK_CAPTURE(BM_SetLogged, no, FsyncPolicy::No, IoBackend::Uring)->Threads(1)->Threads(8)->UseRealTime();
+
+// Benchmark for committing transactions of range(0) SETs with the log
+// fsynced on every commit: each commit is one log record and one fsync.
+static void BM_CommitLogged(benchmark::State& state) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_bench_commit.log").string();
+    std::filesystem::remove(path);
+    std::streambuf* out = std::cout.rdbuf(nullptr); // commit() prints OK
+    {
+        KeyValueStore store;
+        store.open_log(path, FsyncPolicy::Always);
+        int i = 0;
+        for (auto _ : state) {
+            store.begin();
+            for (int w = 0; w < state.range(0); ++w) {
+                store.set("key" + std::to_string(i++ % 100000), "some_value");
+            }
+            store.commit();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    std::cout.rdbuf(out);
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_CommitLogged)->Arg(1)->Arg(100)->UseRealTime();
+
+
+// --- Benchmark for SET tail latency while snapshots run in the background ---
+// Arg 0 measures the baseline, arg 1 keeps a snapshot of 1M keys running.
+static void BM_SetLatencyDuringSnapshot(benchmark::State& state) {
+    KeyValueStore store;
+    fill_store(store, 1000000);
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    std::atomic<bool> done{false};
+    std::thread snapshotter;
+    if (state.range(0) == 1) {
+        snapshotter = std::thread([&] {
+            while (!done) store.save(path);
+        });
+    }
+
+    std::vector<double> latencies_us;
+    int i = 0;
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        store.set("key" + std::to_string(i++ % 1000000), "updated_value");
+        auto end = std::chrono::steady_clock::now();
+        latencies_us.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    done = true;
+    if (snapshotter.joinable()) snapshotter.join();
+    std::filesystem::remove(path);
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    state.counters["p50_us"] = latencies_us[latencies_us.size() / 2];
+    state.counters["p99_us"] = latencies_us[latencies_us.size() * 99 / 100];
+    state.counters["max_us"] = latencies_us.back();
+}
+BENCHMARK(BM_SetLatencyDuringSnapshot)->Arg(0)->Arg(1)->Iterations(200000)->UseRealTime();
+
+
+// --- Benchmarks for the snapshot checksums, on entry- and block-sized inputs ---
+static void BM_Checksum(benchmark::State& state, ChecksumType type) {
+    std::string data(static_cast<size_t>(state.range(0)), 'x');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 31);
+    }
+    std::string digest;
+    for (auto _ : state) {
+        digest.clear();
+        append_checksum(type, data.data(), data.size(), digest);
+        benchmark::DoNotOptimize(digest.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_Checksum, crc32c, ChecksumType::Crc32c)->Arg(64)->Arg(64 * 1024);
+BENCHMARK_CAPTURE(BM_Checksum, xxh64, ChecksumType::XXH64)->Arg(64)->Arg(64 * 1024);
+BENCHMARK_CAPTURE(BM_Checksum, sha256, ChecksumType::Sha256)->Arg(64)->Arg(64 * 1024);
+
+static void BM_SaveIntegrity(benchmark::State& state, ChecksumType type, bool per_entry) {
+    KeyValueStore store;
+    fill_store(store, 100000);
+    store.set_snapshot_integrity({type, per_entry});
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    for (auto _ : state) {
+        store.save(path, SnapshotFormat::Binary);
+    }
+    state.SetItemsProcessed(state.iterations() * 100000);
+    state.counters["file_bytes"] = static_cast<double>(std::filesystem::file_size(path));
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveIntegrity, crc32c_block, ChecksumType::Crc32c, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_SaveIntegrity, xxh64_entry, ChecksumType::XXH64, true)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_SaveIntegrity, sha256_entry, ChecksumType::Sha256, true)->Unit(benchmark::kMillisecond);
+
+// --- Benchmarks for block compression: save and load time and the ratio ---
+static void BM_SaveCompression(benchmark::State& state, Compression compression) {
+    KeyValueStore store;
+    fill_store(store, 100000);
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    store.save(path);
+    const double plain_bytes = static_cast<double>(std::filesystem::file_size(path));
+    store.set_snapshot_compression(compression);
+    for (auto _ : state) {
+        store.save(path);
+    }
+    const double file_bytes = static_cast<double>(std::filesystem::file_size(path));
+    state.SetItemsProcessed(state.iterations() * 100000);
+    state.counters["file_bytes"] = file_bytes;
+    state.counters["ratio"] = plain_bytes / file_bytes;
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveCompression, none, Compression::None)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_SaveCompression, lz4, Compression::Lz4)->Unit(benchmark::kMillisecond);
+
+static void BM_LoadCompression(benchmark::State& state, Compression compression) {
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    {
+        KeyValueStore source;
+        fill_store(source, 100000);
+        source.set_snapshot_compression(compression);
+        source.save(path);
+    }
+    for (auto _ : state) {
+        auto store = std::make_unique<KeyValueStore>();
+        store->load(path);
+        state.PauseTiming();
+        store.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * 100000);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_LoadCompression, none, Compression::None)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_LoadCompression, lz4, Compression::Lz4)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_Lz4(benchmark::State& state, bool decompress) {
+    std::string input;
+    for (int i = 0; input.size() < 64 * 1024; ++i) {
+        input += "key" + std::to_string(i) + "\x01some_value_" + std::to_string(i);
+    }
+    std::string packed;
+    lz4_compress(input.data(), input.size(), packed);
+    std::string output(input.size(), '\0');
+    for (auto _ : state) {
+        if (decompress) {
+            benchmark::DoNotOptimize(lz4_decompress(packed.data(), packed.size(), &output[0], output.size()));
+        } else {
+            packed.clear();
+            lz4_compress(input.data(), input.size(), packed);
+            benchmark::DoNotOptimize(packed.data());
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(input.size()));
+    state.counters["ratio"] = static_cast<double>(input.size()) / packed.size();
+}
+BENCHMARK_CAPTURE(BM_Lz4, compress, false);
+BENCHMARK_CAPTURE(BM_Lz4, decompress, true);
+
+// --- Benchmark for each SHA-256 backend hashing a batch of equal-sized values ---
+static void BM_Sha256(benchmark::State& state, Sha256Backend backend) {
+    if (!sha256_supported(backend)) {
+        state.SkipWithError("backend not supported by this CPU");
+        return;
+    }
+    const size_t len = static_cast<size_t>(state.range(0));
+    const size_t count = 1024;
+    std::string data(len * count, 'x');
+    std::vector<Sha256Message> messages;
+    for (size_t i = 0; i < count; ++i) {
+        messages.push_back({data.data() + i * len, len});
+    }
+    std::vector<unsigned char> digests(32 * count);
+    for (auto _ : state) {
+        sha256_many(backend, messages.data(), messages.size(), digests.data());
+        benchmark::DoNotOptimize(digests.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(len * count));
+}
+BENCHMARK_CAPTURE(BM_Sha256, scalar, Sha256Backend::Scalar)->Arg(48)->Arg(1024);
+BENCHMARK_CAPTURE(BM_Sha256, sha_ni, Sha256Backend::ShaNi)->Arg(48)->Arg(1024);
+BENCHMARK_CAPTURE(BM_Sha256, avx2, Sha256Backend::Avx2)->Arg(48)->Arg(1024);
+
+// --- Benchmark for repeated saves when only a share of the keys changes ---
+// range(0) is the percentage of keys written between two saves; entries
+// left unchanged reuse the digest cached by the previous save.
+static void BM_SaveMostlyStatic(benchmark::State& state, SnapshotFormat format) {
+    const int n = 100000;
+    KeyValueStore store;
+    fill_store(store, n);
+    store.set_snapshot_integrity({ChecksumType::Sha256, true});
+    const std::string path = snapshot_path(format);
+    store.save(path, format);
+    const int changed = n * static_cast<int>(state.range(0)) / 100;
+    int next = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int i = 0; i < changed; ++i, next = (next + 1) % n) {
+            store.set("key" + std::to_string(next), "changed_" + std::to_string(i));
+        }
+        state.ResumeTiming();
+        store.save(path, format);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveMostlyStatic, json, SnapshotFormat::Json)->Arg(1)->Arg(100)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_SaveMostlyStatic, binary_sha256, SnapshotFormat::Binary)->Arg(1)->Arg(100)->Unit(benchmark::kMillisecond);
+
+// Benchmark for checkpoints at a given churn in percent, with delta snapshots
+// (Arg 1) or full snapshots (Arg 0). Reports the bytes each one writes.
+static void BM_CheckpointChurn(benchmark::State& state) {
+    const int n = 100000;
+    KeyValueStore store;
+    fill_store(store, n);
+    store.set_delta_snapshots(state.range(1) != 0, 1000);
+    const std::string path = snapshot_path(SnapshotFormat::Binary);
+    store.checkpoint(path);
+    const int changed = n * static_cast<int>(state.range(0)) / 100;
+    int next = 0;
+    uint32_t deltas = 0;
+    uint64_t written = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int i = 0; i < changed; ++i, next = (next + 1) % n) {
+            store.set("key" + std::to_string(next), "changed_" + std::to_string(i));
+        }
+        state.ResumeTiming();
+        store.checkpoint(path);
+        state.PauseTiming();
+        if (std::filesystem::exists(path + ".delta." + std::to_string(deltas + 1))) {
+            written += std::filesystem::file_size(path + ".delta." + std::to_string(++deltas));
+        } else {
+            written += std::filesystem::file_size(path);
+            deltas = 0;
+        }
+        state.ResumeTiming();
+    }
+    state.counters["bytes_per_checkpoint"] = static_cast<double>(written) / state.iterations();
+    store.set_delta_snapshots(false);
+    store.checkpoint(path);
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_CheckpointChurn)->Args({1, 0})->Args({1, 1})->Args({10, 1})->Unit(benchmark::kMillisecond);
+
+// Benchmark for replaying a log of 1M increments over 1000 counters, as
+// written (first Arg 0) or after a rewrite (1), with the given number of
+// replay threads. Reports the log size.
+static void BM_ReplayLog(benchmark::State& state) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_bench_replay.log").string();
+    std::filesystem::remove(path);
+    uint64_t size;
+    {
+        KeyValueStore store;
+        store.open_log(path, FsyncPolicy::No);
+        for (int i = 0; i < 1000000; ++i) {
+            store.incr("counter" + std::to_string(i % 1000));
+        }
+        if (state.range(0)) {
+            store.rewrite_log();
+        }
+        size = store.log_size();
+    }
+    for (auto _ : state) {
+        KeyValueStore store;
+        store.set_replay_threads(static_cast<size_t>(state.range(1)));
+        store.open_log(path, FsyncPolicy::No);
+        benchmark::DoNotOptimize(store.count());
+    }
+    state.counters["log_bytes"] = static_cast<double>(size);
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_ReplayLog)->Args({0, 1})->Args({0, 4})->Args({1, 1})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Benchmark for finding the keys two stores of 1M keys differ in once both
+// have built their Merkle trees: diff the trees and compare the entries of
+// the differing leaves. Arg is how many keys differ.
+static void BM_MerkleDiff(benchmark::State& state) {
+    KeyValueStore primary;
+    KeyValueStore replica;
+    for (int i = 0; i < 1000000; ++i) {
+        primary.set("key" + std::to_string(i), "value" + std::to_string(i));
+        replica.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    for (int i = 0; i < state.range(0); ++i) {
+        replica.set("key" + std::to_string(i * 97), "changed");
+    }
+    const MerkleTree a = primary.merkle_tree();
+    const MerkleTree b = replica.merkle_tree();
+    size_t leaves = 0;
+    size_t found = 0;
+    for (auto _ : state) {
+        const std::vector<uint32_t> differing = MerkleTree::diff(a, b);
+        leaves = differing.size();
+        const auto mine = primary.leaf_entries(differing);
+        const auto theirs = replica.leaf_entries(differing);
+        KeyValueStore::LeafEntries only;
+        std::set_symmetric_difference(mine.begin(), mine.end(), theirs.begin(), theirs.end(), std::back_inserter(only));
+        found = only.size() / 2; // Each changed key once per side
+    }
+    state.counters["leaves"] = static_cast<double>(leaves);
+    state.counters["keys"] = static_cast<double>(found);
+}
+BENCHMARK(BM_MerkleDiff)->Arg(1)->Arg(100)->Arg(10000)->Unit(benchmark::kMillisecond);
 
 // Boilerplate main function to run the benchmarks
 BENCHMARK_MAIN();
\ No newline at end of file
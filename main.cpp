@@ -2,6 +2,8 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <filesystem>
+#include <charconv>
 #include "KeyValueStore.h"
 
 void print_help() {
@@ -12,22 +14,215 @@ void print_help() {
               << "  REMOVE key              - Deletes a key-value pair.\n"
               << "  INCR key                - Atomically increments an integer key.\n"
               << "  DECR key                - Atomically decrements an integer key.\n"
+              << "  INCRBY key delta        - Atomically adds delta to an integer key.\n"
+              << "  DECRBY key delta        - Atomically subtracts delta from an integer key.\n"
+              << "  INCRBYFLOAT key delta   - Atomically adds delta to a floating-point key.\n"
+              << "  APPEND key value        - Appends to a key and returns the new length.\n"
               << "  COUNT                   - Returns the total number of keys.\n"
               << "--------------------------------------------------------------------------\n"
+              << "  SETNX key value [ttl_ms]            - Sets a key only if it does not exist.\n"
+              << "  SETXX key value [ttl_ms]            - Sets a key only if it already exists.\n"
+              << "  GETSET key value [ttl_ms]           - Sets a key and returns its old value.\n"
+              << "  GETDEL key                          - Returns a key's value and deletes it.\n"
+              << "  CAS key expected new [ttl_ms]       - Sets a key only if it holds 'expected'.\n"
+              << "  VERSION key                         - Returns the version a key's last write gave it.\n"
+              << "  CASVERSION key version new [ttl_ms] - Sets a key only if it is still at 'version'.\n"
+              << "--------------------------------------------------------------------------\n"
               << "  BEGIN                   - Starts a new transaction.\n"
               << "  COMMIT                  - Saves all changes in the current transaction.\n"
               << "  ROLLBACK                - Discards all changes in the current transaction.\n"
               << "--------------------------------------------------------------------------\n"
+              << "  BGSAVE                  - Saves a snapshot in the background.\n"
+              << "  LASTSAVE                - Shows when the last save finished and how long it took.\n"
+              << "  BGREWRITELOG            - Compacts the write-ahead log in the background.\n"
+              << "  MERKLE                  - Shows the Merkle root and how the snapshot differs.\n"
               << "  HELP                    - Shows this help message.\n"
               << "  EXIT                    - Saves the database and closes the CLI.\n"
               << "--------------------------------------------------------------------------\n";
 }
 
-int main() {
+// Parses "value [ttl_ms]", the rest of the line, for commands that write a
+// value. Prints the error and returns false if the value is missing.
+bool parse_value_args(std::stringstream& ss, const std::string& command, std::string& value, long long& ttl_ms) {
+    std::string rest_of_line;
+    std::getline(ss, rest_of_line);
+
+    size_t first_char = rest_of_line.find_first_not_of(" \t");
+    if (std::string::npos == first_char) {
+        std::cout << "ERROR: Value cannot be empty for " << command << " command." << std::endl;
+        return false;
+    }
+    rest_of_line = rest_of_line.substr(first_char);
+
+    ttl_ms = -1;
+    value = rest_of_line;
+
+    size_t last_space = rest_of_line.find_last_of(" \t");
+    if (last_space != std::string::npos) {
+        std::string last_word = rest_of_line.substr(last_space + 1);
+        try {
+            size_t pos;
+            long long potential_ttl = std::stoll(last_word, &pos);
+            if (pos == last_word.length()) {
+                ttl_ms = potential_ttl;
+                value = rest_of_line.substr(0, last_space);
+            }
+        } catch (const std::invalid_argument&) {
+        } catch (const std::out_of_range&) {
+        }
+    }
+    return true;
+}
+
+// Parses "key value [ttl_ms]" for SET-style commands. Prints the usage error and
+// returns false if the arguments are incomplete.
+bool parse_set_args(std::stringstream& ss, const std::string& command, std::string& key, std::string& value, long long& ttl_ms) {
+    if (!(ss >> key)) {
+        std::cout << "ERROR: Incorrect usage. Try " << command << " key value [ttl_ms]" << std::endl;
+        return false;
+    }
+    return parse_value_args(ss, command, value, ttl_ms);
+}
+
+// Prints an error in place of the reply to a write that could not be logged,
+// or made as durable as the fsync policy promises. Returns true if it did.
+bool report_write_failure(KeyValueStore& kvs) {
+    if (!kvs.write_failed()) {
+        return false;
+    }
+    std::cout << "ERROR: The write could not be logged durably." << std::endl;
+    return true;
+}
+
+// Parses "SECONDS:CHANGES" from --save. The first rule given replaces the
+// defaults; later ones add to it.
+bool parse_save_rule(const std::string& spec, std::vector<KeyValueStore::SaveRule>& rules, bool& custom) {
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    try {
+        size_t used_seconds, used_changes;
+        long long seconds = std::stoll(spec.substr(0, colon), &used_seconds);
+        unsigned long long changes = std::stoull(spec.substr(colon + 1), &used_changes);
+        if (used_seconds != colon || used_changes != spec.size() - colon - 1 || seconds < 0) {
+            return false;
+        }
+        if (!custom) {
+            rules.clear();
+            custom = true;
+        }
+        rules.push_back({seconds, changes});
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Parses a plain decimal count such as the N of --delta-snapshots=N.
+bool parse_count(const std::string& spec, size_t& count) {
+    try {
+        size_t used;
+        unsigned long long value = std::stoull(spec, &used);
+        if (used != spec.size() || spec[0] == '-') {
+            return false;
+        }
+        count = static_cast<size_t>(value);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    FsyncPolicy fsync_policy = FsyncPolicy::EverySec;
+    SnapshotIntegrity integrity;
+    Compression compression = Compression::None;
+    IoBackend io_backend = IoBackend::Auto;
+    // Same defaults as Redis: after an hour if anything changed, after five
+    // minutes for 100 changes, after a minute for 10000.
+    std::vector<KeyValueStore::SaveRule> save_rules = {{3600, 1}, {300, 100}, {60, 10000}};
+    bool custom_save_rules = false;
+    size_t delta_chain = 0; // 0 keeps every checkpoint a full snapshot
+    bool lazy_load = false;
+    bool lazy_verify = false;
+    bool warm_restart = false;
+    // Like Redis: rewrite the log once it has doubled, but not below 64 MB.
+    size_t log_rewrite_percent = 100;
+    const uint64_t LOG_REWRITE_MIN_BYTES = 64ull * 1024 * 1024;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fsync=always") {
+            fsync_policy = FsyncPolicy::Always;
+        } else if (arg == "--fsync=everysec") {
+            fsync_policy = FsyncPolicy::EverySec;
+        } else if (arg == "--fsync=no") {
+            fsync_policy = FsyncPolicy::No;
+        } else if (arg.rfind("--checksum=", 0) == 0 && parse_checksum_type(arg.substr(11), integrity.checksum)) {
+            // Parsed into integrity.checksum
+        } else if (arg.rfind("--compression=", 0) == 0 && parse_compression(arg.substr(14), compression)) {
+            // Parsed into compression
+        } else if (arg.rfind("--io=", 0) == 0 && parse_io_backend(arg.substr(5), io_backend)) {
+            // Parsed into io_backend
+        } else if (arg == "--checksum-per-entry") {
+            integrity.per_entry = true;
+        } else if (arg == "--merkle") {
+            integrity.merkle = true;
+        } else if (arg == "--lazy-load") {
+            lazy_load = true;
+        } else if (arg == "--lazy-verify") {
+            lazy_load = true;
+            lazy_verify = true;
+        } else if (arg == "--warm-restart") {
+            warm_restart = true;
+        } else if (arg == "--delta-snapshots") {
+            delta_chain = 16;
+        } else if (arg.rfind("--delta-snapshots=", 0) == 0 && parse_count(arg.substr(18), delta_chain) && delta_chain > 0) {
+            // Parsed into delta_chain
+        } else if (arg == "--log-rewrite=off") {
+            log_rewrite_percent = 0;
+        } else if (arg.rfind("--log-rewrite=", 0) == 0 && parse_count(arg.substr(14), log_rewrite_percent)) {
+            // Parsed into log_rewrite_percent
+        } else if (arg == "--save=off") {
+            save_rules.clear();
+            custom_save_rules = true;
+        } else if (arg.rfind("--save=", 0) == 0 && parse_save_rule(arg.substr(7), save_rules, custom_save_rules)) {
+            // Parsed into save_rules
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--fsync=always|everysec|no] [--checksum=crc32c|xxh64|sha256] [--checksum-per-entry] [--merkle]"
+                      << " [--compression=none|lz4] [--io=auto|uring|threads] [--save=SECONDS:CHANGES ...|--save=off] [--delta-snapshots[=MAX_CHAIN]]"
+                      << " [--lazy-load|--lazy-verify] [--warm-restart] [--log-rewrite=PERCENT|--log-rewrite=off]" << std::endl;
+            return 1;
+        }
+    }
+
     KeyValueStore kvs;
+    kvs.set_snapshot_integrity(integrity);
+    kvs.set_snapshot_compression(compression);
+    kvs.set_io_backend(io_backend);
+    kvs.set_lazy_load(lazy_load, true, lazy_verify);
+    if (delta_chain > 0) {
+        kvs.set_delta_snapshots(true, delta_chain);
+    }
     std::string line;
-    const std::string FILENAME = std::string(PROJECT_SOURCE_DIR) + "/data.json";
-    kvs.load(FILENAME);
+    const std::string FILENAME = std::string(PROJECT_SOURCE_DIR) + "/data.snap";
+    const std::string LEGACY_FILENAME = std::string(PROJECT_SOURCE_DIR) + "/data.json";
+    const std::string LOG_FILENAME = std::string(PROJECT_SOURCE_DIR) + "/data.log";
+    const std::string WARM_FILENAME = std::string(PROJECT_SOURCE_DIR) + "/data.warm";
+    // A clean warm image is served as is. Without one, or after a crash,
+    // the store is rebuilt from the snapshot. An image left from a run with
+    // --warm-restart would be stale after a run without it.
+    if (!warm_restart) {
+        std::filesystem::remove(WARM_FILENAME);
+    }
+    if (!(warm_restart && kvs.attach_warm_image(WARM_FILENAME))) {
+        // Older versions persisted to data.json; keep reading it until the first binary save.
+        kvs.load(std::filesystem::exists(FILENAME) ? FILENAME : LEGACY_FILENAME);
+    }
+    // Anything written since that snapshot is recovered from the log.
+    kvs.set_log_rewrite(static_cast<unsigned>(log_rewrite_percent), LOG_REWRITE_MIN_BYTES);
+    kvs.open_log(LOG_FILENAME, fsync_policy, compression);
+    kvs.set_autosave(FILENAME, save_rules);
 
     std::cout << "Nikhil's In-Memory Key-Value Store Project" << std::endl;
     std::cout << "Enter commands (e.g., SET, GET, INCR, DECR, EXIT)" << std::endl;
@@ -42,10 +237,50 @@ int main() {
         std::string command;
         ss >> command;
         if (command == "EXIT") {
-            kvs.save(FILENAME);
-            std::cout << "Data saved to data.json" << std::endl;
+            kvs.checkpoint(FILENAME);
+            std::cout << "Data saved to data.snap" << std::endl;
+            if (warm_restart && kvs.save_warm_image(WARM_FILENAME)) {
+                std::cout << "Warm image saved to data.warm" << std::endl;
+            }
             break;
         }
+        else if (command == "BGSAVE") {
+            if (kvs.save_background(FILENAME)) {
+                std::cout << "Background saving started" << std::endl;
+            } else {
+                std::cout << "ERROR: A background save is already in progress." << std::endl;
+            }
+        }
+        else if (command == "BGREWRITELOG") {
+            if (kvs.rewrite_log_background()) {
+                std::cout << "Background log rewrite started" << std::endl;
+            } else {
+                std::cout << "ERROR: A log rewrite is already in progress." << std::endl;
+            }
+        }
+        else if (command == "MERKLE") {
+            MerkleTree live = kvs.merkle_tree();
+            std::cout << sha256_hex(live.root().data()) << " (" << live.total_entries() << " entries)";
+            MerkleTree saved;
+            std::string error;
+            if (MerkleTree::read(FILENAME, saved, error)) {
+                size_t leaves = MerkleTree::diff(live, saved).size();
+                std::cout << ", " << leaves << " of " << MerkleTree::LEAF_COUNT << " leaves differ from the snapshot";
+            }
+            std::cout << std::endl;
+        }
+        else if (command == "LASTSAVE") {
+            KeyValueStore::SaveStats stats = kvs.save_stats();
+            if (stats.last_save_ms == 0) {
+                std::cout << "(never)";
+            } else {
+                std::cout << stats.last_save_ms << " (took " << stats.last_save_duration_ms << " ms)";
+            }
+            if (!stats.last_save_ok) {
+                std::cout << ", last attempt failed";
+            }
+            std::cout << ", " << stats.changes_since_save << " changes since" << std::endl;
+        }
         else if (command == "HELP") {
             print_help();
         }
@@ -59,41 +294,105 @@ int main() {
             kvs.rollback();
         }
         else if (command == "SET") {
+            std::string key, value;
+            long long ttl_ms = -1;
+            if (!parse_set_args(ss, "SET", key, value, ttl_ms)) {
+                continue;
+            }
+            kvs.set(key, value, ttl_ms);
+            if (report_write_failure(kvs)) {
+                continue;
+            }
+            std::cout << "OK" << std::endl;
+        }
+        else if (command == "SETNX" || command == "SETXX") {
+            std::string key, value;
+            long long ttl_ms = -1;
+            if (!parse_set_args(ss, command, key, value, ttl_ms)) {
+                continue;
+            }
+            bool written = (command == "SETNX") ? kvs.setnx(key, value, ttl_ms) : kvs.setxx(key, value, ttl_ms);
+            if (report_write_failure(kvs)) {
+                continue;
+            }
+            std::cout << (written ? "OK" : "(nil)") << std::endl;
+        }
+        else if (command == "GETSET") {
+            std::string key, value;
+            long long ttl_ms = -1;
+            if (!parse_set_args(ss, "GETSET", key, value, ttl_ms)) {
+                continue;
+            }
+            auto old_value = kvs.getset(key, value, ttl_ms);
+            if (report_write_failure(kvs)) {
+                continue;
+            }
+            if (old_value) {
+                std::cout << *old_value << std::endl;
+            } else {
+                std::cout << "(nil)" << std::endl;
+            }
+        }
+        else if (command == "GETDEL") {
             std::string key;
-            if (!(ss >> key)) {
-                std::cout << "ERROR: Incorrect usage. Try SET key value [ttl_ms]" << std::endl;
+            if (ss >> key) {
+                auto old_value = kvs.getdel(key);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (old_value) {
+                    std::cout << *old_value << std::endl;
+                } else {
+                    std::cout << "(nil)" << std::endl;
+                }
+            } else {
+                std::cout << "ERROR: Incorrect usage. Try GETDEL key" << std::endl;
+            }
+        }
+        else if (command == "CAS") {
+            std::string key, expected, desired;
+            long long ttl_ms = -1;
+            if (!(ss >> key >> expected)) {
+                std::cout << "ERROR: Incorrect usage. Try CAS key expected new_value [ttl_ms]" << std::endl;
                 continue;
             }
-
-            std::string rest_of_line;
-            std::getline(ss, rest_of_line);
-
-            size_t first_char = rest_of_line.find_first_not_of(" \t");
-            if (std::string::npos == first_char) {
-                std::cout << "ERROR: Value cannot be empty for SET command." << std::endl;
+            if (!parse_value_args(ss, "CAS", desired, ttl_ms)) {
                 continue;
             }
-            rest_of_line = rest_of_line.substr(first_char);
-
+            bool written = kvs.cas(key, expected, desired, ttl_ms);
+            if (report_write_failure(kvs)) {
+                continue;
+            }
+            std::cout << (written ? "OK" : "(nil)") << std::endl;
+        }
+        else if (command == "CASVERSION") {
+            std::string key, desired;
+            unsigned long long expected_version;
             long long ttl_ms = -1;
-            std::string value = rest_of_line;
-
-            size_t last_space = rest_of_line.find_last_of(" \t");
-            if (last_space != std::string::npos) {
-                std::string last_word = rest_of_line.substr(last_space + 1);
-                try {
-                    size_t pos;
-                    long long potential_ttl = std::stoll(last_word, &pos);
-                    if (pos == last_word.length()) {
-                        ttl_ms = potential_ttl;
-                        value = rest_of_line.substr(0, last_space);
-                    }
-                } catch (const std::invalid_argument&) {
-                } catch (const std::out_of_range&) {
+            if (!(ss >> key >> expected_version)) {
+                std::cout << "ERROR: Incorrect usage. Try CASVERSION key version new_value [ttl_ms]" << std::endl;
+                continue;
+            }
+            if (!parse_value_args(ss, "CASVERSION", desired, ttl_ms)) {
+                continue;
+            }
+            bool written = kvs.cas_version(key, expected_version, desired, ttl_ms);
+            if (report_write_failure(kvs)) {
+                continue;
+            }
+            std::cout << (written ? "OK" : "(nil)") << std::endl;
+        }
+        else if (command == "VERSION") {
+            std::string key;
+            if (ss >> key) {
+                if (auto version = kvs.version(key)) {
+                    std::cout << "(integer) " << *version << std::endl;
+                } else {
+                    std::cout << "(nil)" << std::endl;
                 }
+            } else {
+                std::cout << "ERROR: Incorrect usage. Try VERSION key" << std::endl;
             }
-            kvs.set(key, value, ttl_ms);
-            std::cout << "OK" << std::endl;
         }else if(command == "GET"){
             std::string key;
             if (ss >> key) {
@@ -112,7 +411,11 @@ int main() {
         else if (command == "REMOVE") {
             std::string key;
             if (ss >> key) {
-                if (kvs.remove(key)) {
+                bool removed = kvs.remove(key);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (removed) {
                     std::cout << "OK" << std::endl;
                 } else {
                     std::cout << "Key not found" << std::endl;
@@ -125,7 +428,11 @@ int main() {
         else if (command == "INCR") {
             std::string key;
             if (ss >> key) {
-                if (auto new_value = kvs.incr(key)) {
+                auto new_value = kvs.incr(key);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (new_value) {
                     std::cout << "(integer) " << *new_value << std::endl;
                 } else {
                     std::cout << "ERROR: Value is not an integer or out of range." << std::endl;
@@ -134,10 +441,26 @@ int main() {
                 std::cout << "ERROR: Incorrect usage. Try INCR key" << std::endl;
             }
         }
+        else if (command == "APPEND") {
+            std::string key, suffix;
+            if (ss >> key >> suffix) {
+                size_t length = kvs.append(key, suffix);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                std::cout << "(integer) " << length << std::endl;
+            } else {
+                std::cout << "ERROR: Incorrect usage. Try APPEND key value" << std::endl;
+            }
+        }
         else if (command == "DECR") {
             std::string key;
             if (ss >> key) {
-                if (auto new_value = kvs.decr(key)) {
+                auto new_value = kvs.decr(key);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (new_value) {
                     std::cout << "(integer) " << *new_value << std::endl;
                 } else {
                     std::cout << "ERROR: Value is not an integer or out of range." << std::endl;
@@ -146,6 +469,43 @@ int main() {
                 std::cout << "ERROR: Incorrect usage. Try DECR key" << std::endl;
             }
         }
+        else if (command == "INCRBY" || command == "DECRBY") {
+            std::string key;
+            long long delta;
+            if (ss >> key >> delta) {
+                auto new_value = (command == "INCRBY") ? kvs.incrby(key, delta) : kvs.decrby(key, delta);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (new_value) {
+                    std::cout << "(integer) " << *new_value << std::endl;
+                } else {
+                    std::cout << "ERROR: Value is not an integer or out of range." << std::endl;
+                }
+            } else {
+                std::cout << "ERROR: Incorrect usage. Try " << command << " key delta" << std::endl;
+            }
+        }
+        else if (command == "INCRBYFLOAT") {
+            std::string key;
+            double delta;
+            if (ss >> key >> delta) {
+                auto new_value = kvs.incrbyfloat(key, delta);
+                if (report_write_failure(kvs)) {
+                    continue;
+                }
+                if (new_value) {
+                    // Shortest round-trip form, as GET shows it
+                    char buf[32];
+                    auto res = std::to_chars(buf, buf + sizeof(buf), *new_value);
+                    std::cout << std::string(buf, res.ptr) << std::endl;
+                } else {
+                    std::cout << "ERROR: Value is not a valid float or out of range." << std::endl;
+                }
+            } else {
+                std::cout << "ERROR: Incorrect usage. Try INCRBYFLOAT key delta" << std::endl;
+            }
+        }
 
         else if (!command.empty()) {
             std::cout << "ERROR: Unknown command '" << command << "'" << std::endl;
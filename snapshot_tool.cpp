@@ -0,0 +1,524 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <array>
+#include <future>
+#include <memory>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include "Snapshot.h"
+#include "JsonSnapshot.h"
+#include "MerkleTree.h"
+#include "ThreadPool.h"
+#include "AsyncIo.h"
+
+// imkvs-snapshot: converts, inspects and verifies snapshot files without
+// loading them into a store. Files are streamed a block (or a batch of JSON
+// envelopes) at a time; checking and decoding runs on a pool while the next
+// one is read, and only a bounded window of them is in memory at once.
+
+namespace {
+
+using Entries = std::vector<std::pair<std::string, ValueWithTTL>>;
+
+void print_usage(const char* program) {
+    std::cerr << "Usage:\n"
+              << "  " << program << " convert IN OUT [--to=json|binary] [--checksum=crc32c|xxh64|sha256]"
+              << " [--checksum-per-entry] [--compression=none|lz4] [--merkle] [--threads=N]\n"
+              << "  " << program << " stats FILE [--threads=N]\n"
+              << "  " << program << " verify FILE [--threads=N]\n"
+              << "The format of IN and FILE is detected. convert writes the other format unless --to says"
+              << " otherwise, and keeps the checksum, compression and manifest of a binary IN by default."
+              << " Delta snapshots cannot be converted on their own.\n";
+}
+
+// What one task made of a block or a batch of envelopes
+struct Chunk {
+    Entries entries;
+    std::vector<std::pair<uint32_t, MerkleTree::Digest>> digests; // For the manifest check
+    std::string text;     // Output rendered on the worker, if any
+    std::string messages;
+    uint64_t lost = 0;    // Entries that failed their checks or could not be decoded
+};
+
+// Runs tasks on a pool and hands their chunks to emit on the calling
+// thread in submission order. At most two per worker are in flight, which
+// bounds memory whatever the size of the file.
+class OrderedPipeline {
+public:
+    using Task = std::function<void(Chunk&)>;
+    using Emit = std::function<void(Chunk&)>;
+
+    OrderedPipeline(size_t threads, Emit emit) : pool(threads), window(2 * pool.size()), emit(std::move(emit)) {}
+
+    void submit(Task task) {
+        auto chunk = std::make_shared<Chunk>();
+        auto done = std::make_shared<std::promise<void>>();
+        pending.emplace_back(chunk, done->get_future());
+        pool.submit([chunk, done, task = std::move(task)] {
+            task(*chunk);
+            done->set_value();
+        });
+        while (pending.size() > window) {
+            pop();
+        }
+    }
+
+    void drain() {
+        while (!pending.empty()) {
+            pop();
+        }
+    }
+
+private:
+    ThreadPool pool;
+    size_t window;
+    Emit emit;
+    std::deque<std::pair<std::shared_ptr<Chunk>, std::future<void>>> pending;
+
+    void pop() {
+        pending.front().second.wait();
+        emit(*pending.front().first);
+        pending.pop_front();
+    }
+};
+
+// What reading a file found out about it
+struct Summary {
+    SnapshotFormat format = SnapshotFormat::Binary;
+    SnapshotIntegrity integrity;
+    Compression compression = Compression::None;
+    SnapshotChain chain;
+    uint64_t units = 0;   // Blocks, or batches of envelopes
+    uint64_t entries = 0; // Decoded intact
+    uint64_t lost = 0;
+    bool incomplete = false; // Truncated or unparseable past some point
+    bool manifest_damaged = false;
+    uint64_t manifest_leaves = 0; // Leaves that disagree with the manifest
+};
+
+// Reads path, hands every intact entry to emit in file order and reports
+// problems on stderr as they are found. prepare, if set, runs on the
+// worker after a chunk has been decoded. Returns false if the file cannot
+// be read at all.
+bool scan(const std::string& path, size_t threads, const OrderedPipeline::Task& prepare,
+          const OrderedPipeline::Emit& emit, Summary& summary) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "[ERROR] Cannot open " << path << "." << std::endl;
+        return false;
+    }
+    std::unique_ptr<MerkleTree> loaded;
+    OrderedPipeline pipeline(threads, [&](Chunk& chunk) {
+        std::cerr << chunk.messages;
+        summary.entries += chunk.entries.size();
+        summary.lost += chunk.lost;
+        if (loaded) {
+            for (const auto& d : chunk.digests) {
+                loaded->add(d.first, d.second);
+            }
+        }
+        if (emit) {
+            emit(chunk);
+        }
+    });
+
+    if (!SnapshotReader::is_snapshot(in)) {
+        constexpr size_t BATCH_SIZE = 1024;
+        summary.format = SnapshotFormat::Json;
+        auto batch = std::make_shared<EnvelopeBatch>();
+        auto submit_batch = [&] {
+            pipeline.submit([batch, &prepare](Chunk& chunk) {
+                chunk.lost = decode_envelopes(*batch, chunk.entries, chunk.messages);
+                if (prepare) {
+                    prepare(chunk);
+                }
+            });
+            batch = std::make_shared<EnvelopeBatch>();
+            ++summary.units;
+        };
+        EnvelopeReader reader([&](const std::string& key, json& entry_envelope) {
+            batch->emplace_back(key, std::move(entry_envelope));
+            if (batch->size() == BATCH_SIZE) {
+                submit_batch();
+            }
+        });
+        bool parsed = false;
+        try {
+            parsed = json::sax_parse(in, &reader);
+        } catch (const json::exception&) {
+            parsed = false;
+        }
+        if (!batch->empty()) {
+            submit_batch();
+        }
+        pipeline.drain();
+        if (!parsed) {
+            std::cerr << "[ERROR] " << path << " is neither a binary snapshot nor valid JSON past entry "
+                      << summary.entries + summary.lost << "." << std::endl;
+            summary.incomplete = true;
+        }
+        return true;
+    }
+
+    SnapshotReader reader(in);
+    if (!reader.header_ok()) {
+        std::cerr << "[ERROR] " << path << " has an unsupported snapshot version or flags." << std::endl;
+        return false;
+    }
+    summary.integrity = reader.integrity();
+    summary.integrity.merkle = reader.has_manifest();
+    summary.compression = reader.compression();
+    summary.chain = reader.chain();
+    if (reader.has_manifest()) {
+        loaded = std::make_unique<MerkleTree>();
+    }
+    const bool merkle = loaded != nullptr;
+    SnapshotBlock block;
+    while (reader.read_block(block)) {
+        const uint64_t block_no = ++summary.units;
+        auto shared = std::make_shared<SnapshotBlock>(std::move(block));
+        pipeline.submit([shared, block_no, merkle, &path, &prepare](Chunk& chunk) {
+            bool intact = SnapshotReader::verify(*shared);
+            if (!intact && !shared->integrity.per_entry) {
+                chunk.messages = "[CRITICAL] Checksum mismatch in block " + std::to_string(block_no) + " of " + path
+                    + ". Its " + std::to_string(shared->entry_count) + " entries are lost.\n";
+                chunk.lost = shared->entry_count;
+                return;
+            }
+            size_t rejected = 0;
+            bool decoded = SnapshotReader::decode_block(*shared, chunk.entries, !intact, &rejected);
+            if (!intact) {
+                chunk.messages = "[CRITICAL] Checksum mismatch in block " + std::to_string(block_no) + " of " + path
+                    + ". " + std::to_string(rejected) + " damaged entries are lost.\n";
+            }
+            if (!decoded) {
+                chunk.messages += "[WARNING] Undecodable entries in block " + std::to_string(block_no) + " of " + path + ".\n";
+            }
+            if (chunk.entries.size() < shared->entry_count) {
+                chunk.lost = shared->entry_count - chunk.entries.size();
+            }
+            if (merkle) {
+                chunk.digests.reserve(chunk.entries.size());
+                for (const auto& entry : chunk.entries) {
+                    chunk.digests.emplace_back(MerkleTree::leaf_of(entry.first),
+                                               MerkleTree::entry_digest(entry.first, entry.second));
+                }
+            }
+            if (prepare) {
+                prepare(chunk);
+            }
+        });
+        block = SnapshotBlock();
+    }
+    pipeline.drain();
+    if (reader.truncated()) {
+        std::cerr << "[WARNING] " << path << " is truncated after block " << summary.units << "." << std::endl;
+        summary.incomplete = true;
+    } else if (loaded) {
+        MerkleTree manifest;
+        if (!reader.read_manifest(manifest)) {
+            std::cerr << "[WARNING] The Merkle manifest of " << path << " is damaged." << std::endl;
+            summary.manifest_damaged = true;
+        } else {
+            loaded->build();
+            const std::vector<uint32_t> leaves = MerkleTree::diff(manifest, *loaded);
+            summary.manifest_leaves = leaves.size();
+            if (!leaves.empty()) {
+                std::cerr << "[CRITICAL] " << path << " does not match its Merkle manifest: " << leaves.size()
+                          << " leaves differ, " << MerkleTree::missing(manifest, *loaded, leaves)
+                          << " entries missing." << std::endl;
+            }
+        }
+    }
+    return true;
+}
+
+bool damaged(const Summary& summary) {
+    return summary.lost > 0 || summary.incomplete || summary.manifest_damaged || summary.manifest_leaves > 0;
+}
+
+void print_summary(const std::string& path, const Summary& summary) {
+    std::cout << path << ": ";
+    if (summary.format == SnapshotFormat::Json) {
+        std::cout << "JSON snapshot, SHA-256 per entry";
+    } else {
+        std::cout << "binary snapshot, " << checksum_name(summary.integrity.checksum)
+                  << (summary.integrity.per_entry ? " per block and entry" : " per block")
+                  << ", compression " << compression_name(summary.compression);
+        if (summary.integrity.merkle) {
+            std::cout << ", Merkle manifest";
+        }
+        if (summary.chain.base_id) {
+            std::cout << ", " << (summary.chain.sequence ? "delta " + std::to_string(summary.chain.sequence) : std::string("base"))
+                      << " of chain " << summary.chain.base_id;
+        }
+        std::cout << ", " << summary.units << " blocks";
+    }
+    std::cout << ", " << summary.entries << " entries" << std::endl;
+}
+
+// Counts of values by the power of two range they fall into
+struct Histogram {
+    std::array<uint64_t, 65> buckets{}; // Bucket b holds values of bit width b
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    void add(uint64_t v) {
+        unsigned width = 0;
+        while (width < 64 && (v >> width) != 0) {
+            ++width;
+        }
+        ++buckets[width];
+        ++count;
+        total += v;
+        max = std::max(max, v);
+    }
+
+    void print(const char* title) const {
+        std::printf("%s: avg %.1f, max %llu\n", title, count ? static_cast<double>(total) / count : 0.0,
+                    static_cast<unsigned long long>(max));
+        for (unsigned b = 0; b < buckets.size(); ++b) {
+            if (buckets[b] == 0) {
+                continue;
+            }
+            unsigned long long low = b == 0 ? 0 : 1ull << (b - 1);
+            unsigned long long high = b == 0 ? 0 : (b == 64 ? ~0ull : (1ull << b) - 1);
+            std::printf("  %10llu - %-10llu %12llu  %5.1f%%\n", low, high, static_cast<unsigned long long>(buckets[b]),
+                        100.0 * buckets[b] / count);
+        }
+    }
+};
+
+struct Stats {
+    Histogram key_sizes;
+    Histogram value_sizes; // Strings by length, numbers by their 8 stored bytes
+    uint64_t strings = 0;
+    uint64_t integers = 0;
+    uint64_t floats = 0;
+    // No TTL, expired (tombstones included), then due within a minute, an
+    // hour, a day, a week, and later
+    std::array<uint64_t, 7> ttl{};
+
+    void add(const std::string& key, const ValueWithTTL& value, long long now) {
+        key_sizes.add(key.size());
+        if (auto* str = std::get_if<std::string>(&value.data)) {
+            ++strings;
+            value_sizes.add(str->size());
+        } else {
+            ++(std::holds_alternative<long long>(value.data) ? integers : floats);
+            value_sizes.add(8);
+        }
+        static const long long LIMITS[] = {60000LL, 3600000LL, 86400000LL, 604800000LL};
+        if (value.expiration_time_ms == -1) {
+            ++ttl[0];
+        } else if (value.expiration_time_ms <= now) {
+            ++ttl[1];
+        } else {
+            size_t slot = 2;
+            while (slot < 6 && value.expiration_time_ms - now > LIMITS[slot - 2]) {
+                ++slot;
+            }
+            ++ttl[slot];
+        }
+    }
+
+    void print() const {
+        std::printf("types: %llu string, %llu integer, %llu float\n", static_cast<unsigned long long>(strings),
+                    static_cast<unsigned long long>(integers), static_cast<unsigned long long>(floats));
+        key_sizes.print("key bytes");
+        value_sizes.print("value bytes");
+        static const char* const NAMES[] = {"none", "expired", "< 1 minute", "< 1 hour", "< 1 day", "< 1 week", "later"};
+        std::printf("ttl:\n");
+        for (size_t i = 0; i < ttl.size(); ++i) {
+            std::printf("  %-12s %12llu\n", NAMES[i], static_cast<unsigned long long>(ttl[i]));
+        }
+    }
+};
+
+long long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct ConvertOptions {
+    bool format_set = false;
+    SnapshotFormat format = SnapshotFormat::Binary;
+    bool integrity_set = false;
+    SnapshotIntegrity integrity;
+    bool compression_set = false;
+    Compression compression = Compression::None;
+};
+
+int convert(const std::string& in_path, const std::string& out_path, ConvertOptions options, size_t threads) {
+    // The header is needed before anything is written, so peek at it
+    {
+        std::ifstream in(in_path, std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "[ERROR] Cannot open " << in_path << "." << std::endl;
+            return 1;
+        }
+        const bool binary = SnapshotReader::is_snapshot(in);
+        if (binary) {
+            SnapshotReader header(in);
+            if (header.header_ok() && header.chain().sequence != 0) {
+                std::cerr << "[ERROR] " << in_path << " is a delta snapshot. Load it with its base and save instead."
+                          << std::endl;
+                return 1;
+            }
+            if (!options.integrity_set) {
+                options.integrity = header.integrity();
+                options.integrity.merkle = header.has_manifest();
+            }
+            if (!options.compression_set) {
+                options.compression = header.compression();
+            }
+        }
+        if (!options.format_set) {
+            options.format = binary ? SnapshotFormat::Json : SnapshotFormat::Binary;
+        }
+    }
+
+    // Written next to the target and renamed over it, so IN may be OUT
+    const std::string temp = out_path + ".tmp";
+    AsyncFileBuf buffer;
+    if (!buffer.open(temp)) {
+        std::cerr << "[ERROR] Cannot create " << temp << "." << std::endl;
+        return 1;
+    }
+    std::ostream out(&buffer);
+    Summary summary;
+    bool read = false;
+    if (options.format == SnapshotFormat::Binary) {
+        SnapshotWriter writer(out, options.integrity, {}, options.compression);
+        read = scan(in_path, threads, nullptr, [&](Chunk& chunk) {
+            for (const auto& entry : chunk.entries) {
+                writer.add(entry.first, entry.second);
+            }
+        }, summary);
+        read = writer.finish() && read;
+    } else {
+        // Values are hashed and rendered on the workers
+        bool first = true;
+        out << '{';
+        read = scan(in_path, threads, [](Chunk& chunk) {
+            bool first_in_chunk = true;
+            append_envelopes(chunk.entries, chunk.text, first_in_chunk);
+        }, [&](Chunk& chunk) {
+            if (!chunk.text.empty()) {
+                if (!first) {
+                    out << ',';
+                }
+                first = false;
+                out << chunk.text;
+            }
+        }, summary);
+        out << "\n}\n";
+    }
+    out.flush();
+    const bool written = buffer.close() && static_cast<bool>(out);
+    if (!read || !written || std::rename(temp.c_str(), out_path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        std::cerr << "[ERROR] Could not convert " << in_path << " to " << out_path << "." << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << summary.entries << " entries to " << out_path << " as "
+              << (options.format == SnapshotFormat::Json ? "JSON" : "binary");
+    if (summary.lost) {
+        std::cout << ", " << summary.lost << " damaged entries left out";
+    }
+    std::cout << std::endl;
+    return damaged(summary) ? 2 : 0;
+}
+
+int stats(const std::string& path, size_t threads) {
+    Stats totals;
+    const long long now = now_ms();
+    Summary summary;
+    if (!scan(path, threads, nullptr, [&](Chunk& chunk) {
+            for (const auto& entry : chunk.entries) {
+                totals.add(entry.first, entry.second, now);
+            }
+        }, summary)) {
+        return 1;
+    }
+    print_summary(path, summary);
+    totals.print();
+    return damaged(summary) ? 2 : 0;
+}
+
+int verify(const std::string& path, size_t threads) {
+    Summary summary;
+    if (!scan(path, threads, nullptr, nullptr, summary)) {
+        return 1;
+    }
+    print_summary(path, summary);
+    if (!damaged(summary)) {
+        std::cout << "OK" << std::endl;
+        return 0;
+    }
+    std::cout << "DAMAGED: " << summary.lost << " entries lost";
+    if (summary.incomplete) {
+        std::cout << ", file incomplete";
+    }
+    if (summary.manifest_damaged) {
+        std::cout << ", manifest damaged";
+    } else if (summary.manifest_leaves) {
+        std::cout << ", " << summary.manifest_leaves << " Merkle leaves differ";
+    }
+    std::cout << std::endl;
+    return 2;
+}
+
+} // namespace
+
+// Exit status: 0 if the file was read cleanly, 2 if it was read but is
+// damaged, 1 for usage and I/O errors.
+int main(int argc, char* argv[]) {
+    std::vector<std::string> operands;
+    ConvertOptions options;
+    size_t threads = ThreadPool::default_size();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--to=json" || arg == "--to=binary") {
+            options.format_set = true;
+            options.format = arg == "--to=json" ? SnapshotFormat::Json : SnapshotFormat::Binary;
+        } else if (arg.rfind("--checksum=", 0) == 0 && parse_checksum_type(arg.substr(11), options.integrity.checksum)) {
+            options.integrity_set = true;
+        } else if (arg == "--checksum-per-entry") {
+            options.integrity_set = true;
+            options.integrity.per_entry = true;
+        } else if (arg == "--merkle") {
+            options.integrity_set = true;
+            options.integrity.merkle = true;
+        } else if (arg.rfind("--compression=", 0) == 0 && parse_compression(arg.substr(14), options.compression)) {
+            options.compression_set = true;
+        } else if (arg.rfind("--threads=", 0) == 0 && arg.size() > 10 && arg.find_first_not_of("0123456789", 10) == std::string::npos) {
+            threads = std::max<size_t>(1, std::strtoull(arg.c_str() + 10, nullptr, 10));
+        } else if (arg.rfind("--", 0) == 0) {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            operands.push_back(arg);
+        }
+    }
+
+    if (operands.size() == 3 && operands[0] == "convert") {
+        return convert(operands[1], operands[2], options, threads);
+    }
+    if (operands.size() == 2 && operands[0] == "stats") {
+        return stats(operands[1], threads);
+    }
+    if (operands.size() == 2 && operands[0] == "verify") {
+        return verify(operands[1], threads);
+    }
+    print_usage(argv[0]);
+    return 1;
+}
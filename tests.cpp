@@ -1,5 +1,19 @@
 #include <gtest/gtest.h>
 #include "KeyValueStore.h"
+#include "JsonSnapshot.h"
+#include "Encoding.h"
+#include "picosha2.h"
+#include <algorithm>
+#include <iterator>
+#include <climits>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <sys/resource.h>
 
 // Test fixture for creating a fresh KeyValueStore for each test case
 class KeyValueStoreTest : public ::testing::Test {
@@ -56,4 +70,1380 @@ TEST_F(KeyValueStoreTest, TransactionRollback) {
     EXPECT_EQ(kvs.get("status").value(), "modified");
     kvs.rollback();
     EXPECT_EQ(kvs.get("status").value(), "initial");
-}
\ No newline at end of file
+}
+
+// Test case for a transaction large enough to span every partition
+TEST_F(KeyValueStoreTest, LargeTransactionCommit) {
+    kvs.set("doomed", "x");
+    kvs.begin();
+    for (int i = 0; i < 20000; ++i) {
+        kvs.set("bulk" + std::to_string(i), std::to_string(i));
+    }
+    kvs.set("bulk7", "overwritten");
+    kvs.remove("doomed");
+    EXPECT_EQ(kvs.get("bulk19999").value(), "19999");
+    EXPECT_FALSE(kvs.get("doomed").has_value());
+    EXPECT_EQ(kvs.count(), 1);
+    kvs.commit();
+
+    EXPECT_EQ(kvs.count(), 20000);
+    EXPECT_EQ(kvs.get("bulk7").value(), "overwritten");
+    EXPECT_EQ(kvs.get("bulk12345").value(), "12345");
+    EXPECT_FALSE(kvs.get("doomed").has_value());
+}
+
+// Test case for the conditional SETNX/SETXX writes
+TEST_F(KeyValueStoreTest, ConditionalSet) {
+    EXPECT_FALSE(kvs.setxx("lock", "owner1"));
+    EXPECT_FALSE(kvs.get("lock").has_value());
+    EXPECT_TRUE(kvs.setnx("lock", "owner1"));
+    EXPECT_FALSE(kvs.setnx("lock", "owner2"));
+    EXPECT_EQ(kvs.get("lock").value(), "owner1");
+    EXPECT_TRUE(kvs.setxx("lock", "owner3"));
+    EXPECT_EQ(kvs.get("lock").value(), "owner3");
+}
+
+// Test case for GETSET and GETDEL
+TEST_F(KeyValueStoreTest, GetSetAndGetDel) {
+    EXPECT_FALSE(kvs.getset("k", "v1").has_value());
+    EXPECT_EQ(kvs.getset("k", "v2").value(), "v1");
+    EXPECT_EQ(kvs.getdel("k").value(), "v2");
+    EXPECT_FALSE(kvs.get("k").has_value());
+    EXPECT_FALSE(kvs.getdel("k").has_value());
+}
+
+// Test case for compare-and-swap on value and on version
+TEST_F(KeyValueStoreTest, CompareAndSwap) {
+    kvs.set("state", "idle");
+    EXPECT_FALSE(kvs.cas("state", "busy", "done"));
+    EXPECT_TRUE(kvs.cas("state", "idle", "busy"));
+    EXPECT_EQ(kvs.get("state").value(), "busy");
+
+    auto v = kvs.version("state");
+    ASSERT_TRUE(v.has_value());
+    EXPECT_TRUE(kvs.cas_version("state", *v, "done"));
+    EXPECT_FALSE(kvs.cas_version("state", *v, "stale"));
+    EXPECT_EQ(kvs.get("state").value(), "done");
+    EXPECT_FALSE(kvs.version("missing").has_value());
+}
+
+// Test case for DECR and for INCR on a numeric string
+TEST_F(KeyValueStoreTest, DecrementAndNumericString) {
+    EXPECT_EQ(kvs.decr("down").value(), -1);
+    EXPECT_EQ(kvs.decr("down").value(), -2);
+    kvs.set("num", "41");
+    EXPECT_EQ(kvs.incr("num").value(), 42);
+    kvs.set("word", "abc");
+    EXPECT_FALSE(kvs.incr("word").has_value());
+    EXPECT_EQ(kvs.get("word").value(), "abc");
+}
+
+// Test case for APPEND and the generic update() primitive
+TEST_F(KeyValueStoreTest, AppendAndUpdate) {
+    EXPECT_EQ(kvs.append("log", "a"), 1);
+    EXPECT_EQ(kvs.append("log", "bc"), 3);
+    EXPECT_EQ(kvs.get("log").value(), "abc");
+
+    EXPECT_FALSE(kvs.update("absent", [](ValueWithTTL&, bool existed) { return existed; }));
+    EXPECT_FALSE(kvs.get("absent").has_value());
+    EXPECT_EQ(kvs.count(), 1);
+
+    kvs.begin();
+    kvs.incr("c");
+    kvs.append("log", "d");
+    EXPECT_EQ(kvs.get("log").value(), "abcd");
+    kvs.rollback();
+    EXPECT_EQ(kvs.get("log").value(), "abc");
+    EXPECT_FALSE(kvs.get("c").has_value());
+}
+
+// Test case for INCRBY/DECRBY including overflow detection
+TEST_F(KeyValueStoreTest, IncrByAndOverflow) {
+    EXPECT_EQ(kvs.incrby("meter", 100).value(), 100);
+    EXPECT_EQ(kvs.decrby("meter", 30).value(), 70);
+    kvs.set("big", std::to_string(LLONG_MAX - 1));
+    EXPECT_EQ(kvs.incrby("big", 1).value(), LLONG_MAX);
+    EXPECT_FALSE(kvs.incrby("big", 1).has_value());
+    EXPECT_EQ(kvs.get("big").value(), std::to_string(LLONG_MAX));
+    EXPECT_FALSE(kvs.decrby("meter", LLONG_MIN).has_value());
+}
+
+// Test case for INCRBYFLOAT and its interaction with integer values
+TEST_F(KeyValueStoreTest, IncrByFloat) {
+    EXPECT_DOUBLE_EQ(kvs.incrbyfloat("temp", 1.5).value(), 1.5);
+    EXPECT_DOUBLE_EQ(kvs.incrbyfloat("temp", 0.25).value(), 1.75);
+    EXPECT_EQ(kvs.get("temp").value(), "1.75");
+    EXPECT_FALSE(kvs.incr("temp").has_value());
+
+    kvs.incrby("n", 2);
+    EXPECT_DOUBLE_EQ(kvs.incrbyfloat("n", 0.5).value(), 2.5);
+    kvs.set("s", "not a number");
+    EXPECT_FALSE(kvs.incrbyfloat("s", 1.0).has_value());
+}
+
+// Test case for a binary snapshot round trip of every value type
+TEST_F(KeyValueStoreTest, BinarySnapshotRoundTrip) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_roundtrip.snap").string();
+    kvs.set("name", "Nikhil");
+    kvs.set("session", "abc", 60000);
+    kvs.incrby("counter", -42);
+    kvs.incrbyfloat("ratio", 0.125);
+    for (int i = 0; i < 5000; ++i) {
+        kvs.set("bulk" + std::to_string(i), std::string(i % 50, 'x'));
+    }
+    ASSERT_TRUE(kvs.save(path, SnapshotFormat::Binary));
+
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(path));
+    EXPECT_EQ(restored.count(), kvs.count());
+    EXPECT_EQ(restored.get("name").value(), "Nikhil");
+    EXPECT_EQ(restored.get("session").value(), "abc");
+    EXPECT_EQ(restored.get("counter").value(), "-42");
+    EXPECT_EQ(restored.get("ratio").value(), "0.125");
+    EXPECT_EQ(restored.incr("counter").value(), -41);
+    EXPECT_EQ(restored.get("bulk4999").value(), std::string(4999 % 50, 'x'));
+    std::filesystem::remove(path);
+}
+
+// Test case for a damaged snapshot block being skipped, and JSON still loading
+TEST_F(KeyValueStoreTest, SnapshotCorruptionAndJsonFallback) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_corrupt.snap").string();
+    kvs.set("only", "entry");
+    ASSERT_TRUE(kvs.save(path, SnapshotFormat::Binary));
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(30); // Inside the first block payload
+        file.put('#');
+    }
+    KeyValueStore damaged;
+    EXPECT_TRUE(damaged.load(path));
+    EXPECT_EQ(damaged.count(), 0);
+
+    ASSERT_TRUE(kvs.save(path, SnapshotFormat::Json));
+    KeyValueStore from_json;
+    ASSERT_TRUE(from_json.load(path));
+    EXPECT_EQ(from_json.get("only").value(), "entry");
+    std::filesystem::remove(path);
+}
+
+// Test case for replaying the write-ahead log after an unclean shutdown
+TEST_F(KeyValueStoreTest, WriteAheadLogReplay) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_replay.log").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+        store.set("name", "Nikhil");
+        store.set("gone", "soon");
+        store.remove("gone");
+        store.incrby("hits", 5);
+        store.decr("hits");
+        store.incrbyfloat("avg", 2.5);
+        store.append("name", "!");
+        store.begin();
+        store.set("trxn", "committed");
+        store.commit();
+        store.begin();
+        store.set("rolled", "back");
+        store.rollback();
+    } // No save(): only the log survives
+
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(recovered.get("name").value(), "Nikhil!");
+    EXPECT_FALSE(recovered.get("gone").has_value());
+    EXPECT_EQ(recovered.get("hits").value(), "4");
+    EXPECT_EQ(recovered.get("avg").value(), "2.5");
+    EXPECT_EQ(recovered.get("trxn").value(), "committed");
+    EXPECT_FALSE(recovered.get("rolled").has_value());
+    std::filesystem::remove(log_path);
+}
+
+// Test case for a transaction being logged, and recovered, as a single record
+TEST_F(KeyValueStoreTest, TransactionLoggedAsOneRecord) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_trxn.log").string();
+    std::filesystem::remove(log_path);
+    uint64_t before, after;
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+        store.set("kept", "1");
+        store.set("doomed", "2");
+        before = store.log_size();
+        store.begin();
+        for (int i = 0; i < 100; ++i) {
+            store.set("t" + std::to_string(i), "v" + std::to_string(i));
+        }
+        store.remove("doomed");
+        store.commit();
+        after = store.log_size();
+    }
+    {
+        std::ifstream log(log_path, std::ios::binary);
+        char frame[4];
+        log.seekg(static_cast<std::streamoff>(before));
+        ASSERT_TRUE(log.read(frame, sizeof(frame)));
+        EXPECT_EQ(before + 8 + get_u32(frame), after);
+    }
+
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(recovered.count(), 101u);
+    EXPECT_EQ(recovered.get("t99").value(), "v99");
+    EXPECT_FALSE(recovered.get("doomed").has_value());
+
+    // Torn anywhere inside the record, none of the transaction is applied
+    std::filesystem::resize_file(log_path, after - (after - before) / 2);
+    KeyValueStore torn;
+    ASSERT_TRUE(torn.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(torn.count(), 2u);
+    EXPECT_EQ(torn.get("doomed").value(), "2");
+    EXPECT_FALSE(torn.get("t0").has_value());
+    std::filesystem::remove(log_path);
+}
+
+// Test case for a transaction too large for one log record being refused
+TEST_F(KeyValueStoreTest, OversizedTransactionRefused) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_trxn_big.log").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+        store.set("before", "1");
+        const std::string value(1024 * 1024, 'v');
+        store.begin();
+        for (int i = 0; i < 260; ++i) {
+            store.set("big" + std::to_string(i), value);
+        }
+        testing::internal::CaptureStdout();
+        testing::internal::CaptureStderr();
+        store.commit();
+        EXPECT_NE(testing::internal::GetCapturedStdout().find("too large"), std::string::npos);
+        EXPECT_NE(testing::internal::GetCapturedStderr().find("Not logging a record"), std::string::npos);
+        EXPECT_FALSE(store.get("big0").has_value());
+        store.set("after", "2");
+    }
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(recovered.count(), 2u);
+    EXPECT_EQ(recovered.get("after").value(), "2");
+    std::filesystem::remove(log_path);
+}
+
+// Test case for a version 1 log being replayed and upgraded before it is appended to
+TEST_F(KeyValueStoreTest, OlderLogVersionUpgraded) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_v1.log").string();
+    {
+        LogRecord record;
+        record.key = "old";
+        record.value.data = std::string("1");
+        std::string header("IMKVSLOG", 8);
+        put_u32(header, 1);
+        std::ofstream log(log_path, std::ios::binary | std::ios::trunc);
+        log << header << WriteAheadLog::encode(record);
+    }
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+        EXPECT_EQ(store.get("old").value(), "1");
+        store.set("new", "2");
+    }
+    {
+        std::ifstream log(log_path, std::ios::binary);
+        char header[12];
+        ASSERT_TRUE(log.read(header, sizeof(header)));
+        EXPECT_EQ(get_u32(header + 8), 2u);
+    }
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(recovered.count(), 2u);
+    std::filesystem::remove(log_path);
+}
+
+// Test case for a failed log write being reported instead of acknowledged
+TEST_F(KeyValueStoreTest, FailedLogWriteRefused) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_failed.log").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+        store.set("kept", "1");
+        EXPECT_FALSE(store.write_failed());
+
+        // Writes past the file size limit fail with EFBIG, as on a full disk
+        struct rlimit saved;
+        ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &saved), 0);
+        struct rlimit limit = saved;
+        limit.rlim_cur = store.log_size();
+        auto handler = std::signal(SIGXFSZ, SIG_IGN);
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+        store.set("lost", "2");
+        const bool lost_failed = store.write_failed();
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &saved), 0);
+        std::signal(SIGXFSZ, handler);
+        EXPECT_TRUE(lost_failed);
+
+        // Nothing more is taken on
+        store.set("refused", "3");
+        EXPECT_TRUE(store.write_failed());
+        EXPECT_FALSE(store.get("refused").has_value());
+        EXPECT_FALSE(store.incr("kept").has_value());
+        EXPECT_TRUE(store.write_failed());
+        EXPECT_FALSE(store.rewrite_log());
+    }
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(recovered.count(), 1u);
+    EXPECT_EQ(recovered.get("kept").value(), "1");
+    std::filesystem::remove(log_path);
+}
+
+// Test case for a torn log tail being cut off and a checkpoint emptying the log
+TEST_F(KeyValueStoreTest, WriteAheadLogTornTailAndCheckpoint) {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string log_path = (dir / "imkvs_torn.log").string();
+    const std::string snap_path = (dir / "imkvs_torn.snap").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::EverySec));
+        store.set("a", "1");
+        store.set("b", "2");
+    }
+    {
+        std::ofstream log(log_path, std::ios::binary | std::ios::app);
+        log.write("\x20\x00\x00\x00garbage", 11);
+    }
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::EverySec));
+        EXPECT_EQ(store.count(), 2);
+        store.set("c", "3");
+    }
+    KeyValueStore store;
+    ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::EverySec));
+    EXPECT_EQ(store.get("c").value(), "3");
+
+    ASSERT_TRUE(store.checkpoint(snap_path));
+    EXPECT_EQ(std::filesystem::file_size(log_path), 12);
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(snap_path));
+    ASSERT_TRUE(restored.open_log(log_path, FsyncPolicy::EverySec));
+    EXPECT_EQ(restored.count(), 3);
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(snap_path);
+}
+
+// Test case for compacting the log while writes keep arriving
+TEST_F(KeyValueStoreTest, LogRewriteKeepsState) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_rewrite.log").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::No));
+        for (int i = 0; i < 2000; ++i) {
+            store.incr("hits" + std::to_string(i % 4));
+        }
+        store.set("gone", "soon");
+        store.remove("gone");
+        store.set("expired", "soon", 1);
+        store.begin();
+        store.set("trxn", "committed");
+        store.incrbyfloat("avg", 1.5);
+        store.commit();
+        uint64_t before = store.log_size();
+
+        std::thread writer([&] {
+            for (int i = 0; i < 100; ++i) {
+                store.incr("during");
+            }
+        });
+        ASSERT_TRUE(store.rewrite_log());
+        writer.join();
+        store.set("after", "rewrite");
+        EXPECT_LT(store.log_size(), before / 4);
+    }
+
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    for (int k = 0; k < 4; ++k) {
+        EXPECT_EQ(recovered.get("hits" + std::to_string(k)).value(), "500");
+    }
+    EXPECT_FALSE(recovered.get("gone").has_value());
+    EXPECT_FALSE(recovered.get("expired").has_value());
+    EXPECT_EQ(recovered.get("trxn").value(), "committed");
+    EXPECT_EQ(recovered.get("avg").value(), "1.5");
+    EXPECT_EQ(recovered.get("during").value(), "100");
+    EXPECT_EQ(recovered.get("after").value(), "rewrite");
+
+    // Automatic rewrites kick in once the log has doubled
+    recovered.set_log_rewrite(100, 16 * 1024);
+    for (int i = 0; i < 5000; ++i) {
+        recovered.incr("hits0");
+    }
+    // Records that arrived during a rewrite are checked on the next write
+    for (int wait = 0; wait < 200 && recovered.log_size() > 16 * 1024; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        recovered.set("nudge", std::to_string(wait));
+    }
+    EXPECT_LT(recovered.log_size(), 16 * 1024);
+    EXPECT_EQ(recovered.get("hits0").value(), "5500");
+    std::filesystem::remove(log_path);
+}
+
+// Test case for compacting an LZ4-compressed log
+TEST_F(KeyValueStoreTest, LogRewriteLz4) {
+    const std::string log_path = (std::filesystem::temp_directory_path() / "imkvs_rewrite_lz4.log").string();
+    std::filesystem::remove(log_path);
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::No, Compression::Lz4));
+        for (int i = 0; i < 5000; ++i) {
+            store.set("key" + std::to_string(i), "value" + std::string(100, 'x'));
+        }
+        ASSERT_TRUE(store.rewrite_log());
+        store.set("after", "rewrite");
+    }
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No, Compression::Lz4));
+    EXPECT_EQ(recovered.count(), 5001u);
+    EXPECT_EQ(recovered.get("key4999").value(), "value" + std::string(100, 'x'));
+    EXPECT_EQ(recovered.get("after").value(), "rewrite");
+    std::filesystem::remove(log_path);
+}
+
+// Test case for replaying a log across partitions on top of a lazily loaded snapshot
+TEST_F(KeyValueStoreTest, ParallelLogReplay) {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string log_path = (dir / "imkvs_parallel.log").string();
+    const std::string snap_path = (dir / "imkvs_parallel.snap").string();
+    std::filesystem::remove(log_path);
+    const int keys = 30000;
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::No));
+        for (int i = 0; i < keys; ++i) {
+            store.set("k" + std::to_string(i), "base");
+        }
+        ASSERT_TRUE(store.checkpoint(snap_path));
+        for (int i = 0; i < keys; ++i) {
+            const std::string key = "k" + std::to_string(i);
+            if (i % 3 == 0) {
+                store.remove(key);
+            } else if (i % 3 == 1) {
+                store.set(key, "first");
+                store.set(key, "second");
+            }
+            store.incr("c" + std::to_string(i % 100));
+        }
+        store.begin();
+        store.set("k2", "in-trxn");
+        store.remove("k4");
+        store.commit();
+    }
+
+    KeyValueStore recovered;
+    recovered.set_replay_threads(4);
+    recovered.set_lazy_load(true, false);
+    ASSERT_TRUE(recovered.load(snap_path));
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    // Only the keys the log never touched are still cold
+    EXPECT_EQ(recovered.lazy_entries(), keys / 3 - 1);
+    EXPECT_EQ(recovered.count(), keys / 3 * 2 - 1 + 100);
+    for (int i = 5; i < keys; ++i) {
+        auto value = recovered.get("k" + std::to_string(i));
+        if (i % 3 == 0) {
+            ASSERT_FALSE(value.has_value()) << i;
+        } else {
+            ASSERT_EQ(value.value(), i % 3 == 1 ? "second" : "base") << i;
+        }
+    }
+    EXPECT_EQ(recovered.get("k2").value(), "in-trxn");
+    EXPECT_FALSE(recovered.get("k4").has_value());
+    EXPECT_EQ(recovered.get("c7").value(), std::to_string(keys / 100));
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(snap_path);
+}
+
+// Test case for writing snapshots and the log through each I/O backend
+TEST_F(KeyValueStoreTest, IoBackendsRoundTrip) {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string path = (dir / "imkvs_io.bin").string();
+    const std::string snap_path = (dir / "imkvs_io.snap").string();
+    const std::string log_path = (dir / "imkvs_io.log").string();
+    for (IoBackend backend : {IoBackend::Uring, IoBackend::Threads}) {
+        // Several times the two 4 KiB buffers, ending in the middle of one
+        std::string expected;
+        {
+            AsyncFileBuf buffer(backend, 4096, 2);
+            ASSERT_TRUE(buffer.open(path));
+            std::ostream out(&buffer);
+            for (int i = 0; i < 10000; ++i) {
+                out << i << ',';
+                expected += std::to_string(i) + ',';
+            }
+            ASSERT_TRUE(buffer.close());
+        }
+        std::ifstream in(path, std::ios::binary);
+        std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(written, expected) << io_backend_name(backend);
+
+        std::filesystem::remove(log_path);
+        {
+            KeyValueStore store;
+            store.set_io_backend(backend);
+            ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::Always));
+            for (int i = 0; i < 1000; ++i) {
+                store.set("key" + std::to_string(i), "value" + std::to_string(i));
+            }
+            ASSERT_TRUE(store.checkpoint(snap_path));
+            store.set("after", "checkpoint");
+        }
+        KeyValueStore restored;
+        ASSERT_TRUE(restored.load(snap_path));
+        ASSERT_TRUE(restored.open_log(log_path, FsyncPolicy::No));
+        EXPECT_EQ(restored.count(), 1001) << io_backend_name(backend);
+        EXPECT_EQ(restored.get("key999").value(), "value999");
+        EXPECT_EQ(restored.get("after").value(), "checkpoint");
+    }
+    std::filesystem::remove(path);
+    std::filesystem::remove(snap_path);
+    std::filesystem::remove(log_path);
+}
+
+// Test case for snapshots staying point-in-time while writers keep going
+TEST_F(KeyValueStoreTest, SnapshotIsPointInTimeDuringWrites) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_pit.snap").string();
+    const int keys = 20000;
+    for (int i = 0; i < keys; ++i) {
+        kvs.set("k" + std::to_string(i), "0");
+    }
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        // Each commit flips every key at once, so a consistent snapshot
+        // never mixes two rounds.
+        for (int round = 1; !done; ++round) {
+            kvs.begin();
+            for (int i = 0; i < keys; ++i) {
+                kvs.set("k" + std::to_string(i), std::to_string(round));
+            }
+            kvs.commit();
+        }
+    });
+    for (int attempt = 0; attempt < 5; ++attempt) {
+        ASSERT_TRUE(kvs.save(path));
+        KeyValueStore restored;
+        ASSERT_TRUE(restored.load(path));
+        ASSERT_EQ(restored.count(), keys);
+        const std::string first = restored.get("k0").value();
+        for (int i = 1; i < keys; ++i) {
+            ASSERT_EQ(restored.get("k" + std::to_string(i)).value(), first);
+        }
+    }
+    done = true;
+    writer.join();
+    std::filesystem::remove(path);
+}
+
+// Test case for a background checkpoint with the log carrying later writes
+TEST_F(KeyValueStoreTest, BackgroundCheckpointAndLogArchive) {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string log_path = (dir / "imkvs_bg.log").string();
+    const std::string snap_path = (dir / "imkvs_bg.snap").string();
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(WriteAheadLog::archive_path(log_path));
+    {
+        KeyValueStore store;
+        ASSERT_TRUE(store.open_log(log_path, FsyncPolicy::EverySec));
+        for (int i = 0; i < 1000; ++i) {
+            store.set("before" + std::to_string(i), "x");
+        }
+        ASSERT_TRUE(store.save_background(snap_path));
+        store.set("after", "y");
+        store.wait_for_background_save();
+        EXPECT_FALSE(std::filesystem::exists(WriteAheadLog::archive_path(log_path)));
+    }
+    {
+        KeyValueStore recovered;
+        ASSERT_TRUE(recovered.load(snap_path));
+        ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::EverySec));
+        EXPECT_EQ(recovered.count(), 1001);
+        EXPECT_EQ(recovered.get("after").value(), "y");
+    }
+
+    // A snapshot that never finished leaves its records in the archive.
+    {
+        WriteAheadLog log(log_path, FsyncPolicy::No);
+        LogRecord record;
+        record.key = "archived";
+        record.value = {std::string("1"), -1};
+        log.append(record);
+        ASSERT_TRUE(log.rotate());
+        // A second one appends to the archive rather than replacing it
+        record.key = "archived_later";
+        log.append(record);
+        ASSERT_TRUE(log.rotate());
+        EXPECT_EQ(log.size(), 12u);
+        record.key = "live";
+        log.append(record);
+    }
+    KeyValueStore recovered;
+    ASSERT_TRUE(recovered.open_log(log_path, FsyncPolicy::No));
+    EXPECT_TRUE(recovered.get("archived").has_value());
+    EXPECT_TRUE(recovered.get("archived_later").has_value());
+    EXPECT_TRUE(recovered.get("live").has_value());
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(WriteAheadLog::archive_path(log_path));
+    std::filesystem::remove(snap_path);
+}
+
+// Test case for the streamed JSON format round trip, including escaped keys
+TEST_F(KeyValueStoreTest, JsonSnapshotRoundTrip) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_stream.json").string();
+    kvs.set("quote\"key", "line1\nline2");
+    kvs.incrby("count", 7);
+    kvs.incrbyfloat("ratio", 0.1);
+    ASSERT_TRUE(kvs.save(path, SnapshotFormat::Json));
+
+    std::ifstream file(path);
+    json parsed = json::parse(file); // Still a plain JSON object
+    EXPECT_EQ(parsed.size(), 3);
+    EXPECT_EQ(parsed["count"]["value"]["type"], "integer");
+
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(path));
+    EXPECT_EQ(restored.get("quote\"key").value(), "line1\nline2");
+    EXPECT_EQ(restored.get("count").value(), "7");
+    EXPECT_EQ(restored.get("ratio").value(), "0.1");
+    std::filesystem::remove(path);
+}
+
+// Test case for the streaming JSON loader skipping bad envelopes and rejecting truncated files
+TEST_F(KeyValueStoreTest, JsonStreamingLoadSkipsBadEntries) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_sax.json").string();
+    kvs.set("good", "value");
+    kvs.set("tampered", "original");
+    kvs.incrby("number", 42);
+    ASSERT_TRUE(kvs.save(path, SnapshotFormat::Json));
+
+    json doc;
+    {
+        std::ifstream in(path);
+        doc = json::parse(in);
+    }
+    doc["tampered"]["value"]["data"] = "forged";
+    doc["malformed"] = json::array({1, json::object({{"nested", json::array()}})});
+    doc["no_hash"] = {{"value", doc["good"]["value"]}};
+    std::ofstream(path, std::ios::trunc) << doc.dump(4);
+
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(path));
+    EXPECT_EQ(restored.count(), 2);
+    EXPECT_EQ(restored.get("good").value(), "value");
+    EXPECT_EQ(restored.get("number").value(), "42");
+    EXPECT_FALSE(restored.get("tampered").has_value());
+
+    // A file cut off mid-entry is not valid JSON, so nothing is kept
+    std::string text = doc.dump(4);
+    std::ofstream(path, std::ios::trunc) << text.substr(0, text.size() / 2);
+    KeyValueStore truncated;
+    ASSERT_TRUE(truncated.load(path));
+    EXPECT_EQ(truncated.count(), 0);
+    std::filesystem::remove(path);
+}
+
+// Test case for loading snapshots that span many blocks and batches on the thread pool
+TEST_F(KeyValueStoreTest, ParallelLoadManyBlocks) {
+    const int N = 30000;
+    for (int i = 0; i < N; ++i) {
+        kvs.set("key" + std::to_string(i), "value_" + std::to_string(i) + std::string(16, 'x'));
+    }
+    kvs.incrby("counter", 5);
+
+    for (SnapshotFormat format : {SnapshotFormat::Binary, SnapshotFormat::Json}) {
+        const std::string path = (std::filesystem::temp_directory_path() / "imkvs_parallel.snap").string();
+        ASSERT_TRUE(kvs.save(path, format));
+
+        KeyValueStore restored;
+        restored.set("key0", "stale");
+        restored.set("extra", "kept");
+        ASSERT_TRUE(restored.load(path));
+        EXPECT_EQ(restored.count(), N + 2);
+        EXPECT_EQ(restored.get("extra").value(), "kept");
+        EXPECT_EQ(restored.get("counter").value(), "5");
+        for (int i = 0; i < N; i += 997) {
+            EXPECT_EQ(restored.get("key" + std::to_string(i)).value(), "value_" + std::to_string(i) + std::string(16, 'x'));
+        }
+        std::filesystem::remove(path);
+    }
+}
+
+// Test case for the checksum functions against published test vectors
+TEST_F(KeyValueStoreTest, ChecksumKnownValues) {
+    const std::string check = "123456789";
+    EXPECT_EQ(crc32c(check.data(), check.size()), 0xE3069283u);
+    EXPECT_EQ(crc32c(check.data() + 4, 5, crc32c(check.data(), 4)), 0xE3069283u);
+
+    EXPECT_EQ(xxh64("", 0), 0xEF46DB3751D8E999ull);
+    EXPECT_EQ(xxh64("abc", 3), 0x44BC2CF5AD770999ull);
+    const std::string long_input = "Nobody inspects the spammish repetition";
+    EXPECT_EQ(xxh64(long_input.data(), long_input.size()), 0xFBCEA83C8A378BF1ull);
+
+    unsigned char digest[32];
+    sha256("abc", 3, digest);
+    EXPECT_EQ(digest[0], 0xBA);
+    EXPECT_EQ(digest[31], 0xAD);
+
+    std::string out;
+    append_checksum(ChecksumType::XXH64, "abc", 3, out);
+    EXPECT_EQ(out.size(), checksum_size(ChecksumType::XXH64));
+    EXPECT_TRUE(verify_checksum(ChecksumType::XXH64, "abc", 3, out.data()));
+    EXPECT_FALSE(verify_checksum(ChecksumType::XXH64, "abd", 3, out.data()));
+}
+
+// Test case for binary snapshots under every integrity mode, including salvaging a damaged block
+TEST_F(KeyValueStoreTest, SnapshotIntegrityModes) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_integrity.snap").string();
+    kvs.set("before", "intact");
+    kvs.set("victim", "damaged_value");
+    kvs.incrby("after", 3);
+
+    for (ChecksumType type : {ChecksumType::Crc32c, ChecksumType::XXH64, ChecksumType::Sha256}) {
+        for (bool per_entry : {false, true}) {
+            kvs.set_snapshot_integrity({type, per_entry});
+            ASSERT_TRUE(kvs.save(path, SnapshotFormat::Binary));
+            KeyValueStore restored;
+            ASSERT_TRUE(restored.load(path));
+            EXPECT_EQ(restored.count(), 3);
+            EXPECT_EQ(restored.get("after").value(), "3");
+        }
+    }
+
+    // Flip a byte of one value: the block checksum fails, but the entries
+    // around it still verify on their own
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    size_t pos = bytes.find("damaged_value");
+    ASSERT_NE(pos, std::string::npos);
+    bytes[pos] = 'D';
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << bytes;
+
+    KeyValueStore salvaged;
+    ASSERT_TRUE(salvaged.load(path));
+    EXPECT_EQ(salvaged.count(), 2);
+    EXPECT_EQ(salvaged.get("before").value(), "intact");
+    EXPECT_FALSE(salvaged.get("victim").has_value());
+    std::filesystem::remove(path);
+}
+
+// Test case for every supported SHA-256 backend matching the reference implementation
+TEST_F(KeyValueStoreTest, Sha256BackendsMatchReference) {
+    std::vector<std::string> inputs;
+    for (size_t len = 0; len <= 300; len += (len < 130 ? 1 : 17)) {
+        std::string s(len, '\0');
+        for (size_t i = 0; i < len; ++i) {
+            s[i] = static_cast<char>(i * 7 + len);
+        }
+        inputs.push_back(s);
+    }
+    std::vector<Sha256Message> messages;
+    for (const auto& s : inputs) {
+        messages.push_back({s.data(), s.size()});
+    }
+
+    for (Sha256Backend backend : {Sha256Backend::Scalar, Sha256Backend::ShaNi, Sha256Backend::Avx2}) {
+        if (!sha256_supported(backend)) {
+            continue;
+        }
+        std::vector<unsigned char> digests(32 * messages.size());
+        sha256_many(backend, messages.data(), messages.size(), digests.data());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            EXPECT_EQ(sha256_hex(&digests[32 * i]), picosha2::hash256_hex_string(inputs[i]))
+                << sha256_backend_name(backend) << " with " << inputs[i].size() << " bytes";
+        }
+    }
+
+    unsigned char digest[32];
+    sha256("abc", 3, digest);
+    EXPECT_EQ(sha256_hex(digest), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+// Test case for cached digests being refreshed when entries change between saves
+TEST_F(KeyValueStoreTest, CachedDigestsFollowWrites) {
+    const std::string json_path = (std::filesystem::temp_directory_path() / "imkvs_digest.json").string();
+    kvs.set("stable", "unchanged");
+    kvs.set("changed", "before");
+    kvs.incrby("counter", 1);
+    ASSERT_TRUE(kvs.save(json_path, SnapshotFormat::Json));
+
+    KeyValueStore reloaded;
+    ASSERT_TRUE(reloaded.load(json_path)); // Primes the digests from the file
+    reloaded.set("changed", "after");
+    reloaded.incr("counter");
+    ASSERT_TRUE(reloaded.save(json_path, SnapshotFormat::Json));
+    reloaded.append("changed", "!");
+    ASSERT_TRUE(reloaded.save(json_path, SnapshotFormat::Json));
+
+    // A stale digest would be reported as tampering and the entry dropped
+    KeyValueStore from_json;
+    ASSERT_TRUE(from_json.load(json_path));
+    EXPECT_EQ(from_json.count(), 3);
+    EXPECT_EQ(from_json.get("changed").value(), "after!");
+    EXPECT_EQ(from_json.get("counter").value(), "2");
+    std::filesystem::remove(json_path);
+
+    // Same for per-entry SHA-256 in binary snapshots: damage one entry so the
+    // block fails and every other entry is checked against its own digest
+    const std::string snap_path = (std::filesystem::temp_directory_path() / "imkvs_digest.snap").string();
+    from_json.set_snapshot_integrity({ChecksumType::Sha256, true});
+    from_json.set("victim", "damaged_value");
+    ASSERT_TRUE(from_json.save(snap_path, SnapshotFormat::Binary));
+    from_json.set("changed", "again");
+    from_json.decr("counter");
+    ASSERT_TRUE(from_json.save(snap_path, SnapshotFormat::Binary));
+
+    std::string bytes;
+    {
+        std::ifstream in(snap_path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    size_t pos = bytes.find("damaged_value");
+    ASSERT_NE(pos, std::string::npos);
+    bytes[pos] = 'D';
+    std::ofstream(snap_path, std::ios::binary | std::ios::trunc) << bytes;
+
+    KeyValueStore salvaged;
+    ASSERT_TRUE(salvaged.load(snap_path));
+    EXPECT_EQ(salvaged.count(), 3);
+    EXPECT_EQ(salvaged.get("changed").value(), "again");
+    EXPECT_EQ(salvaged.get("counter").value(), "1");
+    std::filesystem::remove(snap_path);
+}
+
+// Test case for the autosave scheduler and the save statistics
+TEST_F(KeyValueStoreTest, AutosaveAfterChanges) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_autosave.snap").string();
+    std::filesystem::remove(path);
+    EXPECT_EQ(kvs.save_stats().last_save_ms, 0);
+
+    kvs.set_autosave(path, {{0, 3}});
+    kvs.set("a", "1");
+    kvs.set("b", "2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_FALSE(std::filesystem::exists(path)); // Below the threshold
+
+    kvs.set("c", "3");
+    for (int i = 0; i < 50 && kvs.save_stats().last_save_ms == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    kvs.set_autosave(path, {});
+    kvs.wait_for_background_save();
+
+    KeyValueStore::SaveStats stats = kvs.save_stats();
+    EXPECT_NE(stats.last_save_ms, 0);
+    EXPECT_TRUE(stats.last_save_ok);
+    EXPECT_EQ(stats.changes_since_save, 0);
+    EXPECT_FALSE(std::filesystem::exists(path + ".tmp"));
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(path));
+    EXPECT_EQ(restored.count(), 3);
+
+    // A save that cannot be written leaves the previous snapshot untouched
+    std::filesystem::create_directory(path + ".tmp");
+    kvs.set("d", "4");
+    EXPECT_FALSE(kvs.save(path));
+    EXPECT_FALSE(kvs.save_stats().last_save_ok);
+    EXPECT_EQ(kvs.save_stats().changes_since_save, 1);
+    KeyValueStore previous;
+    ASSERT_TRUE(previous.load(path));
+    EXPECT_EQ(previous.count(), 3);
+    std::filesystem::remove(path + ".tmp");
+
+    // Writes that change nothing are not counted: reading a key that has
+    // expired since, removing a missing key, or a failed increment
+    kvs.set("brief", "x", 1);
+    kvs.set("word", "text");
+    kvs.set("top", std::to_string(LLONG_MAX));
+    ASSERT_TRUE(kvs.save(path));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_FALSE(kvs.get("brief").has_value());
+    EXPECT_FALSE(kvs.remove("missing"));
+    EXPECT_FALSE(kvs.incr("word").has_value());
+    EXPECT_FALSE(kvs.incr("top").has_value());
+    EXPECT_FALSE(kvs.incrbyfloat("word", 1.5).has_value());
+    EXPECT_EQ(kvs.save_stats().changes_since_save, 0);
+    std::filesystem::remove(path);
+}
+
+// Test case for delta checkpoints layered on a base and replayed in order
+TEST_F(KeyValueStoreTest, DeltaSnapshotChain) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_delta.snap").string();
+    const std::string delta1 = path + ".delta.1";
+    const std::string delta2 = path + ".delta.2";
+    kvs.set_delta_snapshots(true);
+    for (int i = 0; i < 200; ++i) {
+        kvs.set("key" + std::to_string(i), std::string(32, 'v'));
+    }
+    ASSERT_TRUE(kvs.checkpoint(path));
+    EXPECT_FALSE(std::filesystem::exists(delta1));
+
+    kvs.set("key1", "changed");
+    kvs.remove("key2");
+    kvs.set("fresh", "new");
+    ASSERT_TRUE(kvs.checkpoint(path));
+    ASSERT_TRUE(std::filesystem::exists(delta1));
+    EXPECT_LT(std::filesystem::file_size(delta1), std::filesystem::file_size(path) / 10);
+
+    kvs.remove("fresh");
+    kvs.set("key3", "again");
+    ASSERT_TRUE(kvs.checkpoint(path));
+    ASSERT_TRUE(std::filesystem::exists(delta2));
+
+    KeyValueStore restored;
+    restored.set_delta_snapshots(true);
+    ASSERT_TRUE(restored.load(path));
+    EXPECT_EQ(restored.count(), 199);
+    EXPECT_EQ(restored.get("key1").value(), "changed");
+    EXPECT_FALSE(restored.get("key2").has_value());
+    EXPECT_FALSE(restored.get("fresh").has_value());
+    EXPECT_EQ(restored.get("key3").value(), "again");
+
+    // The restored store keeps extending the same chain
+    restored.set("key4", "restored");
+    ASSERT_TRUE(restored.checkpoint(path));
+    ASSERT_TRUE(std::filesystem::exists(path + ".delta.3"));
+    KeyValueStore reloaded;
+    ASSERT_TRUE(reloaded.load(path));
+    EXPECT_EQ(reloaded.get("key4").value(), "restored");
+    EXPECT_EQ(reloaded.count(), 199);
+
+    // Deltas left over from another base are ignored
+    std::filesystem::copy_file(path + ".delta.3", (std::filesystem::temp_directory_path() / "imkvs_stale.delta").string(),
+                               std::filesystem::copy_options::overwrite_existing);
+    restored.set_delta_snapshots(true, 0); // Forces the next checkpoint to compact the chain
+    ASSERT_TRUE(restored.checkpoint(path));
+    EXPECT_FALSE(std::filesystem::exists(delta1));
+    std::filesystem::rename((std::filesystem::temp_directory_path() / "imkvs_stale.delta").string(), delta1);
+    KeyValueStore compacted;
+    ASSERT_TRUE(compacted.load(path));
+    EXPECT_EQ(compacted.count(), 199);
+    EXPECT_EQ(compacted.get("key4").value(), "restored");
+    EXPECT_EQ(compacted.get("key3").value(), "again");
+    std::filesystem::remove(delta1);
+    std::filesystem::remove(path);
+}
+
+// Test case for the LZ4 block codec, including a block built by hand from the format spec
+TEST_F(KeyValueStoreTest, Lz4BlockCodec) {
+    const std::string known("\x36" "abc" "\x03\x00" "\x50" "bcabc", 12);
+    std::string decoded(18, '\0');
+    ASSERT_TRUE(lz4_decompress(known.data(), known.size(), &decoded[0], decoded.size()));
+    EXPECT_EQ(decoded, "abcabcabcabcabcabc");
+    EXPECT_FALSE(lz4_decompress(known.data(), known.size() - 1, &decoded[0], decoded.size()));
+    EXPECT_FALSE(lz4_decompress(known.data(), known.size(), &decoded[0], decoded.size() - 1));
+
+    std::string noise;
+    unsigned state = 12345;
+    for (int i = 0; i < 70000; ++i) {
+        state = state * 1103515245u + 12345u;
+        noise.push_back(static_cast<char>(state >> 16));
+    }
+    std::string entries;
+    for (int i = 0; i < 5000; ++i) {
+        entries += "{\"key\":\"user:" + std::to_string(i) + "\",\"expiration_time_ms\":-1,\"type\":\"string\"}\n";
+    }
+    for (const std::string& input : {std::string(), std::string("x"), std::string("abcdefghijklm"),
+                                     std::string(100000, 'z'), noise, entries}) {
+        std::string packed;
+        lz4_compress(input.data(), input.size(), packed);
+        std::string output(input.size(), '\0');
+        ASSERT_TRUE(lz4_decompress(packed.data(), packed.size(), &output[0], output.size()));
+        EXPECT_EQ(output, input);
+        if (input.size() > 1000 && input != noise) {
+            EXPECT_LT(packed.size(), input.size() / 4);
+        }
+        for (size_t cut = 0; cut < packed.size(); cut += 1 + packed.size() / 7) {
+            EXPECT_FALSE(lz4_decompress(packed.data(), cut, &output[0], output.size()) && !input.empty());
+        }
+    }
+}
+
+// Test case for compressed snapshots and a compressed write-ahead log
+TEST_F(KeyValueStoreTest, CompressedSnapshotAndLog) {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string plain_path = (dir / "imkvs_plain.snap").string();
+    const std::string lz4_path = (dir / "imkvs_lz4.snap").string();
+    const std::string log_path = (dir / "imkvs_lz4.log").string();
+    std::filesystem::remove(log_path);
+    for (int i = 0; i < 20000; ++i) {
+        kvs.set("session:" + std::to_string(i), "{\"user\":\"" + std::to_string(i % 100) + "\",\"active\":true}");
+    }
+    kvs.incrby("counter", 42);
+    ASSERT_TRUE(kvs.save(plain_path));
+    kvs.set_snapshot_compression(Compression::Lz4);
+    ASSERT_TRUE(kvs.save(lz4_path));
+    EXPECT_LT(std::filesystem::file_size(lz4_path) * 2, std::filesystem::file_size(plain_path));
+
+    KeyValueStore restored;
+    ASSERT_TRUE(restored.load(lz4_path));
+    EXPECT_EQ(restored.count(), 20001);
+    EXPECT_EQ(restored.get("session:1234").value(), "{\"user\":\"34\",\"active\":true}");
+    EXPECT_EQ(restored.get("counter").value(), "42");
+
+    {
+        KeyValueStore logged;
+        ASSERT_TRUE(logged.open_log(log_path, FsyncPolicy::No, Compression::Lz4));
+        logged.begin();
+        for (int i = 0; i < 2000; ++i) {
+            logged.set("trxn:" + std::to_string(i), std::string(50, 'x'));
+        }
+        logged.commit();
+        for (int i = 0; i < 2000; ++i) {
+            logged.set("plain:" + std::to_string(i), std::string(50, 'y'));
+        }
+        logged.remove("plain:7");
+    }
+    KeyValueStore replayed;
+    ASSERT_TRUE(replayed.open_log(log_path, FsyncPolicy::No));
+    EXPECT_EQ(replayed.count(), 3999);
+    EXPECT_EQ(replayed.get("trxn:1999").value(), std::string(50, 'x'));
+    EXPECT_FALSE(replayed.get("plain:7").has_value());
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(plain_path);
+    std::filesystem::remove(lz4_path);
+}
+
+// Test case for lazily loading a memory-mapped snapshot
+TEST_F(KeyValueStoreTest, LazyMappedLoad) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_lazy.snap").string();
+    for (int i = 0; i < 5000; ++i) {
+        kvs.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    kvs.incrby("counter", 7);
+    kvs.set("short-lived", "gone", 1);
+    kvs.set_snapshot_integrity({ChecksumType::Sha256, true});
+    kvs.set_snapshot_compression(Compression::Lz4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_TRUE(kvs.save(path));
+
+    KeyValueStore lazy;
+    lazy.set_lazy_load(true, false);
+    ASSERT_TRUE(lazy.load(path));
+    EXPECT_EQ(lazy.count(), 5001);
+    EXPECT_EQ(lazy.lazy_entries(), 5001);
+    EXPECT_EQ(lazy.get("key42").value(), "value42");
+    EXPECT_EQ(lazy.lazy_entries(), 5000);
+    EXPECT_EQ(lazy.incrby("counter", 1).value(), 8);
+    EXPECT_TRUE(lazy.remove("key43"));
+    lazy.set("key44", "overwritten");
+    EXPECT_EQ(lazy.count(), 5000);
+    EXPECT_EQ(lazy.lazy_entries(), 4997);
+
+    // Saving includes the keys that are still cold without decoding them for good
+    const std::string copy_path = path + ".copy";
+    ASSERT_TRUE(lazy.save(copy_path));
+    EXPECT_EQ(lazy.lazy_entries(), 4997);
+    KeyValueStore eager;
+    ASSERT_TRUE(eager.load(copy_path));
+    EXPECT_EQ(eager.count(), 5000);
+    EXPECT_EQ(eager.get("key4999").value(), "value4999");
+    EXPECT_EQ(eager.get("key44").value(), "overwritten");
+    EXPECT_FALSE(eager.get("key43").has_value());
+    EXPECT_EQ(eager.get("counter").value(), "8");
+
+    // The background migration decodes everything that is left
+    KeyValueStore migrated;
+    migrated.set_lazy_load(true);
+    ASSERT_TRUE(migrated.load(path));
+    for (int i = 0; i < 100 && migrated.lazy_entries() > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    EXPECT_EQ(migrated.lazy_entries(), 0);
+    EXPECT_EQ(migrated.count(), 5001);
+    EXPECT_EQ(migrated.get("key1234").value(), "value1234");
+    std::filesystem::remove(path);
+    std::filesystem::remove(copy_path);
+}
+
+// Test case for deferred verification quarantining a damaged block on access and in the background
+TEST_F(KeyValueStoreTest, LazyVerificationQuarantine) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_lazy_verify.snap").string();
+    auto corrupt = [&](const std::string& needle) {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t at = contents.find(needle);
+        ASSERT_NE(at, std::string::npos);
+        file.seekp(static_cast<std::streamoff>(at));
+        file.put('X');
+    };
+    for (int i = 0; i < 2000; ++i) {
+        kvs.set("key" + std::to_string(i), "payload" + std::to_string(i) + std::string(200, '.'));
+    }
+    ASSERT_TRUE(kvs.save(path));
+    corrupt("payload1500");
+    // Snapshots are written partition by partition, so a key from a distant
+    // partition is in another block
+    const auto partition = [](const std::string& key) {
+        return static_cast<int>(MerkleTree::leaf_of(key) / (MerkleTree::LEAF_COUNT / KeyValueStore::PARTITION_COUNT));
+    };
+    int intact = 0;
+    while (std::abs(partition("key" + std::to_string(intact)) - partition("key1500")) < 24) {
+        ++intact;
+    }
+    const std::string intact_key = "key" + std::to_string(intact);
+    const std::string intact_value = "payload" + std::to_string(intact) + std::string(200, '.');
+
+    KeyValueStore on_access;
+    on_access.set_lazy_load(true, false, true);
+    ASSERT_TRUE(on_access.load(path));
+    EXPECT_EQ(on_access.count(), 2000); // Nothing was verified yet
+    EXPECT_EQ(on_access.get(intact_key).value(), intact_value);
+    EXPECT_FALSE(on_access.get("key1500").has_value());
+    const std::vector<std::string> held = on_access.quarantined();
+    EXPECT_NE(std::find(held.begin(), held.end(), "key1500"), held.end());
+
+    KeyValueStore background;
+    background.set_lazy_load(true, false, true);
+    ASSERT_TRUE(background.load(path));
+    for (int i = 0; i < 100 && background.quarantined().empty(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    const size_t lost = background.quarantined().size();
+    EXPECT_GT(lost, 1u); // The whole block
+    EXPECT_EQ(background.count(), 2000 - lost);
+    EXPECT_EQ(background.get(intact_key).value(), intact_value);
+
+    // Saving quarantines the damaged entries it meets; writing a key, or
+    // removing it, releases it
+    KeyValueStore saving;
+    saving.set_lazy_load(true, false, true);
+    ASSERT_TRUE(saving.load(path));
+    ASSERT_TRUE(saving.save(path + ".copy"));
+    std::vector<std::string> skipped = saving.quarantined();
+    ASSERT_NE(std::find(skipped.begin(), skipped.end(), "key1500"), skipped.end());
+    EXPECT_EQ(saving.count(), 2000 - skipped.size());
+    saving.set("key1500", "rewritten");
+    ASSERT_GT(skipped.size(), 1u);
+    saving.remove(skipped.back() == "key1500" ? skipped.front() : skipped.back());
+    EXPECT_EQ(saving.quarantined().size(), skipped.size() - 2);
+    std::filesystem::remove(path + ".copy");
+
+    // With per-entry checksums only the damaged entry is lost
+    kvs.set_snapshot_integrity({ChecksumType::XXH64, true});
+    ASSERT_TRUE(kvs.save(path));
+    corrupt("payload1500");
+    KeyValueStore per_entry;
+    per_entry.set_lazy_load(true, true, true);
+    ASSERT_TRUE(per_entry.load(path));
+    for (int i = 0; i < 100 && per_entry.lazy_entries() > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    EXPECT_EQ(per_entry.count(), 1999);
+    EXPECT_EQ(per_entry.quarantined(), std::vector<std::string>{"key1500"});
+    std::filesystem::remove(path);
+}
+
+// Test case for narrowing two stores down to the keys they differ in with Merkle trees
+TEST_F(KeyValueStoreTest, MerkleDiffFindsChangedKeys) {
+    KeyValueStore replica;
+    for (int i = 0; i < 5000; ++i) {
+        kvs.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    for (int i = 4999; i >= 0; --i) {
+        replica.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    EXPECT_EQ(kvs.merkle_tree().root(), replica.merkle_tree().root()); // Insertion order does not matter
+
+    replica.set("key17", "changed");
+    replica.remove("key2500");
+    replica.set("extra", "value");
+    replica.set("key4000", "value4000", 60000); // Same value, different expiration
+    const std::vector<std::string> changed = {"extra", "key17", "key2500", "key4000"};
+
+    const MerkleTree a = kvs.merkle_tree();
+    const MerkleTree b = replica.merkle_tree();
+    EXPECT_NE(a.root(), b.root());
+    EXPECT_EQ(a.entries(MerkleTree::leaf_of("key2500")), b.entries(MerkleTree::leaf_of("key2500")) + 1);
+    const std::vector<uint32_t> leaves = MerkleTree::diff(a, b);
+    EXPECT_LE(leaves.size(), changed.size());
+    const auto mine = kvs.leaf_entries(leaves);
+    const auto theirs = replica.leaf_entries(leaves);
+    EXPECT_LT(mine.size(), 100u); // Just the differing leaves
+    KeyValueStore::LeafEntries only;
+    std::set_symmetric_difference(mine.begin(), mine.end(), theirs.begin(), theirs.end(), std::back_inserter(only));
+    std::vector<std::string> found;
+    for (const auto& entry : only) {
+        found.push_back(entry.first);
+    }
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    EXPECT_EQ(found, changed);
+
+    // A snapshot carries the same tree, and a lazy load rebuilds it from cold entries
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_merkle.snap").string();
+    kvs.set_snapshot_integrity({ChecksumType::Crc32c, false, true});
+    ASSERT_TRUE(kvs.save(path));
+    MerkleTree saved;
+    std::string error;
+    ASSERT_TRUE(MerkleTree::read(path, saved, error)) << error;
+    EXPECT_EQ(saved.root(), a.root());
+    KeyValueStore lazy;
+    lazy.set_lazy_load(true, false);
+    ASSERT_TRUE(lazy.load(path));
+    EXPECT_EQ(lazy.merkle_tree().root(), a.root());
+    EXPECT_EQ(lazy.lazy_entries(), 5000u);
+    std::filesystem::remove(path);
+}
+
+// Test case for reporting entries lost from a snapshot against its Merkle manifest
+TEST_F(KeyValueStoreTest, MerkleManifestDetectsLostEntries) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_merkle_lost.snap").string();
+    for (int i = 0; i < 2000; ++i) {
+        kvs.set("key" + std::to_string(i), "payload" + std::to_string(i) + std::string(200, '.'));
+    }
+    kvs.set_snapshot_integrity({ChecksumType::Crc32c, false, true});
+    ASSERT_TRUE(kvs.save(path));
+
+    testing::internal::CaptureStderr();
+    KeyValueStore intact;
+    ASSERT_TRUE(intact.load(path));
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+    EXPECT_EQ(intact.count(), 2000u);
+
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t at = contents.find("payload1500");
+        ASSERT_NE(at, std::string::npos);
+        file.seekp(static_cast<std::streamoff>(at));
+        file.put('X');
+    }
+    testing::internal::CaptureStderr();
+    KeyValueStore damaged;
+    ASSERT_TRUE(damaged.load(path));
+    const std::string messages = testing::internal::GetCapturedStderr();
+    const size_t lost = 2000 - damaged.count();
+    EXPECT_GT(lost, 1u); // The whole block
+    EXPECT_NE(messages.find("does not match its Merkle manifest"), std::string::npos) << messages;
+    EXPECT_NE(messages.find(std::to_string(lost) + " entries missing"), std::string::npos) << messages;
+
+    MerkleTree saved;
+    std::string error;
+    ASSERT_TRUE(MerkleTree::read(path, saved, error)) << error;
+    const MerkleTree now = damaged.merkle_tree();
+    uint64_t missing = 0;
+    for (uint32_t leaf : MerkleTree::diff(saved, now)) {
+        missing += saved.entries(leaf) - now.entries(leaf);
+    }
+    EXPECT_EQ(missing, lost);
+    std::filesystem::remove(path);
+}
+
+// Test case for rendering JSON envelopes and reading them back one at a time
+TEST_F(KeyValueStoreTest, JsonEnvelopesRoundTrip) {
+    std::vector<std::pair<std::string, ValueWithTTL>> entries(3);
+    entries[0] = {"text", ValueWithTTL{}};
+    entries[0].second.data = std::string("hello \"world\"");
+    entries[1] = {"count", ValueWithTTL{}};
+    entries[1].second.data = 42LL;
+    entries[1].second.expiration_time_ms = 123456;
+    entries[2] = {"ratio", ValueWithTTL{}};
+    entries[2].second.data = 0.25;
+
+    std::string text = "{";
+    bool first = true;
+    append_envelopes(entries, text, first);
+    text += "\n}\n";
+    EXPECT_FALSE(first);
+
+    auto read_back = [](const std::string& text, std::vector<std::pair<std::string, ValueWithTTL>>& out) {
+        EnvelopeBatch batch;
+        EnvelopeReader reader([&](const std::string& key, json& envelope) { batch.emplace_back(key, std::move(envelope)); });
+        std::istringstream in(text);
+        EXPECT_TRUE(json::sax_parse(in, &reader));
+        std::string messages;
+        return decode_envelopes(batch, out, messages);
+    };
+    std::vector<std::pair<std::string, ValueWithTTL>> decoded;
+    EXPECT_EQ(read_back(text, decoded), 0u);
+    ASSERT_EQ(decoded.size(), 3u);
+    EXPECT_EQ(std::get<std::string>(decoded[0].second.data), "hello \"world\"");
+    EXPECT_EQ(std::get<long long>(decoded[1].second.data), 42);
+    EXPECT_EQ(decoded[1].second.expiration_time_ms, 123456);
+    EXPECT_EQ(std::get<double>(decoded[2].second.data), 0.25);
+    EXPECT_TRUE(decoded[0].second.has_digest(DigestKind::JsonValueSha256));
+
+    // A value that no longer matches its hash is left out
+    text.replace(text.find("42"), 2, "43");
+    decoded.clear();
+    EXPECT_EQ(read_back(text, decoded), 1u);
+    EXPECT_EQ(decoded.size(), 2u);
+}
+
+// Test case for serving a warm-restart image in place and trusting it only once
+TEST_F(KeyValueStoreTest, WarmImageRestart) {
+    const std::string path = (std::filesystem::temp_directory_path() / "imkvs_warm.image").string();
+    for (int i = 0; i < 1000; ++i) {
+        kvs.set("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    kvs.set("counter", "41");
+    kvs.set("gone", "soon", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_TRUE(kvs.save_warm_image(path));
+
+    KeyValueStore restarted;
+    ASSERT_TRUE(restarted.attach_warm_image(path));
+    EXPECT_EQ(restarted.count(), 1001u);
+    EXPECT_EQ(restarted.warm_entries(), 1001u);
+    EXPECT_EQ(restarted.get("key500").value(), "value500");
+    EXPECT_EQ(restarted.incr("counter").value(), 42);
+    EXPECT_FALSE(restarted.get("gone").has_value());
+    EXPECT_TRUE(restarted.remove("key7"));
+    EXPECT_FALSE(restarted.get("key7").has_value());
+    EXPECT_EQ(restarted.warm_entries(), 998u);
+    EXPECT_EQ(restarted.count(), 1000u);
+    kvs.incr("counter");
+    kvs.remove("key7");
+    EXPECT_EQ(restarted.merkle_tree().root(), kvs.merkle_tree().root());
+
+    // The image was marked in use, so without a clean shutdown it is refused
+    testing::internal::CaptureStderr();
+    KeyValueStore crashed;
+    EXPECT_FALSE(crashed.attach_warm_image(path));
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("not shut down cleanly"), std::string::npos);
+    EXPECT_EQ(crashed.count(), 0u);
+    EXPECT_FALSE(crashed.attach_warm_image(path + ".missing"));
+    std::filesystem::remove(path);
+}
+
+// Test case for replaying the log on top of a warm-restart image
+TEST_F(KeyValueStoreTest, WarmImageUnderLog) {
+    const std::string image = (std::filesystem::temp_directory_path() / "imkvs_warm_log.image").string();
+    const std::string log = (std::filesystem::temp_directory_path() / "imkvs_warm_log.log").string();
+    std::filesystem::remove(log);
+    kvs.set("a", "1");
+    kvs.set("b", "2");
+    kvs.set("c", "3");
+    ASSERT_TRUE(kvs.save_warm_image(image));
+    {
+        KeyValueStore writer;
+        ASSERT_TRUE(writer.open_log(log, FsyncPolicy::Always));
+        writer.set("a", "10");
+        writer.set("b", "20");
+        writer.remove("b");
+    }
+
+    KeyValueStore restarted;
+    ASSERT_TRUE(restarted.attach_warm_image(image));
+    ASSERT_TRUE(restarted.open_log(log, FsyncPolicy::Always));
+    EXPECT_EQ(restarted.warm_entries(), 1u);
+    EXPECT_EQ(restarted.count(), 2u);
+    EXPECT_EQ(restarted.get("a").value(), "10");
+    EXPECT_FALSE(restarted.get("b").has_value());
+    EXPECT_EQ(restarted.get("c").value(), "3");
+    EXPECT_EQ(restarted.warm_entries(), 0u);
+    std::filesystem::remove(image);
+    std::filesystem::remove(log);
+}